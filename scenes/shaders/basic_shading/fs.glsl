@@ -1,10 +1,12 @@
-#version 110
+#version 330
 
-varying vec4 frag_position;
-varying vec4 frag_normal;
-varying vec3 frag_albedo;
-varying vec3 frag_coeffs;
+in vec4 frag_position;
+in vec4 frag_normal;
+in vec3 frag_albedo;
+in vec3 frag_coeffs;
+
+layout(location=0) out vec4 color;
 
 void main() {
-    gl_FragColor = frag_normal; 
-}
\ No newline at end of file
+    color = frag_normal; 
+}
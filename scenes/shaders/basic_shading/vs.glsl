@@ -1,4 +1,4 @@
-#version 110
+#version 330
 
 #define MAX_NUM_LIGHTS 8
 
@@ -12,19 +12,22 @@ uniform vec3 light_color[MAX_NUM_LIGHTS];  // emission
 uniform vec3 light_attenutation[MAX_NUM_LIGHTS]; // attenuation coeffs constant, linear, quadratic 
 uniform int num_lights;
 
-attribute vec3 position;
-attribute vec3 normal
-attribute vec3 albedo;
-attribute vec3 coeffs;
+// material, constant per draw
+uniform vec3 albedo;
+uniform vec3 coeffs;
 
-varying vec4 frag_position;
-varying vec3 frag_normal;
-varying vec3 frag_albedo;
-varying vec3 frag_coeffs;
+in vec3 position;
+in vec3 normal;
+
+out vec4 frag_position;
+out vec4 frag_normal;
+out vec3 frag_albedo;
+out vec3 frag_coeffs;
 
 void main() {
     gl_Position = projection * view * model * vec4(position, 1.0);
     frag_position = clamp(gl_Position, 0.0, 1.0);
     frag_albedo = albedo;
-    frag_normal = view * model * vec4(normal, 1.0);
-}
\ No newline at end of file
+    frag_coeffs = coeffs;
+    frag_normal = view * model * vec4(normal, 0.0);
+}
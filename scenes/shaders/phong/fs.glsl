@@ -1,16 +1,41 @@
 #version 330
 
 #define MAX_NUM_LIGHTS 8
+#ifndef MAX_VIEWS
+#define MAX_VIEWS 1
+#endif
 
-uniform vec3 cam_pos;
+// Per frame state, std140 as FrameUniforms in src/scene.h. One matrix of
+// each per view of a batch.
+layout(std140) uniform FrameBlock {
+    vec4 light_pos[MAX_NUM_LIGHTS];
+    vec3 light_color[MAX_NUM_LIGHTS];  // emission
+    vec3 light_attenuation[MAX_NUM_LIGHTS]; // attenuation coeffs constant, linear, quadratic
+    vec3 ambient;
+    vec3 cam_pos;
+    int num_lights;
+    mat4 views[MAX_VIEWS];
+    mat4 projections[MAX_VIEWS];
+    mat4 inv_view_transposes[MAX_VIEWS];
+};
 
-uniform mat4 view;
+#ifndef MERGED_DRAW
+// Per object state, std140 as ObjectUniforms in src/scene.h
+layout(std140) uniform ObjectBlock {
+    mat4 model;
+    mat3 normal_matrix;     // transpose(inverse(mat3(model)))
+    // material, constant per draw
+    vec3 albedo;
+    vec3 coeffs;
+};
+#endif
 
-uniform vec3 ambient;
-uniform vec4 light_pos[MAX_NUM_LIGHTS];
-uniform vec3 light_color[MAX_NUM_LIGHTS];  // emission
-uniform vec3 light_attenuation[MAX_NUM_LIGHTS]; // attenuation coeffs constant, linear, quadratic
-uniform int num_lights;
+#ifdef MULTIVIEW
+flat in int frag_view;
+#define view views[frag_view]
+#else
+#define view views[0]
+#endif
 
 in vec4 frag_position;
 in vec4 frag_normal;
@@ -1,24 +1,58 @@
 #version 330
 
+// MULTIVIEW (with MAX_VIEWS) is defined by the renderer to draw a batch of
+// views in one instanced draw, one view per instance and G-buffer layer.
+// MERGED_DRAW is defined to draw many objects with one multi-draw call.
+#ifdef MULTIVIEW
+#if defined(GL_ARB_shader_viewport_layer_array)
+#extension GL_ARB_shader_viewport_layer_array : require
+#elif defined(GL_AMD_vertex_shader_layer)
+#extension GL_AMD_vertex_shader_layer : require
+#endif
+#endif
+
 #define MAX_NUM_LIGHTS 8
+#ifndef MAX_VIEWS
+#define MAX_VIEWS 1
+#endif
+
+// Per frame state, std140 as FrameUniforms in src/scene.h. One matrix of
+// each per view of a batch.
+layout(std140) uniform FrameBlock {
+    vec4 light_pos[MAX_NUM_LIGHTS];
+    vec3 light_color[MAX_NUM_LIGHTS];  // emission
+    vec3 light_attenuation[MAX_NUM_LIGHTS]; // attenuation coeffs constant, linear, quadratic
+    vec3 ambient;
+    vec3 cam_pos;
+    int num_lights;
+    mat4 views[MAX_VIEWS];
+    mat4 projections[MAX_VIEWS];
+    mat4 inv_view_transposes[MAX_VIEWS];
+};
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform mat4 inv_model_view;
-uniform mat4 inv_model_view_transpose;
-uniform vec3 cam_pos;
+#ifdef MERGED_DRAW
+// The object blocks of all objects as texels of a texture buffer, the
+// draw id selects the object
+in uint draw_id;
+uniform samplerBuffer object_blocks;
+uniform int object_block_texels;   // per object
+#else
+// Per object state, std140 as ObjectUniforms in src/scene.h
+layout(std140) uniform ObjectBlock {
+    mat4 model;
+    mat3 normal_matrix;     // transpose(inverse(mat3(model)))
+    // material, constant per draw
+    vec3 albedo;
+    vec3 coeffs;
+};
+#endif
 
-uniform vec3 ambient;
-uniform vec4 light_pos[MAX_NUM_LIGHTS];
-uniform vec3 light_color[MAX_NUM_LIGHTS];  // emission
-uniform vec3 light_attenuation[MAX_NUM_LIGHTS]; // attenuation coeffs constant, linear, quadratic
-uniform int num_lights;
+#ifdef MULTIVIEW
+flat out int frag_view;
+#endif
 
 in vec3 position;
 in vec3 normal;
-in vec3 albedo;  // vertex color
-in vec3 coeffs;
 
 // fragment params in view space
 out vec4 frag_position;
@@ -28,9 +62,28 @@ out vec3 frag_coeffs;
 
 
 void main() {
+#ifdef MULTIVIEW
+    int v = gl_InstanceID;
+    frag_view = v;
+    gl_Layer = v;
+#else
+    int v = 0;
+#endif
+    mat4 view = views[v];
+    mat4 projection = projections[v];
+    mat4 inv_view_transpose = inv_view_transposes[v];
+#ifdef MERGED_DRAW
+    int block = int(draw_id) * object_block_texels;
+    mat4 model = mat4(texelFetch(object_blocks, block), texelFetch(object_blocks, block + 1),
+        texelFetch(object_blocks, block + 2), texelFetch(object_blocks, block + 3));
+    mat3 normal_matrix = mat3(texelFetch(object_blocks, block + 4).xyz,
+        texelFetch(object_blocks, block + 5).xyz, texelFetch(object_blocks, block + 6).xyz);
+    vec3 albedo = texelFetch(object_blocks, block + 7).xyz;
+    vec3 coeffs = texelFetch(object_blocks, block + 8).xyz;
+#endif
     gl_Position = projection * view * model * vec4(position, 1.0);
     frag_position = view * model * vec4(position, 1.0);
-    frag_normal = normalize(inv_model_view_transpose * vec4(normal, 0.0));
+    frag_normal = normalize(inv_view_transpose * vec4(normal_matrix * normal, 0.0));
     frag_albedo = albedo;
     frag_coeffs = coeffs;
 }
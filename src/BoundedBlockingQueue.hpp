@@ -0,0 +1,61 @@
+/**
+ * Bounded Multi Producer Multi Consumer Blocking Queue
+ * push() blocks while the queue is full, pop() blocks while it is empty.
+ * After close() pushes are rejected and pop() drains the remaining items
+ * before returning false.
+ */
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+template<typename T>
+class BoundedBlockingQueue {
+public:
+  explicit BoundedBlockingQueue(size_t capacity) : _capacity(capacity), _closed(false) {}
+  BoundedBlockingQueue(const BoundedBlockingQueue&) = delete;
+  BoundedBlockingQueue& operator=(const BoundedBlockingQueue&) = delete;
+
+  bool push(T data) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _not_full.wait(lock, [this] { return _closed || _data.size() < _capacity; });
+    if(_closed)
+      return false;
+    _data.push_back(std::move(data));
+    _not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T& data) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _not_empty.wait(lock, [this] { return _closed || !_data.empty(); });
+    if(_data.empty())
+      return false;
+    data = std::move(_data.front());
+    _data.pop_front();
+    _not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed = true;
+    _not_empty.notify_all();
+    _not_full.notify_all();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _data.size();
+  }
+
+private:
+  size_t _capacity;
+  bool _closed;
+  std::deque<T> _data;
+  mutable std::mutex _mutex;
+  std::condition_variable _not_empty;
+  std::condition_variable _not_full;
+};
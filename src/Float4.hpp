@@ -0,0 +1,129 @@
+/**
+ * Four floats processed in lockstep
+ * SSE2 on x86-64, plain arrays elsewhere. Comparisons return a Mask4 with
+ * all bits of a lane set where the comparison holds; masks combine with
+ * & | and select between two values lane by lane.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+#ifdef __SSE2__
+
+struct Mask4 {
+  __m128 v;
+
+  Mask4() {}
+  explicit Mask4(__m128 m) : v(m) {}
+
+  Mask4 operator&(Mask4 b) const { return Mask4(_mm_and_ps(v, b.v)); }
+  Mask4 operator|(Mask4 b) const { return Mask4(_mm_or_ps(v, b.v)); }
+  // One bit per lane, lane 0 in bit 0
+  int bits() const { return _mm_movemask_ps(v); }
+  bool any() const { return bits() != 0; }
+};
+
+struct Float4 {
+  __m128 v;
+
+  Float4() {}
+  Float4(float f) : v(_mm_set1_ps(f)) {}
+  Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+  explicit Float4(__m128 m) : v(m) {}
+
+  static Float4 load(const float* p) { return Float4(_mm_loadu_ps(p)); }
+  void store(float* p) const { _mm_storeu_ps(p, v); }
+
+  Float4 operator+(Float4 b) const { return Float4(_mm_add_ps(v, b.v)); }
+  Float4 operator-(Float4 b) const { return Float4(_mm_sub_ps(v, b.v)); }
+  Float4 operator*(Float4 b) const { return Float4(_mm_mul_ps(v, b.v)); }
+  Float4 operator/(Float4 b) const { return Float4(_mm_div_ps(v, b.v)); }
+  Float4& operator+=(Float4 b) { v = _mm_add_ps(v, b.v); return *this; }
+
+  Mask4 operator<(Float4 b) const { return Mask4(_mm_cmplt_ps(v, b.v)); }
+  Mask4 operator<=(Float4 b) const { return Mask4(_mm_cmple_ps(v, b.v)); }
+  Mask4 operator>(Float4 b) const { return Mask4(_mm_cmpgt_ps(v, b.v)); }
+  Mask4 operator>=(Float4 b) const { return Mask4(_mm_cmpge_ps(v, b.v)); }
+  Mask4 operator==(Float4 b) const { return Mask4(_mm_cmpeq_ps(v, b.v)); }
+};
+
+inline Float4 sqrt(Float4 a) { return Float4(_mm_sqrt_ps(a.v)); }
+inline Float4 abs(Float4 a) { return Float4(_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)); }
+inline Float4 min(Float4 a, Float4 b) { return Float4(_mm_min_ps(a.v, b.v)); }
+inline Float4 max(Float4 a, Float4 b) { return Float4(_mm_max_ps(a.v, b.v)); }
+// a where the mask is set, b elsewhere
+inline Float4 select(Mask4 m, Float4 a, Float4 b) {
+  return Float4(_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)));
+}
+// Store value into the lanes of dst where the mask is set
+inline void store_masked(uint32_t* dst, Mask4 m, uint32_t value) {
+  __m128i old = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst));
+  __m128i mask = _mm_castps_si128(m.v);
+  __m128i result = _mm_or_si128(_mm_and_si128(mask, _mm_set1_epi32(int(value))),
+                                _mm_andnot_si128(mask, old));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), result);
+}
+
+#else
+
+struct Mask4 {
+  bool v[4];
+
+  Mask4 operator&(Mask4 b) const { Mask4 r; for(int i = 0; i < 4; i++) r.v[i] = v[i] && b.v[i]; return r; }
+  Mask4 operator|(Mask4 b) const { Mask4 r; for(int i = 0; i < 4; i++) r.v[i] = v[i] || b.v[i]; return r; }
+  int bits() const { return int(v[0]) | int(v[1]) << 1 | int(v[2]) << 2 | int(v[3]) << 3; }
+  bool any() const { return bits() != 0; }
+};
+
+struct Float4 {
+  float v[4];
+
+  Float4() {}
+  Float4(float f) { for(int i = 0; i < 4; i++) v[i] = f; }
+  Float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+
+  static Float4 load(const float* p) { return Float4(p[0], p[1], p[2], p[3]); }
+  void store(float* p) const { for(int i = 0; i < 4; i++) p[i] = v[i]; }
+
+#define FLOAT4_OP(op) \
+  Float4 operator op(Float4 b) const { Float4 r; for(int i = 0; i < 4; i++) r.v[i] = v[i] op b.v[i]; return r; }
+  FLOAT4_OP(+)
+  FLOAT4_OP(-)
+  FLOAT4_OP(*)
+  FLOAT4_OP(/)
+#undef FLOAT4_OP
+  Float4& operator+=(Float4 b) { *this = *this + b; return *this; }
+
+#define FLOAT4_CMP(op) \
+  Mask4 operator op(Float4 b) const { Mask4 r; for(int i = 0; i < 4; i++) r.v[i] = v[i] op b.v[i]; return r; }
+  FLOAT4_CMP(<)
+  FLOAT4_CMP(<=)
+  FLOAT4_CMP(>)
+  FLOAT4_CMP(>=)
+  FLOAT4_CMP(==)
+#undef FLOAT4_CMP
+};
+
+inline Float4 sqrt(Float4 a) { Float4 r; for(int i = 0; i < 4; i++) r.v[i] = std::sqrt(a.v[i]); return r; }
+inline Float4 abs(Float4 a) { Float4 r; for(int i = 0; i < 4; i++) r.v[i] = std::fabs(a.v[i]); return r; }
+inline Float4 min(Float4 a, Float4 b) { Float4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r; }
+inline Float4 max(Float4 a, Float4 b) { Float4 r; for(int i = 0; i < 4; i++) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r; }
+inline Float4 select(Mask4 m, Float4 a, Float4 b) {
+  Float4 r;
+  for(int i = 0; i < 4; i++) r.v[i] = m.v[i] ? a.v[i] : b.v[i];
+  return r;
+}
+inline void store_masked(uint32_t* dst, Mask4 m, uint32_t value) {
+  for(int i = 0; i < 4; i++) {
+    if(m.v[i])
+      dst[i] = value;
+  }
+}
+
+#endif
@@ -0,0 +1,56 @@
+/**
+ * Fixed size thread pool
+ * enqueue() returns a std::future for the task's result. The destructor
+ * finishes the queued tasks and joins the workers.
+ */
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <future>
+#include <functional>
+#include <limits>
+#include <memory>
+
+#include "BoundedBlockingQueue.hpp"
+
+
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t num_threads = 0)
+    : _tasks(std::numeric_limits<size_t>::max()) {
+    if(num_threads == 0)
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    for(size_t i = 0; i < num_threads; i++) {
+      _workers.emplace_back([this] {
+        std::function<void()> task;
+        while(_tasks.pop(task))
+          task();
+      });
+    }
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    _tasks.close();
+    for(auto& worker: _workers)
+      worker.join();
+  }
+
+  template<typename F>
+  std::future<typename std::result_of<F()>::type> enqueue(F f) {
+    using R = typename std::result_of<F()>::type;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+    std::future<R> result = task->get_future();
+    _tasks.push([task] { (*task)(); });
+    return result;
+  }
+
+  size_t size() const { return _workers.size(); }
+
+private:
+  BoundedBlockingQueue<std::function<void()>> _tasks;
+  std::vector<std::thread> _workers;
+};
@@ -0,0 +1,131 @@
+#include <algorithm>
+
+#include "bvh.h"
+
+namespace {
+
+const int kMaxLeafSize = 2;
+
+}
+
+AABB AABB::transformed(const glm::mat4& m) const
+{
+    AABB result;
+    if(empty())
+        return result;
+    for(int i = 0; i < 8; i++) {
+        glm::vec3 corner((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+        result.extend(glm::vec3(m * glm::vec4(corner, 1.0f)));
+    }
+    return result;
+}
+
+Frustum Frustum::fromMatrix(const glm::mat4& m)
+{
+    // Gribb/Hartmann: the planes are sums and differences of the rows of m
+    glm::vec4 rows[4];
+    for(int i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+    }
+    Frustum frustum;
+    frustum.planes[0] = rows[3] + rows[0];  // left
+    frustum.planes[1] = rows[3] - rows[0];  // right
+    frustum.planes[2] = rows[3] + rows[1];  // bottom
+    frustum.planes[3] = rows[3] - rows[1];  // top
+    frustum.planes[4] = rows[3] + rows[2];  // near
+    frustum.planes[5] = rows[3] - rows[2];  // far
+    return frustum;
+}
+
+Frustum::Result Frustum::classify(const AABB& box) const
+{
+    Result result = INSIDE;
+    for(int i = 0; i < 6; i++) {
+        const glm::vec4& p = planes[i];
+        // corners furthest along and against the plane normal
+        glm::vec3 far_corner(p.x >= 0 ? box.max.x : box.min.x,
+                             p.y >= 0 ? box.max.y : box.min.y,
+                             p.z >= 0 ? box.max.z : box.min.z);
+        glm::vec3 near_corner(p.x >= 0 ? box.min.x : box.max.x,
+                              p.y >= 0 ? box.min.y : box.max.y,
+                              p.z >= 0 ? box.min.z : box.max.z);
+        if(glm::dot(glm::vec3(p), far_corner) + p.w < 0)
+            return OUTSIDE;
+        if(glm::dot(glm::vec3(p), near_corner) + p.w < 0)
+            result = INTERSECTS;
+    }
+    return result;
+}
+
+void BVH::build(const std::vector<AABB>& boxes)
+{
+    mBoxes = boxes;
+    mNodes.clear();
+    mIndices.resize(boxes.size());
+    for(size_t i = 0; i < boxes.size(); i++) {
+        mIndices[i] = i;
+    }
+    if(!boxes.empty())
+        buildNode(0, boxes.size());
+}
+
+int BVH::buildNode(int first, int count)
+{
+    int node_idx = mNodes.size();
+    mNodes.push_back(Node());
+    AABB bounds, centers;
+    for(int i = first; i < first + count; i++) {
+        bounds.extend(mBoxes[mIndices[i]]);
+        centers.extend(mBoxes[mIndices[i]].center());
+    }
+    mNodes[node_idx].bounds = bounds;
+    mNodes[node_idx].first = first;
+    mNodes[node_idx].count = count;
+    mNodes[node_idx].left = mNodes[node_idx].right = -1;
+    if(count <= kMaxLeafSize)
+        return node_idx;
+
+    // median split along the longest axis of the box centers
+    glm::vec3 extent = centers.max - centers.min;
+    int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+    int mid = first + count / 2;
+    std::nth_element(mIndices.begin() + first, mIndices.begin() + mid, mIndices.begin() + first + count,
+        [this, axis](int a, int b) { return mBoxes[a].center()[axis] < mBoxes[b].center()[axis]; });
+    int left = buildNode(first, mid - first);
+    int right = buildNode(mid, first + count - mid);
+    mNodes[node_idx].left = left;
+    mNodes[node_idx].right = right;
+    return node_idx;
+}
+
+void BVH::classify(const Frustum& frustum, std::vector<Frustum::Result>& results) const
+{
+    if(!mNodes.empty())
+        classifyNode(0, frustum, results);
+}
+
+void BVH::classifyNode(int node_idx, const Frustum& frustum, std::vector<Frustum::Result>& results) const
+{
+    const Node& node = mNodes[node_idx];
+    Frustum::Result result = frustum.classify(node.bounds);
+    if(result != Frustum::INTERSECTS) {
+        setResult(node_idx, result, results);
+        return;
+    }
+    if(node.left < 0) {
+        for(int i = node.first; i < node.first + node.count; i++) {
+            results[mIndices[i]] = frustum.classify(mBoxes[mIndices[i]]);
+        }
+        return;
+    }
+    classifyNode(node.left, frustum, results);
+    classifyNode(node.right, frustum, results);
+}
+
+void BVH::setResult(int node_idx, Frustum::Result result, std::vector<Frustum::Result>& results) const
+{
+    const Node& node = mNodes[node_idx];
+    for(int i = node.first; i < node.first + node.count; i++) {
+        results[mIndices[i]] = result;
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+
+#include <glm/glm.hpp>
+
+// Axis aligned bounding box, empty when min > max
+struct AABB {
+    glm::vec3 min;
+    glm::vec3 max;
+
+    AABB(): min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+    AABB(const glm::vec3& min_, const glm::vec3& max_): min(min_), max(max_) {}
+
+    bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+    glm::vec3 center() const { return 0.5f * (min + max); }
+    void extend(const glm::vec3& p) { min = glm::min(min, p); max = glm::max(max, p); }
+    void extend(const AABB& box) { min = glm::min(min, box.min); max = glm::max(max, box.max); }
+    // Bounds of the box transformed by m
+    AABB transformed(const glm::mat4& m) const;
+};
+
+// View frustum as six planes (a, b, c, d), a point p is inside a plane if
+// dot(plane, vec4(p, 1)) >= 0.
+struct Frustum {
+    enum Result { OUTSIDE = 0, INTERSECTS, INSIDE };
+
+    glm::vec4 planes[6];
+
+    // Frustum of a projection * view (* model) matrix; with the model matrix
+    // included the planes are in object space
+    static Frustum fromMatrix(const glm::mat4& m);
+    Result classify(const AABB& box) const;
+};
+
+// Bounding volume hierarchy over a set of boxes, used for view frustum
+// culling of the scene objects.
+class BVH {
+public:
+    void build(const std::vector<AABB>& boxes);
+
+    // Classify every box against the frustum. Boxes of subtrees entirely
+    // inside or outside the frustum are not tested one by one. results
+    // must have one entry per box.
+    void classify(const Frustum& frustum, std::vector<Frustum::Result>& results) const;
+private:
+    struct Node {
+        AABB bounds;
+        int left, right;    // children, -1 for leaves
+        int first, count;   // range in mIndices for leaves
+    };
+    std::vector<Node> mNodes;
+    std::vector<int> mIndices;
+    std::vector<AABB> mBoxes;
+
+    int buildNode(int first, int count);
+    void classifyNode(int node, const Frustum& frustum, std::vector<Frustum::Result>& results) const;
+    void setResult(int node, Frustum::Result result, std::vector<Frustum::Result>& results) const;
+};
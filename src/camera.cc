@@ -2,10 +2,14 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include "camera.h"
+#include "keyframes.h"
 
 Camera::Camera(const Json::Value& camera_spec) {
     mPos = glm::vec3(camera_spec["eye"][0].asFloat(), camera_spec["eye"][1].asFloat(), camera_spec["eye"][2].asFloat());
@@ -20,7 +24,22 @@ Camera::Camera(const Json::Value& camera_spec) {
         mViewport[i] = camera_spec["viewport"][i].asInt();
     }
 
-    std::cout << str() << std::endl;
+    updateMatrices();
+}
+
+Camera::Camera(glm::vec3 pos, glm::vec3 lookat, glm::vec3 up, float focal_length, float fovy,
+    float near, float far, const int viewport[4])
+    : mPos(pos), mUp(up), mAt(lookat), mFovy(fovy), mFocalLength(focal_length), mNear(near), mFar(far)
+{
+    for(int i = 0; i < 4; i++) {
+        mViewport[i] = viewport[i];
+    }
+    updateMatrices();
+}
+
+void Camera::updateMatrices() {
+    mView = glm::lookAt(mPos, mAt, mUp);
+    mProjection = glm::perspective(mFovy, getAspectRatio(), mNear, mFar);
 }
 
 std::string Camera::str() const {
@@ -38,60 +57,299 @@ std::string Camera::str() const {
     return ss.str();
 }
 
-glm::mat4 Camera::getViewMatrix() const {
-    return glm::lookAt(mPos, mAt, mUp);
+Json::Value Camera::toJson() const {
+    Json::Value spec;
+    for(int i = 0; i < 3; i++) {
+        spec["eye"].append(mPos[i]);
+        spec["at"].append(mAt[i]);
+        spec["up"].append(mUp[i]);
+    }
+    spec["fovy"] = mFovy;
+    spec["focal_length"] = mFocalLength;
+    spec["near"] = mNear;
+    spec["far"] = mFar;
+    for(int i = 0; i < 4; i++) {
+        spec["viewport"].append(mViewport[i]);
+    }
+    return spec;
 }
 
-glm::mat4 Camera::getProjectionMatrix() const {
-    return glm::perspective(mFovy, getAspectRatio(), mNear, mFar);
-}
+const size_t CameraTrajectory::kChunkSize;
+
+namespace {
+
+// Finds the camera objects of a trajectory file without parsing them: a
+// byte scan that tracks the brace depth and skips over strings.
+class TrajectoryScanner {
+public:
+    // Scan from `offset`, which is either the start of the file or the
+    // start of a camera object inside the list
+    TrajectoryScanner(std::istream& in, uint64_t offset, bool in_list)
+        : mIn(in), mBlock(1 << 16), mBlockOffset(offset), mPos(0), mEnd(0), mInList(in_list)
+    {
+        mIn.clear();
+        mIn.seekg(offset);
+    }
+
+    // Find the next camera object, its text is stored in *text unless text
+    // is null. Returns false at the end of the list.
+    bool next(uint64_t* offset, std::string* text)
+    {
+        int c;
+        if(!mInList) {
+            c = skipSpace();
+            if(c != '[')
+                throw std::runtime_error("Camera trajectory must be a list of cameras");
+            mInList = true;
+        }
+        c = skipSpace();
+        if(c == ',')
+            c = skipSpace();
+        if(c == ']')
+            return false;
+        if(c != '{')
+            throw std::runtime_error("Camera trajectory must be a list of cameras");
+
+        *offset = mBlockOffset + mPos - 1;
+        if(text) {
+            text->assign(1, '{');
+        }
+        int depth = 1;
+        bool in_string = false;
+        while(depth > 0) {
+            c = get();
+            if(c < 0)
+                throw std::runtime_error("Camera trajectory ends inside a camera");
+            if(text) {
+                text->push_back(char(c));
+            }
+            if(in_string) {
+                if(c == '\\') {
+                    c = get();
+                    if(text && c >= 0)
+                        text->push_back(char(c));
+                } else if(c == '"') {
+                    in_string = false;
+                }
+            } else if(c == '"') {
+                in_string = true;
+            } else if(c == '{' || c == '[') {
+                depth++;
+            } else if(c == '}' || c == ']') {
+                depth--;
+            }
+        }
+        return true;
+    }
+private:
+    std::istream& mIn;
+    std::vector<char> mBlock;
+    uint64_t mBlockOffset;  // file offset of mBlock[0]
+    size_t mPos, mEnd;
+    bool mInList;
+
+    int get()
+    {
+        if(mPos == mEnd) {
+            mBlockOffset += mEnd;
+            mIn.read(mBlock.data(), mBlock.size());
+            mPos = 0;
+            mEnd = mIn.gcount();
+            if(mEnd == 0)
+                return -1;
+        }
+        return (unsigned char) mBlock[mPos++];
+    }
+
+    int skipSpace()
+    {
+        int c;
+        do {
+            c = get();
+        } while(c == ' ' || c == '\n' || c == '\r' || c == '\t');
+        if(c < 0)
+            throw std::runtime_error("Camera trajectory ends inside the list of cameras");
+        return c;
+    }
+};
 
-glm::mat4 Camera::getViewProjectionMatrix() const {
-    return getProjectionMatrix() * getViewMatrix();
 }
 
-CameraTrajectory::CameraTrajectory(const std::string& trajectory_filename)
+CameraTrajectory::CameraTrajectory(const std::string& trajectory_filename, double keyframe_rate)
+    : mFilename(trajectory_filename), mSize(0), mWindowBegin(0), mKeyframeRate(0.0)
 {
-    std::ifstream ifs(trajectory_filename);
+    std::ifstream ifs(trajectory_filename, std::ifstream::binary);
+    if(!ifs) {
+        throw std::runtime_error("Unable to read trajectory file " + trajectory_filename);
+    }
 
     std::cout << "Camera Trajectory file: " << trajectory_filename << std::endl;
-    Json::CharReaderBuilder reader;
-    Json::Value obj;
-    std::string json_err;
-    Json::parseFromStream(reader, ifs, &obj, &json_err);
-    loadFromJson(obj);
+    try {
+        TrajectoryScanner scanner(ifs, 0, false);
+        uint64_t offset;
+        if(keyframe_rate > 0.0) {
+            // keyframe files are small, all keyframes are parsed up front
+            std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+            std::string text, json_err;
+            Json::Value camera_spec;
+            while(scanner.next(&offset, &text)) {
+                if(!reader->parse(text.data(), text.data() + text.size(), &camera_spec, &json_err)) {
+                    throw std::runtime_error("keyframe " + std::to_string(mKeyframes.size()) + ": " + json_err);
+                }
+                addKeyframe(camera_spec);
+            }
+        } else {
+            while(scanner.next(&offset, nullptr)) {
+                if(mSize % kChunkSize == 0)
+                    mChunkOffsets.push_back(offset);
+                mSize++;
+            }
+        }
+    } catch(const std::runtime_error& e) {
+        throw std::runtime_error("Unable to parse trajectory file " + trajectory_filename + ": " + e.what());
+    }
+
+    if(keyframe_rate > 0.0) {
+        initKeyframes(keyframe_rate);
+    } else {
+        std::cout << "Cameras in trajectory: " << mSize << std::endl;
+    }
+    if(mSize > 0)
+        loadChunk(0);
+    mCurrentTrajectoryId = 0;
+    mBegin = 0;
+    mEnd = mSize;
+}
+
+CameraTrajectory::CameraTrajectory(const Json::Value& trajectory_spec, double keyframe_rate)
+    : mSize(0), mWindowBegin(0), mKeyframeRate(0.0)
+{
+    if(!trajectory_spec.isArray()) {
+        throw std::runtime_error("Camera trajectory must be a list of cameras");
+    }
+    if(keyframe_rate > 0.0) {
+        for(auto& camera_spec: trajectory_spec) {
+            addKeyframe(camera_spec);
+        }
+        initKeyframes(keyframe_rate);
+        if(mSize > 0)
+            loadChunk(0);
+    } else {
+        // already in memory, the window holds all of it
+        mCameras.reserve(trajectory_spec.size());
+        for(auto& camera_spec: trajectory_spec) {
+            mCameras.emplace_back(camera_spec);
+        }
+        mSize = mCameras.size();
+    }
+    mCurrentTrajectoryId = 0;
+    mBegin = 0;
+    mEnd = mSize;
+}
+
+void CameraTrajectory::addKeyframe(const Json::Value& camera_spec)
+{
+    size_t index = mKeyframes.size();
+    if(!camera_spec.isObject() || !camera_spec["timestamp"].isNumeric()) {
+        throw std::runtime_error("keyframe " + std::to_string(index) + " has no \"timestamp\"");
+    }
+    Keyframe keyframe = { camera_spec["timestamp"].asDouble(), Camera(camera_spec) };
+    if(index > 0 && keyframe.time <= mKeyframes.back().time) {
+        throw std::runtime_error("keyframe " + std::to_string(index) + " is not later than the one before it");
+    }
+    mKeyframes.push_back(keyframe);
+}
+
+void CameraTrajectory::initKeyframes(double keyframe_rate)
+{
+    mKeyframeRate = keyframe_rate;
+    if(mKeyframes.empty()) {
+        mSize = 0;
+    } else {
+        // a frame at the first keyframe and every 1/rate seconds after it,
+        // up to the last keyframe
+        double duration = mKeyframes.back().time - mKeyframes.front().time;
+        mSize = size_t(duration * keyframe_rate + 1e-6) + 1;
+    }
+    std::cout << "Keyframes in trajectory: " << mKeyframes.size() << ", " << mSize
+        << " cameras at " << keyframe_rate << " fps" << std::endl;
+}
+
+void CameraTrajectory::loadChunk(size_t chunk)
+{
+    if(!mKeyframes.empty()) {
+        mCameras.clear();
+        mWindowBegin = chunk * kChunkSize;
+        size_t count = std::min(kChunkSize, mSize - mWindowBegin);
+        mCameras.reserve(count);
+        for(size_t i = 0; i < count; i++) {
+            double time = mKeyframes.front().time + (mWindowBegin + i) / mKeyframeRate;
+            mCameras.push_back(interpolate_keyframes(mKeyframes, time));
+        }
+        return;
+    }
+
+    std::ifstream ifs(mFilename, std::ifstream::binary);
+    if(!ifs) {
+        throw std::runtime_error("Unable to read trajectory file " + mFilename);
+    }
+    mCameras.clear();
+    mWindowBegin = chunk * kChunkSize;
+    size_t count = std::min(kChunkSize, mSize - mWindowBegin);
+    mCameras.reserve(count);
+
+    TrajectoryScanner scanner(ifs, mChunkOffsets[chunk], true);
+    std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+    std::string text, json_err;
+    Json::Value camera_spec;
+    uint64_t offset;
+    for(size_t i = 0; i < count; i++) {
+        if(!scanner.next(&offset, &text) ||
+           !reader->parse(text.data(), text.data() + text.size(), &camera_spec, &json_err)) {
+            throw std::runtime_error("Unable to parse camera " + std::to_string(mWindowBegin + i) +
+                " of trajectory file " + mFilename + ": " + json_err);
+        }
+        mCameras.emplace_back(camera_spec);
+    }
 }
 
-CameraTrajectory::CameraTrajectory(const Json::Value& trajectory_spec)
+const Camera* CameraTrajectory::getCamera(size_t index)
 {
-    loadFromJson(trajectory_spec);
+    if(index < mWindowBegin || index >= mWindowBegin + mCameras.size()) {
+        loadChunk(index / kChunkSize);
+    }
+    return &mCameras[index - mWindowBegin];
 }
 
 const Camera* CameraTrajectory::getNext(bool repeat)
 {
-    if(mCurrentTrajectoryId >= mCameras.size())
+    if(mCurrentTrajectoryId >= mEnd)
         return nullptr;
 
-    const Camera* curr_cam = mCameras[mCurrentTrajectoryId++];
-    if(repeat) {
-        mCurrentTrajectoryId %= mCameras.size();
+    const Camera* curr_cam = getCamera(mCurrentTrajectoryId++);
+    if(repeat && mCurrentTrajectoryId == mEnd) {
+        mCurrentTrajectoryId = mBegin;
     }
     return curr_cam;
 }
 
-void CameraTrajectory::loadFromJson(const Json::Value& trajectory_spec)
+void CameraTrajectory::setShard(int shard, int num_shards)
 {
-    for(int i = 0; i < trajectory_spec.size(); i++) {
-        std::cout << trajectory_spec[i] << std::endl;
-        mCameras.push_back(new Camera(trajectory_spec[i]));
-    }
-    mCurrentTrajectoryId = 0;
+    size_t n = mSize;
+    mBegin = n * shard / num_shards;
+    mEnd = n * (shard + 1) / num_shards;
+    mCurrentTrajectoryId = mBegin;
+}
+std::string CameraTrajectory::getFilename(size_t index)
+{
+    char buffer[2048];
+    sprintf(buffer, "im_%07d", int(index));
+    return std::string(buffer);
 }
 
 std::pair<const Camera*, std::string> CameraTrajectory::getNextCameraAndFilename()
 {
-    char buffer[2048];
-    sprintf(buffer, "im_%07d", mCurrentTrajectoryId);
+    std::string filename = getFilename(mCurrentTrajectoryId);
     const Camera* cam = getNext(false);
-    return std::make_pair(cam, std::string(buffer));
+    return std::make_pair(cam, filename);
 }
@@ -1,47 +1,104 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <cstdint>
 #include <json/json.h>
 #include <glm/glm.hpp>
 
 class Camera {
 public:
     Camera(const Json::Value& camera_spec);
-    Camera(glm::vec3 pos, glm::vec3 lookat, glm::vec3 up, float focal_length, float fovy);
-    Camera(float focal_length, float fovy);
+    Camera(glm::vec3 pos, glm::vec3 lookat, glm::vec3 up, float focal_length, float fovy,
+        float near, float far, const int viewport[4]);
 
-    void setCameraParameters(glm::vec3 pos, glm::vec3 lookat, glm::vec3 up, float focal_length, float fovy);
-
-    glm::mat4 getViewMatrix() const;
-    glm::mat4 getProjectionMatrix() const;
-    glm::mat4 getViewProjectionMatrix() const;
+    // Computed once when the camera is built
+    const glm::mat4& getViewMatrix() const { return mView; }
+    const glm::mat4& getProjectionMatrix() const { return mProjection; }
+    glm::mat4 getViewProjectionMatrix() const { return mProjection * mView; }
 
     float getAspectRatio() const { return getWidth() / getHeight(); }
     int getWidth() const { return mViewport[2] - mViewport[0]; }
     int getHeight() const { return mViewport[3] - mViewport[1]; }
+    float getNear() const { return mNear; }
+    float getFar() const { return mFar; }
 
-    glm::vec3 getPosition() { return mPos; }
+    glm::vec3 getPosition() const { return mPos; }
+    glm::vec3 getLookAt() const { return mAt; }
+    glm::vec3 getUp() const { return mUp; }
+    float getFovy() const { return mFovy; }
+    float getFocalLength() const { return mFocalLength; }
+    const int* getViewport() const { return mViewport; }
     std::string str() const;
+    // Same layout as the camera specification it can be built from
+    Json::Value toJson() const;
 private:
+    glm::mat4 mView;
+    glm::mat4 mProjection;
     glm::vec3 mPos;
     glm::vec3 mUp;
     glm::vec3 mAt;
-    glm::vec3 mWorldUp;
     float mFovy;
     float mFocalLength;
     float mNear, mFar;
     int mViewport[4];
+
+    void updateMatrices();
 };
 
+// A camera at a point in time of a keyframe trajectory
+struct Keyframe {
+    double time;    // seconds
+    Camera camera;
+};
+
+// A list of cameras, read from a JSON array of camera specifications.
+//
+// With a keyframe rate the list holds keyframes instead, every one with a
+// "timestamp" in seconds. The trajectory then consists of cameras sampled
+// at that rate from the first to the last keyframe, interpolated on the
+// fly (see keyframes.h).
+//
+// Trajectory files are never parsed as a whole. Opening one only scans it
+// for the extent of every camera object and remembers where each chunk of
+// kChunkSize cameras starts. The cameras of a chunk are parsed into a
+// contiguous window when iteration reaches it, so memory does not grow
+// with the length of the trajectory.
 class CameraTrajectory {
 public:
-    CameraTrajectory(const std::string& trajectory_filename);
-    CameraTrajectory(const Json::Value& trajectory_spec);
+    static const size_t kChunkSize = 4096;
+
+    // Throws std::runtime_error if the trajectory file cannot be read or
+    // parsed. keyframe_rate is in frames per second, 0 to render the listed
+    // cameras as they are.
+    CameraTrajectory(const std::string& trajectory_filename, double keyframe_rate = 0.0);
+    CameraTrajectory(const Json::Value& trajectory_spec, double keyframe_rate = 0.0);
+    size_t size() const { return mSize; }
+    // Restrict iteration to shard `shard` of `num_shards` contiguous ranges
+    // of frames. File names keep the index of the frame in the whole
+    // trajectory.
+    void setShard(int shard, int num_shards);
+    // The returned cameras stay valid until the next call of getNext(),
+    // getNextCameraAndFilename() or getCamera(), copy them to keep them
+    // longer. Cameras after the first chunk are parsed on demand and may
+    // throw std::runtime_error.
     const Camera* getNext(bool repeat);
     std::pair<const Camera*, std::string> getNextCameraAndFilename();
+    const Camera* getCamera(size_t index);
+    // Output file name (without extension) of a frame
+    static std::string getFilename(size_t index);
 private:
-    std::vector<Camera*> mCameras;
-    int mCurrentTrajectoryId;
+    std::string mFilename;              // empty if built from a JSON value
+    std::vector<uint64_t> mChunkOffsets; // file offset of the first camera of each chunk
+    size_t mSize;
+    std::vector<Camera> mCameras;       // cameras mWindowBegin, mWindowBegin + 1, ...
+    size_t mWindowBegin;
+    size_t mCurrentTrajectoryId;
+    size_t mBegin, mEnd;   // range of frames iterated
+    std::vector<Keyframe> mKeyframes;
+    double mKeyframeRate;
 
-    void loadFromJson(const Json::Value& trajectory_spec);
+    void loadChunk(size_t chunk);
+    void addKeyframe(const Json::Value& camera_spec);
+    void initKeyframes(double keyframe_rate);
 };
@@ -0,0 +1,138 @@
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include <zlib.h>
+
+#include "compressed_array.h"
+
+namespace {
+
+const char kMagic[4] = { 'N', 'P', 'Y', 'Z' };
+const uint8_t kVersion = 1;
+// Raw bytes per chunk, a multiple of every element size
+const size_t kChunkBytes = size_t(1) << 20;
+
+void put_u32_at(unsigned char* p, uint32_t v)
+{
+    for(int i = 0; i < 4; i++) {
+        p[i] = (v >> (8 * i)) & 0xff;
+    }
+}
+
+uint32_t get_u32(const char* p)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return uint32_t(u[0]) | uint32_t(u[1]) << 8 | uint32_t(u[2]) << 16 | uint32_t(u[3]) << 24;
+}
+
+void shuffle(const unsigned char* src, size_t num_bytes, size_t element_size, unsigned char* dst)
+{
+    size_t n = num_bytes / element_size;
+    for(size_t b = 0; b < element_size; b++) {
+        unsigned char* out = dst + b * n;
+        const unsigned char* in = src + b;
+        for(size_t i = 0; i < n; i++) {
+            out[i] = in[i * element_size];
+        }
+    }
+    // trailing bytes of a partial element are stored as is
+    memcpy(dst + n * element_size, src + n * element_size, num_bytes - n * element_size);
+}
+
+void unshuffle(const unsigned char* src, size_t num_bytes, size_t element_size, unsigned char* dst)
+{
+    size_t n = num_bytes / element_size;
+    for(size_t b = 0; b < element_size; b++) {
+        const unsigned char* in = src + b * n;
+        unsigned char* out = dst + b;
+        for(size_t i = 0; i < n; i++) {
+            out[i * element_size] = in[i];
+        }
+    }
+    memcpy(dst + n * element_size, src + n * element_size, num_bytes - n * element_size);
+}
+
+}
+
+void compress_npyz(const std::string& npy_preamble, const void* data, size_t num_bytes,
+    size_t element_size, int level, CompressionBuffers& buffers)
+{
+    const unsigned char* src = static_cast<const unsigned char*>(data);
+    size_t num_chunks = (num_bytes + kChunkBytes - 1) / kChunkBytes;
+
+    // magic, version, element size, two reserved bytes, preamble size,
+    // preamble, chunk count, then a raw and compressed size per chunk
+    size_t table_offset = 12 + npy_preamble.size() + 4;
+    size_t data_offset = table_offset + num_chunks * 8;
+    std::vector<unsigned char>& out = buffers.output;
+    out.resize(data_offset + compressBound(kChunkBytes) * num_chunks);
+    memcpy(out.data(), kMagic, 4);
+    out[4] = kVersion;
+    out[5] = uint8_t(element_size);
+    out[6] = out[7] = 0;
+    put_u32_at(out.data() + 8, npy_preamble.size());
+    memcpy(out.data() + 12, npy_preamble.data(), npy_preamble.size());
+    put_u32_at(out.data() + table_offset - 4, num_chunks);
+
+    buffers.shuffled.resize(std::min(num_bytes, kChunkBytes));
+    size_t pos = data_offset;
+    for(size_t c = 0; c < num_chunks; c++) {
+        size_t offset = c * kChunkBytes;
+        size_t raw_size = std::min(kChunkBytes, num_bytes - offset);
+        shuffle(src + offset, raw_size, element_size, buffers.shuffled.data());
+        uLongf size = out.size() - pos;
+        if(compress2(out.data() + pos, &size, buffers.shuffled.data(), raw_size, level) != Z_OK) {
+            throw std::runtime_error("compression failed");
+        }
+        pos += size;
+        put_u32_at(out.data() + table_offset + c * 8, raw_size);
+        put_u32_at(out.data() + table_offset + c * 8 + 4, size);
+    }
+    out.resize(pos);
+}
+
+void load_npyz(const std::string& filename, std::vector<char>& npy)
+{
+    std::ifstream stream(filename, std::ifstream::binary);
+    if(!stream) {
+        throw std::runtime_error("Unable to read " + filename);
+    }
+    std::vector<char> file((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    const std::runtime_error corrupt(filename + " is not a valid .npyz file");
+
+    if(file.size() < 12 || memcmp(file.data(), kMagic, 4) != 0 || uint8_t(file[4]) != kVersion)
+        throw corrupt;
+    size_t element_size = uint8_t(file[5]);
+    size_t preamble_size = get_u32(&file[8]);
+    if(element_size == 0 || file.size() < 16 + preamble_size)
+        throw corrupt;
+    size_t pos = 12 + preamble_size;
+    size_t num_chunks = get_u32(&file[pos]);
+    pos += 4;
+    size_t table = pos;
+    pos += num_chunks * 8;
+    if(file.size() < pos)
+        throw corrupt;
+
+    npy.assign(file.begin() + 12, file.begin() + 12 + preamble_size);
+    std::vector<unsigned char> shuffled;
+    for(size_t c = 0; c < num_chunks; c++) {
+        uLongf raw_size = get_u32(&file[table + c * 8]);
+        size_t size = get_u32(&file[table + c * 8 + 4]);
+        if(file.size() < pos + size)
+            throw corrupt;
+        shuffled.resize(raw_size);
+        uLongf out_size = raw_size;
+        if(uncompress(shuffled.data(), &out_size,
+                      reinterpret_cast<const unsigned char*>(&file[pos]), size) != Z_OK || out_size != raw_size)
+            throw corrupt;
+        size_t offset = npy.size();
+        npy.resize(offset + raw_size);
+        unshuffle(shuffled.data(), raw_size, element_size, reinterpret_cast<unsigned char*>(&npy[offset]));
+        pos += size;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Byte shuffled, deflate compressed .npy files (.npyz):
+//
+//   "NPYZ", uint8 version, uint8 element size, uint16 0
+//   uint32 length of the npy preamble, the npy preamble (magic and header)
+//   uint32 number of chunks
+//   per chunk: uint32 raw size, uint32 compressed size
+//   the compressed chunks
+//
+// All integers are little endian. The payload is split into chunks that are
+// shuffled and compressed independently. Shuffling stores the first byte of
+// every element, then the second and so on, which puts the slowly varying
+// sign and exponent bytes of float data next to each other where deflate
+// finds far more redundancy than in the interleaved bytes. Unshuffling and
+// inflating the chunks after the preamble gives back the original .npy file.
+
+// Scratch space, reused between calls of a thread
+struct CompressionBuffers {
+    std::vector<unsigned char> shuffled;
+    std::vector<unsigned char> output;      // the .npyz file
+};
+
+// Build a .npyz file in buffers.output. npy_preamble is the complete .npy
+// header of data. Throws std::runtime_error on failure.
+void compress_npyz(const std::string& npy_preamble, const void* data, size_t num_bytes,
+    size_t element_size, int level, CompressionBuffers& buffers);
+
+// Read a .npyz file back into the contents of the .npy file it was made
+// from. Throws std::runtime_error if the file cannot be read or is corrupt.
+void load_npyz(const std::string& filename, std::vector<char>& npy);
@@ -0,0 +1,294 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+
+#include <glad/glad.h>
+
+#if USE_GLFW
+    #include <GLFW/glfw3.h>
+#endif
+
+#if USE_EGL
+    #include <EGL/egl.h>
+    #include <EGL/eglext.h>
+#endif
+
+#if USE_OSMESA
+    #include <GL/osmesa.h>
+#endif
+
+#include "context.h"
+
+#if USE_GLFW
+static void error_callback(int error, const char* description) {
+    fprintf(stderr, "Error: %s\n", description);
+}
+
+static void key_callback(GLFWwindow* window, int key,
+             int scancode, int action,
+             int mods) {
+  if(key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+    glfwSetWindowShouldClose(window, true);
+}
+
+class GLFWContext : public GLContext {
+public:
+    GLFWContext(): mWindow(nullptr) {}
+    ~GLFWContext() {
+        if(mWindow)
+            glfwDestroyWindow(mWindow);
+        glfwTerminate();
+    }
+
+    bool init(int width, int height, bool visible) {
+        glfwSetErrorCallback(error_callback);
+
+        glfwInitHint(GLFW_COCOA_MENUBAR, GLFW_FALSE);
+
+        if(!glfwInit()) {
+            return false;
+        }
+
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+        mWindow = glfwCreateWindow(width, height, "Render Server", NULL, NULL);
+        if(!mWindow) {
+            return false;
+        }
+        glfwMakeContextCurrent(mWindow);
+        glfwSetWindowUserPointer(mWindow, this);
+        glfwSetKeyCallback(mWindow, key_callback);
+        return gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+    }
+
+    bool shouldClose() override { return glfwWindowShouldClose(mWindow); }
+    void swapBuffers() override { glfwSwapBuffers(mWindow); }
+    void pollEvents() override { glfwPollEvents(); }
+private:
+    GLFWwindow* mWindow;
+};
+#endif
+
+#if USE_EGL
+static bool has_extension(const char* extensions, const char* name) {
+    if(extensions == nullptr)
+        return false;
+    size_t len = strlen(name);
+    for(const char* p = strstr(extensions, name); p != nullptr; p = strstr(p + len, name)) {
+        if((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+class EGLContextImpl : public GLContext {
+public:
+    EGLContextImpl(): mDisplay(EGL_NO_DISPLAY), mSurface(EGL_NO_SURFACE),
+        mContext(EGL_NO_CONTEXT) {}
+    ~EGLContextImpl() {
+        if(mDisplay == EGL_NO_DISPLAY)
+            return;
+        eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if(mSurface != EGL_NO_SURFACE)
+            eglDestroySurface(mDisplay, mSurface);
+        if(mContext != EGL_NO_CONTEXT)
+            eglDestroyContext(mDisplay, mContext);
+        eglTerminate(mDisplay);
+    }
+
+    bool init(int width, int height) {
+        // Prefer the Mesa surfaceless platform: it needs no X server, no DRM
+        // node and works with llvmpipe.
+        const char* client_ext = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if(get_platform_display && has_extension(client_ext, "EGL_MESA_platform_surfaceless")) {
+            mDisplay = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        }
+        if(mDisplay == EGL_NO_DISPLAY) {
+            mDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        }
+        EGLint major, minor;
+        if(mDisplay == EGL_NO_DISPLAY || !eglInitialize(mDisplay, &major, &minor)) {
+            std::cout << "EGL initialization failed" << std::endl;
+            mDisplay = EGL_NO_DISPLAY;
+            return false;
+        }
+        if(!eglBindAPI(EGL_OPENGL_API)) {
+            std::cout << "EGL: desktop OpenGL API unavailable" << std::endl;
+            return false;
+        }
+
+        const EGLint config_attribs[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+            EGL_DEPTH_SIZE, 24,
+            EGL_NONE
+        };
+        EGLConfig config = nullptr;
+        EGLint num_configs = 0;
+        eglChooseConfig(mDisplay, config_attribs, &config, 1, &num_configs);
+
+        const char* display_ext = eglQueryString(mDisplay, EGL_EXTENSIONS);
+        bool surfaceless = has_extension(display_ext, "EGL_KHR_surfaceless_context");
+        if(num_configs == 0) {
+            if(!surfaceless || !has_extension(display_ext, "EGL_KHR_no_config_context")) {
+                std::cout << "EGL: no usable framebuffer configuration" << std::endl;
+                return false;
+            }
+            config = EGL_NO_CONFIG_KHR;
+        }
+
+        const EGLint context_attribs[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
+        };
+        mContext = eglCreateContext(mDisplay, config, EGL_NO_CONTEXT, context_attribs);
+        if(mContext == EGL_NO_CONTEXT) {
+            std::cout << "EGL: context creation failed (0x" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+            return false;
+        }
+
+        // A pbuffer gives the context a default framebuffer; without a
+        // config we fall back to a surfaceless context.
+        if(num_configs > 0) {
+            const EGLint pbuffer_attribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+            mSurface = eglCreatePbufferSurface(mDisplay, config, pbuffer_attribs);
+        }
+        if(!eglMakeCurrent(mDisplay, mSurface, mSurface, mContext)) {
+            std::cout << "EGL: eglMakeCurrent failed" << std::endl;
+            return false;
+        }
+        return gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+    }
+private:
+    EGLDisplay mDisplay;
+    EGLSurface mSurface;
+    EGLContext mContext;
+};
+#endif
+
+#if USE_OSMESA
+class OSMesaContextImpl : public GLContext {
+public:
+    OSMesaContextImpl(): mContext(nullptr) {}
+    ~OSMesaContextImpl() {
+        if(mContext)
+            OSMesaDestroyContext(mContext);
+    }
+
+    bool init(int width, int height) {
+        const int attribs[] = {
+            OSMESA_FORMAT, OSMESA_RGBA,
+            OSMESA_DEPTH_BITS, 24,
+            OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+            OSMESA_CONTEXT_MAJOR_VERSION, 3,
+            OSMESA_CONTEXT_MINOR_VERSION, 3,
+            0
+        };
+        mContext = OSMesaCreateContextAttribs(attribs, NULL);
+        if(!mContext) {
+            std::cout << "OSMesa: context creation failed" << std::endl;
+            return false;
+        }
+        mBuffer.resize(4 * width * height);
+        if(!OSMesaMakeCurrent(mContext, mBuffer.data(), GL_UNSIGNED_BYTE, width, height)) {
+            std::cout << "OSMesa: OSMesaMakeCurrent failed" << std::endl;
+            return false;
+        }
+        return gladLoadGLLoader((GLADloadproc) OSMesaGetProcAddress);
+    }
+private:
+    OSMesaContext mContext;
+    std::vector<unsigned char> mBuffer;
+};
+#endif
+
+GLContext* GLContext::create(Backend backend, int width, int height, bool visible)
+{
+    GLContext* context = nullptr;
+    bool ok = false;
+    switch(backend) {
+#if USE_GLFW
+    case GLFW: {
+        GLFWContext* ctx = new GLFWContext();
+        context = ctx;
+        ok = ctx->init(width, height, visible);
+        break;
+    }
+#endif
+#if USE_EGL
+    case EGL: {
+        EGLContextImpl* ctx = new EGLContextImpl();
+        context = ctx;
+        ok = ctx->init(width, height);
+        break;
+    }
+#endif
+#if USE_OSMESA
+    case OSMESA: {
+        OSMesaContextImpl* ctx = new OSMesaContextImpl();
+        context = ctx;
+        ok = ctx->init(width, height);
+        break;
+    }
+#endif
+    default:
+        std::cout << "Error: context backend '" << backendName(backend)
+                  << "' is not available in this build" << std::endl;
+        break;
+    }
+    if(!ok) {
+        delete context;
+        return nullptr;
+    }
+    return context;
+}
+
+GLContext::Backend GLContext::defaultBackend(bool interactive)
+{
+#if USE_GLFW
+    if(interactive)
+        return GLFW;
+#endif
+#if USE_EGL
+    return EGL;
+#elif USE_OSMESA
+    return OSMESA;
+#else
+    return GLFW;
+#endif
+}
+
+bool GLContext::parseBackend(const std::string& name, Backend* backend)
+{
+    if(name == "auto")
+        *backend = AUTO;
+    else if(name == "glfw")
+        *backend = GLFW;
+    else if(name == "egl")
+        *backend = EGL;
+    else if(name == "osmesa")
+        *backend = OSMESA;
+    else
+        return false;
+    return true;
+}
+
+const char* GLContext::backendName(Backend backend)
+{
+    switch(backend) {
+    case GLFW: return "glfw";
+    case EGL: return "egl";
+    case OSMESA: return "osmesa";
+    default: return "auto";
+    }
+}
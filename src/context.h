@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+// OpenGL context backends. The GLFW backend opens a window and is meant for
+// the interactive (--gui) mode; EGL and OSMesa create headless contexts that
+// need neither an X server nor a window.
+class GLContext {
+public:
+    enum Backend { AUTO = 0, GLFW, EGL, OSMESA };
+
+    virtual ~GLContext() {}
+
+    virtual bool shouldClose() { return false; }
+    virtual void swapBuffers() {}
+    virtual void pollEvents() {}
+
+    // Creates and makes current a GL 3.3 core context for the given backend
+    // and loads the GL entry points. Returns nullptr on failure.
+    static GLContext* create(Backend backend, int width, int height, bool visible);
+
+    // Backend to use when none is requested: GLFW for interactive sessions,
+    // otherwise the first headless backend compiled in.
+    static Backend defaultBackend(bool interactive);
+
+    static bool parseBackend(const std::string& name, Backend* backend);
+    static const char* backendName(Backend backend);
+};
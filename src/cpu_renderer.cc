@@ -0,0 +1,319 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+#include <glm/gtc/packing.hpp>
+
+#include "cpu_renderer.h"
+#include "profiler.h"
+#include "Float4.hpp"
+
+namespace {
+
+void write_pixel(unsigned char* dst, const ChannelFormat& format, const float value[4])
+{
+    switch(format.type) {
+    case ChannelFormat::FLOAT16:
+        for(int i = 0; i < format.components; i++) {
+            uint16_t half = glm::packHalf1x16(value[i]);
+            memcpy(dst + 2 * i, &half, 2);
+        }
+        break;
+    case ChannelFormat::UNORM16:
+        for(int i = 0; i < format.components; i++) {
+            uint16_t unorm = uint16_t(std::min(std::max(value[i], 0.0f), 1.0f) * 65535.0f + 0.5f);
+            memcpy(dst + 2 * i, &unorm, 2);
+        }
+        break;
+    default:
+        memcpy(dst, value, format.components * sizeof(float));
+    }
+}
+
+}
+
+const int CPURenderer::kTileSize;
+const int CPURenderer::PixelBlock::kStride;
+
+CPURenderer::CPURenderer(const std::string& output_dir, Scene* scene, int width, int height,
+    int num_writers, int num_threads)
+    : Renderer(output_dir, scene, width, height, num_writers,
+        scene ? scene->getOutputFormat() : OutputFormat()),
+    mPool(num_threads), mTransformVersion(scene ? scene->getTransformVersion() : 0)
+{
+    mFrameWriter = new FrameWriter(mNumWriters, mNumWriters + 2,
+        [this](int slot) { releaseSlot(slot); });
+    if(scene) {
+        mFrameWriter->setOutputFormat(mOutputFormat);
+        mFrameWriter->setTonemap(scene->getTonemap());
+    }
+    initSlots();
+}
+
+CPURenderer::~CPURenderer()
+{
+    finish();
+    mFrameWriter->close();
+    delete mFrameWriter;
+}
+
+void CPURenderer::initSlots()
+{
+    // only called without frames in flight. Each writer thread can hold
+    // one slot while the next frame is drawn into another and one more is
+    // queued.
+    mSlots.resize(mNumWriters + 2);
+    for(auto& slot: mSlots) {
+        for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+            size_t pixel_bytes = c == OutputFormat::DEPTH ? sizeof(float) : mOutputFormat[c].pixelBytes();
+            slot.channels[c].clear();
+            if(mOutputFormat[c].enabled)
+                slot.channels[c].resize(size_t(mWidth) * mHeight * pixel_bytes);
+        }
+        slot.writing = false;
+    }
+    mNextSlot = 0;
+    mTilesX = (mWidth + kTileSize - 1) / kTileSize;
+    mTilesY = (mHeight + kTileSize - 1) / kTileSize;
+}
+
+void CPURenderer::setScene(Scene* scene)
+{
+    // frames of the previous scene are written with its settings
+    finish();
+    mScene = scene;
+    mWidth = scene->getWidth();
+    mHeight = scene->getHeight();
+    mOutputFormat = scene->getOutputFormat();
+    initSlots();
+    mFrameWriter->setOutputFormat(mOutputFormat);
+    mFrameWriter->setTonemap(scene->getTonemap());
+    mTransformVersion = scene->getTransformVersion();
+    sceneChanged();
+}
+
+void CPURenderer::resize(int width, int height)
+{
+    if(width == mWidth && height == mHeight)
+        return;
+    finish();
+    mWidth = width;
+    mHeight = height;
+    initSlots();
+}
+
+void CPURenderer::setBatchSize(int batch_size)
+{
+    finish();
+    mBatchSize = std::max(1, std::min(batch_size, MAX_VIEWS_PER_BATCH));
+}
+
+void CPURenderer::releaseSlot(int slot)
+{
+    // called from the writer threads
+    std::lock_guard<std::mutex> lock(mSlotMutex);
+    mSlots[slot].writing = false;
+    mSlotWritten.notify_all();
+}
+
+int CPURenderer::acquireSlot()
+{
+    int slot_idx = mNextSlot;
+    mNextSlot = (mNextSlot + 1) % mSlots.size();
+    ScopedTimer timer("wait for writers");
+    std::unique_lock<std::mutex> lock(mSlotMutex);
+    FrameSlot& slot = mSlots[slot_idx];
+    mSlotWritten.wait(lock, [&slot] { return !slot.writing; });
+    return slot_idx;
+}
+
+void CPURenderer::finish()
+{
+    std::unique_lock<std::mutex> lock(mSlotMutex);
+    for(auto& slot: mSlots) {
+        mSlotWritten.wait(lock, [&slot] { return !slot.writing; });
+    }
+}
+
+void CPURenderer::render(const Camera* camera, const std::string& outfilename)
+{
+    if(!camera)
+        camera = mScene->getCamera();
+    if(mScene->getTransformVersion() != mTransformVersion) {
+        mTransformVersion = mScene->getTransformVersion();
+        sceneChanged();
+    }
+    int slot_idx = acquireSlot();
+    FrameSlot& slot = mSlots[slot_idx];
+
+    {
+        ScopedTimer timer("draw", &mStageTimes.draw_seconds);
+        setupView(camera);
+        drawView(camera, slot);
+    }
+    mStageTimes.frames++;
+    printCullStats(outfilename);
+
+    FrameData frame;
+    for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+        frame.data[c] = mOutputFormat[c].enabled ? slot.channels[c].data() : nullptr;
+    }
+    frame.prefix = mOutputDir + outfilename;
+    frame.width = mWidth;
+    frame.height = mHeight;
+    frame.near = camera->getNear();
+    frame.far = camera->getFar();
+    frame.slot = slot_idx;
+    {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        slot.writing = true;
+    }
+    ScopedTimer timer("queue frame");
+    mFrameWriter->push(frame);
+}
+
+void CPURenderer::render(const std::vector<const Camera*>& cameras,
+    const std::vector<std::string>& outfilenames)
+{
+    assert(cameras.size() == outfilenames.size());
+    for(size_t i = 0; i < cameras.size(); i++) {
+        render(cameras[i], outfilenames[i]);
+    }
+}
+
+void CPURenderer::setupView(const Camera* camera)
+{
+    // uniforms of the phong shaders, see Scene::renderViews
+    mView.view = camera->getViewMatrix();
+    mView.projection = camera->getProjectionMatrix();
+    mView.inv_view_transpose = glm::transpose(glm::inverse(mView.view));
+    mView.cam_pos = glm::vec3(mView.view * glm::vec4(mScene->getCamera()->getPosition(), 1.0f));
+    mView.num_lights = std::min(mScene->getNumLights(), MAX_NUM_LIGHTS);
+    for(int i = 0; i < mView.num_lights; i++) {
+        mView.light_pos[i] = mView.view * mScene->getLightPosition(i);
+        mView.light_color[i] = mScene->getLightColor(i);
+        mView.light_attenuation[i] = mScene->getLightAttenuation(i);
+    }
+    mView.ambient = mScene->getAmbient();
+}
+
+glm::vec4 CPURenderer::transformNormal(glm::uint32 packed_normal, const glm::mat3& normal_matrix) const
+{
+    glm::vec4 normal = glm::unpackSnorm3x10_1x2(packed_normal);
+    return glm::normalize(mView.inv_view_transpose * glm::vec4(normal_matrix * glm::vec3(normal), 0.0f));
+}
+
+void CPURenderer::PixelBlock::add(int pixel, const glm::vec3& position, const glm::vec3& normal,
+    const glm::vec3& albedo)
+{
+    int n = pixels.size();
+    array(PX)[n] = position.x;
+    array(PY)[n] = position.y;
+    array(PZ)[n] = position.z;
+    array(NX)[n] = normal.x;
+    array(NY)[n] = normal.y;
+    array(NZ)[n] = normal.z;
+    array(AR)[n] = albedo.r;
+    array(AG)[n] = albedo.g;
+    array(AB)[n] = albedo.b;
+    pixels.push_back(pixel);
+}
+
+void CPURenderer::shadePixels(PixelBlock& block) const
+{
+    int num_pixels = block.pixels.size();
+    for(int n = num_pixels; n < ((num_pixels + 3) & ~3); n++) {
+        for(int k = 0; k < PixelBlock::NUM_ARRAYS; k++) {
+            block.array(k)[n] = 1.0f;
+        }
+    }
+
+    // the phong fragment shader
+    const Float4 zero(0.0f), one(1.0f);
+    const Float4 cam_x(mView.cam_pos.x), cam_y(mView.cam_pos.y), cam_z(mView.cam_pos.z);
+    for(int n = 0; n < num_pixels; n += 4) {
+        Float4 px = Float4::load(block.array(PixelBlock::PX) + n);
+        Float4 py = Float4::load(block.array(PixelBlock::PY) + n);
+        Float4 pz = Float4::load(block.array(PixelBlock::PZ) + n);
+        Float4 nx = Float4::load(block.array(PixelBlock::NX) + n);
+        Float4 ny = Float4::load(block.array(PixelBlock::NY) + n);
+        Float4 nz = Float4::load(block.array(PixelBlock::NZ) + n);
+        Float4 length = sqrt(nx * nx + ny * ny + nz * nz);
+        nx = nx / length;
+        ny = ny / length;
+        nz = nz / length;
+        // flip normals facing away from the camera
+        Float4 facing = (cam_x - px) * nx + (cam_y - py) * ny + (cam_z - pz) * nz;
+        Float4 sign = select(facing > zero, one, select(facing < zero, Float4(-1.0f), zero));
+        nx = sign * nx;
+        ny = sign * ny;
+        nz = sign * nz;
+        nx.store(block.array(PixelBlock::NX) + n);
+        ny.store(block.array(PixelBlock::NY) + n);
+        nz.store(block.array(PixelBlock::NZ) + n);
+
+        Float4 irradiance[3] = { zero, zero, zero };
+        for(int i = 0; i < mView.num_lights; i++) {
+            const glm::vec4& light = mView.light_pos[i];
+            const glm::vec3& attenuation = mView.light_attenuation[i];
+            Float4 dx = Float4(light.x) - px, dy = Float4(light.y) - py, dz = Float4(light.z) - pz;
+            Float4 dw = Float4(light.w - 1.0f);
+            Float4 dist = sqrt(dx * dx + dy * dy + dz * dz + dw * dw);
+            Float4 cos_angle = (nx * dx + ny * dy + nz * dz) / dist;
+            Float4 divisor = Float4(attenuation.x) + dist * Float4(attenuation.y) + dist * dist * Float4(attenuation.z);
+            divisor = select(abs(divisor) < Float4(1e-8f), one, divisor);
+            Float4 factor = cos_angle / divisor;
+            for(int c = 0; c < 3; c++) {
+                irradiance[c] += Float4(mView.light_color[i][c]) * factor;
+            }
+        }
+        for(int c = 0; c < 3; c++) {
+            Float4 albedo = Float4::load(block.array(PixelBlock::AR + c) + n);
+            (albedo * irradiance[c] + Float4(mView.ambient[c])).store(block.array(PixelBlock::CR + c) + n);
+        }
+    }
+}
+
+void CPURenderer::writeTile(const PixelBlock& block, const float* depth, int tile_x, int tile_y,
+    FrameSlot& slot) const
+{
+    int x0 = tile_x * kTileSize, y0 = tile_y * kTileSize;
+    int x1 = std::min(x0 + kTileSize, mWidth), y1 = std::min(y0 + kTileSize, mHeight);
+    size_t pixel_bytes[OutputFormat::NUM_CHANNELS];
+    for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+        pixel_bytes[c] = c == OutputFormat::DEPTH ? sizeof(float) : mOutputFormat[c].pixelBytes();
+    }
+
+    // pixels without a triangle keep the clear values
+    const float clear[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for(int y = y0; y < y1; y++) {
+        for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+            if(!mOutputFormat[c].enabled)
+                continue;
+            size_t offset = (size_t(y) * mWidth + x0) * pixel_bytes[c];
+            if(c == OutputFormat::DEPTH) {
+                memcpy(&slot.channels[c][offset], &depth[(y - y0) * kTileSize], (x1 - x0) * sizeof(float));
+                continue;
+            }
+            for(int x = x0; x < x1; x++) {
+                write_pixel(&slot.channels[c][offset + (x - x0) * pixel_bytes[c]], mOutputFormat[c], clear);
+            }
+        }
+    }
+    for(size_t n = 0; n < block.pixels.size(); n++) {
+        int p = block.pixels[n];
+        size_t pixel = size_t(y0 + p / kTileSize) * mWidth + x0 + p % kTileSize;
+        const float color[4] = { block.array(PixelBlock::CR)[n], block.array(PixelBlock::CG)[n],
+            block.array(PixelBlock::CB)[n], 1.0f };
+        const float position[4] = { block.array(PixelBlock::PX)[n], block.array(PixelBlock::PY)[n],
+            block.array(PixelBlock::PZ)[n], 1.0f };
+        const float normal[4] = { block.array(PixelBlock::NX)[n], block.array(PixelBlock::NY)[n],
+            block.array(PixelBlock::NZ)[n], 0.0f };
+        const float* values[3] = { color, position, normal };
+        for(int c = 0; c < 3; c++) {
+            if(mOutputFormat[c].enabled)
+                write_pixel(&slot.channels[c][pixel * pixel_bytes[c]], mOutputFormat[c], values[c]);
+        }
+    }
+}
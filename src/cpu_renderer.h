@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+#include "renderer.h"
+#include "ThreadPool.hpp"
+
+// Base of the renderers that run on the CPU, for machines without a usable
+// GL driver. They produce the same G-buffer as GLRenderer with the phong
+// shaders (scenes/shaders/phong): color, view space position and normal,
+// and depth, all with the channels and precisions of the scene's output
+// format. The scene's GLSL is not interpreted, the phong shading is built
+// in. Only TriangleMesh objects are drawn.
+//
+// Views are drawn by drawView() on a pool of threads into frame slots,
+// which are handed to the FrameWriter and recycled round robin.
+class CPURenderer: public Renderer {
+public:
+    ~CPURenderer();
+
+    void setScene(Scene* scene) override;
+    void resize(int width, int height) override;
+    void render(const Camera* camera = nullptr, const std::string& outfilename="offscreen") override;
+    // Views are rendered one after the other
+    void render(const std::vector<const Camera*>& cameras,
+        const std::vector<std::string>& outfilenames) override;
+    void setBatchSize(int batch_size) override;
+    void finish() override;
+
+    static const int kTileSize = 64;
+protected:
+    // num_threads 0: one per core
+    CPURenderer(const std::string& output_dir, Scene* scene, int width, int height,
+        int num_writers, int num_threads);
+
+    ThreadPool mPool;
+    int mTilesX, mTilesY;   // kTileSize tiles covering the viewport
+
+    // Frames handed to the writers
+    struct FrameSlot {
+        std::vector<unsigned char> channels[OutputFormat::NUM_CHANNELS];
+        bool writing;
+    };
+
+    // Per view constants of the shading
+    struct ViewState {
+        glm::mat4 view, projection;
+        glm::mat4 inv_view_transpose;
+        glm::vec3 cam_pos;          // scene camera in view space
+        int num_lights;
+        glm::vec4 light_pos[MAX_NUM_LIGHTS];    // view space
+        glm::vec3 light_color[MAX_NUM_LIGHTS];
+        glm::vec3 light_attenuation[MAX_NUM_LIGHTS];
+        glm::vec3 ambient;
+    };
+    ViewState mView;
+
+    // Covered pixels of a tile with the inputs of the phong fragment shader,
+    // structure of arrays padded to a multiple of four. shadePixels() adds
+    // the color and turns the normals towards the camera.
+    struct PixelBlock {
+        enum { PX, PY, PZ, NX, NY, NZ, AR, AG, AB, CR, CG, CB, NUM_ARRAYS };
+        static const int kStride = kTileSize * kTileSize + 4;
+
+        std::vector<float> values;
+        std::vector<int> pixels;    // y * kTileSize + x in the tile
+
+        PixelBlock(): values(NUM_ARRAYS * kStride) {}
+        float* array(int k) { return &values[k * kStride]; }
+        const float* array(int k) const { return &values[k * kStride]; }
+        void add(int pixel, const glm::vec3& position, const glm::vec3& normal, const glm::vec3& albedo);
+    };
+
+    // Draw a view into the slot, with mView set up for it
+    virtual void drawView(const Camera* camera, FrameSlot& slot) = 0;
+    // A new scene was set, no frames are in flight, or objects of the
+    // scene were moved since the last call, frames may still be written
+    virtual void sceneChanged() {}
+
+    // Normal output of the phong vertex shader for a packed vertex normal
+    // of an object with the given normal_matrix()
+    glm::vec4 transformNormal(glm::uint32 packed_normal, const glm::mat3& normal_matrix) const;
+    void shadePixels(PixelBlock& block) const;
+    // Write the pixels of the block into the tile of the slot, the others
+    // get the clear values. depth holds kTileSize floats per row of the
+    // tile.
+    void writeTile(const PixelBlock& block, const float* depth, int tile_x, int tile_y,
+        FrameSlot& slot) const;
+private:
+    std::vector<FrameSlot> mSlots;
+    int mNextSlot;
+    unsigned int mTransformVersion;     // of mScene at the last sceneChanged()
+    std::mutex mSlotMutex;
+    std::condition_variable mSlotWritten;
+
+    void initSlots();
+    int acquireSlot();
+    void releaseSlot(int slot);
+    void setupView(const Camera* camera);
+};
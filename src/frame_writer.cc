@@ -0,0 +1,234 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+#include <chrono>
+#include <iomanip>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb/stb_image_write.h>
+#include <npy/npy.hpp>
+
+#include "profiler.h"
+#include "frame_writer.h"
+
+static std::string npy_header(int width, int height, const ChannelFormat& format)
+{
+    std::vector<npy::ndarray_len_t> shape = {
+        npy::ndarray_len_t(height), npy::ndarray_len_t(width) };
+    if(format.components > 1)
+        shape.push_back(format.components);
+    std::ostringstream ss;
+    npy::write_header(ss, format.dtype(), false, shape);
+    return ss.str();
+}
+
+void store_as_npy(const std::string& outfilename_prefix,
+    int width, int height, const ChannelFormat& format, const void* data)
+{
+    std::ofstream stream(outfilename_prefix + ".npy", std::ofstream::binary);
+    if(!stream) {
+        throw std::runtime_error("io error: failed to open a file.");
+    }
+    stream << npy_header(width, height, format);
+    stream.write(reinterpret_cast<const char*>(data), format.pixelBytes() * height * width);
+}
+
+static void append_to_buffer(void* context, void* data, int size)
+{
+    std::vector<unsigned char>* buffer = static_cast<std::vector<unsigned char>*>(context);
+    buffer->insert(buffer->end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+}
+
+static void store_buffer(const std::string& filename, const unsigned char* data, size_t size)
+{
+    std::ofstream stream(filename, std::ofstream::binary);
+    stream.write(reinterpret_cast<const char*>(data), size);
+    if(!stream) {
+        throw std::runtime_error("io error: failed to write " + filename);
+    }
+}
+
+static void store_as_dat(const std::string& filename, int width, int height, const ChannelFormat& format, const void* data)
+{
+    std::ofstream outfile(filename.c_str(), std::ios::out | std::ios::binary);
+    outfile.write((const char*) data, format.pixelBytes() * width * height);
+}
+
+FrameWriter::FrameWriter(int num_threads, size_t queue_capacity, ReleaseCallback release):
+    mQueue(queue_capacity), mRelease(release), mStackedOutput(nullptr),
+    mCompressionLevel(0), mCompressionStats(), mStats()
+{
+    for(int i = 0; i < num_threads; i++) {
+        mThreads.push_back(std::thread(&FrameWriter::run, this, i));
+    }
+}
+
+FrameWriter::~FrameWriter()
+{
+    close();
+}
+
+void FrameWriter::push(const FrameData& frame)
+{
+    if(!mQueue.push(frame)) {
+        std::cout << "Error: frame writer is closed, dropping " << frame.prefix << std::endl;
+        mRelease(frame.slot);
+    }
+}
+
+void FrameWriter::close()
+{
+    mQueue.close();
+    for(auto& thread: mThreads) {
+        if(thread.joinable())
+            thread.join();
+    }
+    mThreads.clear();
+    printCompressionStats();
+}
+
+void FrameWriter::printCompressionStats()
+{
+    for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+        CompressionStats& stats = mCompressionStats[c];
+        if(stats.raw_bytes == 0)
+            continue;
+        std::cout << "Compressed " << OutputFormat::channelName(c) << ": "
+            << std::fixed << std::setprecision(1)
+            << stats.raw_bytes / 1048576.0 << " MB -> " << stats.compressed_bytes / 1048576.0 << " MB ("
+            << std::setprecision(2) << double(stats.raw_bytes) / stats.compressed_bytes << "x), "
+            << std::setprecision(1) << stats.raw_bytes / 1048576.0 / stats.seconds << " MB/s per thread"
+            << std::defaultfloat << std::endl;
+        stats = CompressionStats();
+    }
+}
+
+void FrameWriter::run(int index)
+{
+    if(Profiler::enabled())
+        Profiler::instance().setThreadName("frame writer " + std::to_string(index));
+    Buffers buffers;
+    FrameData frame;
+    while(mQueue.pop(frame)) {
+        try {
+            write(frame, buffers);
+        } catch(std::exception& e) {
+            std::cout << "Exception in FrameWriter " << e.what() << std::endl;
+        }
+        mRelease(frame.slot);
+    }
+}
+
+void FrameWriter::write(const FrameData& frame, Buffers& buffers)
+{
+    int width = frame.width;
+    int height = frame.height;
+    size_t num_pixels = size_t(width) * height;
+    const void* data[OutputFormat::NUM_CHANNELS];
+    std::copy(frame.data, frame.data + OutputFormat::NUM_CHANNELS, data);
+
+    // Encode everything in memory first, then write it out
+    auto start = std::chrono::steady_clock::now();
+    const ChannelFormat& depth = mFormat[OutputFormat::DEPTH];
+    if(depth.enabled) {
+        ScopedTimer timer("linearize depth");
+        buffers.depth.resize(num_pixels * depth.pixelBytes());
+        linearize_depth(depth, static_cast<const float*>(data[OutputFormat::DEPTH]), num_pixels,
+            frame.near, frame.far, buffers.depth.data());
+        data[OutputFormat::DEPTH] = buffers.depth.data();
+    }
+
+    const ChannelFormat& color = mFormat[OutputFormat::COLOR];
+    if(color.enabled) {
+        const float* rgba = static_cast<const float*>(data[OutputFormat::COLOR]);
+        if(color.components != 4 || color.type != ChannelFormat::FLOAT32) {
+            buffers.color.resize(num_pixels * 4);
+            channel_to_rgba_float(color, data[OutputFormat::COLOR], num_pixels, buffers.color.data());
+            rgba = buffers.color.data();
+        }
+        buffers.ldr.resize(num_pixels * 4);
+        {
+            ScopedTimer timer("tonemap");
+            mTonemap.apply(rgba, buffers.ldr.data(), width, height);
+        }
+        if(!mStackedOutput) {
+            ScopedTimer timer("encode png");
+            buffers.png.clear();
+            stbi_write_png_to_func(append_to_buffer, &buffers.png,
+                                   width, height, 4, buffers.ldr.data(), width * 4);
+        }
+    }
+
+    bool compress = mCompressionLevel > 0 && !mStackedOutput;
+    for(int c = 0; c < OutputFormat::NUM_CHANNELS && compress; c++) {
+        if(!mFormat[c].enabled)
+            continue;
+        // the element size is that of one component
+        const ChannelFormat& format = mFormat[c];
+        size_t num_bytes = num_pixels * format.pixelBytes();
+        double seconds = 0.0;
+        {
+            ScopedTimer timer("compress", &seconds);
+            compress_npyz(npy_header(width, height, format), data[c], num_bytes,
+                format.pixelBytes() / format.components, mCompressionLevel, buffers.compression[c]);
+        }
+        std::lock_guard<std::mutex> lock(mStatsMutex);
+        mCompressionStats[c].raw_bytes += num_bytes;
+        mCompressionStats[c].compressed_bytes += buffers.compression[c].output.size();
+        mCompressionStats[c].seconds += seconds;
+    }
+    auto encoded = std::chrono::steady_clock::now();
+
+    size_t bytes_written = 0;
+    double write_seconds = 0.0;
+    {
+        ScopedTimer timer("write files", &write_seconds);
+        if(mStackedOutput) {
+            bytes_written = mStackedOutput->write(frame.prefix, width, height, data,
+                color.enabled ? buffers.ldr.data() : nullptr);
+        } else {
+            // file suffixes of the channels
+            const char* suffixes[OutputFormat::NUM_CHANNELS] = { "", "_pos", "_normal", "_depth" };
+            for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+                if(!mFormat[c].enabled)
+                    continue;
+                std::string prefix = frame.prefix + suffixes[c];
+                if(compress) {
+                    const std::vector<unsigned char>& npyz = buffers.compression[c].output;
+                    store_buffer(prefix + ".npyz", npyz.data(), npyz.size());
+                    bytes_written += npyz.size();
+                } else {
+                    size_t num_bytes = num_pixels * mFormat[c].pixelBytes();
+                    store_as_npy(prefix, width, height, mFormat[c], data[c]);
+                    store_as_dat(prefix + ".dat", width, height, mFormat[c], data[c]);
+                    bytes_written += 2 * num_bytes;
+                }
+                if(c == OutputFormat::COLOR) {
+                    store_buffer(frame.prefix + ".png", buffers.png.data(), buffers.png.size());
+                    bytes_written += buffers.png.size();
+                }
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    mStats.frames++;
+    mStats.encode_seconds += std::chrono::duration<double>(encoded - start).count();
+    mStats.write_seconds += write_seconds;
+    mStats.bytes_written += bytes_written;
+}
+
+FrameWriter::Stats FrameWriter::getStats()
+{
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    return mStats;
+}
+
+void FrameWriter::resetStats()
+{
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    mStats = Stats();
+}
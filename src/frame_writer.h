@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <mutex>
+
+#include "tonemap.h"
+#include "output_format.h"
+#include "BoundedBlockingQueue.hpp"
+#include "stacked_output.h"
+#include "compressed_array.h"
+
+// One rendered frame ready to be written. The channel pointers are owned by
+// the producer (e.g. mapped pixel buffers) and stay valid until the writer
+// hands the slot back through the release callback.
+struct FrameData {
+    std::string prefix;  // output path without extension
+    int width;
+    int height;
+    // Laid out as given by the writer's OutputFormat, nullptr for disabled
+    // channels. Depth is the raw [0, 1] float depth buffer.
+    const void* data[OutputFormat::NUM_CHANNELS];
+    float near, far;     // depth range of the view
+    int slot;
+};
+
+// Writes frames on a pool of threads so that disk I/O and PNG encoding do
+// not stall the GL thread. push() blocks when the writers fall behind.
+class FrameWriter {
+public:
+    using ReleaseCallback = std::function<void(int slot)>;
+
+    FrameWriter(int num_threads, size_t queue_capacity, ReleaseCallback release);
+    ~FrameWriter();
+
+    // Only call while no frames are queued (e.g. after a flush)
+    void setTonemap(const Tonemap& tonemap) { mTonemap = TonemapKernel(tonemap); }
+    void setOutputFormat(const OutputFormat& format) { mFormat = format; }
+    // Deflate level 1-9 to write the channels as byte shuffled, compressed
+    // .npyz files instead of .npy and .dat files, 0 for uncompressed output.
+    // Only call while no frames are queued.
+    void setCompression(int level) { mCompressionLevel = level; }
+    // Write frames into a stacked container instead of files per frame,
+    // nullptr for files. Only call while no frames are queued.
+    void setStackedOutput(StackedOutput* output) { mStackedOutput = output; }
+
+    void push(const FrameData& frame);
+
+    // Time the writer threads spent per frame, summed over the threads
+    struct Stats {
+        size_t frames;
+        double encode_seconds;  // depth, tone mapping, PNG and compression
+        double write_seconds;   // file output
+        size_t bytes_written;
+
+        Stats(): frames(0), encode_seconds(0.0), write_seconds(0.0), bytes_written(0) {}
+    };
+    Stats getStats();
+    void resetStats();
+
+    // Write out the queued frames and stop the writer threads. Reports the
+    // compression ratio and throughput per channel.
+    void close();
+private:
+    BoundedBlockingQueue<FrameData> mQueue;
+    std::vector<std::thread> mThreads;
+    ReleaseCallback mRelease;
+    TonemapKernel mTonemap;
+    OutputFormat mFormat;
+    StackedOutput* mStackedOutput;
+    int mCompressionLevel;
+
+    struct CompressionStats {
+        size_t raw_bytes, compressed_bytes;
+        double seconds;     // summed over the writer threads
+    };
+    CompressionStats mCompressionStats[OutputFormat::NUM_CHANNELS];
+    Stats mStats;
+    std::mutex mStatsMutex;     // guards mCompressionStats and mStats
+    void printCompressionStats();
+
+    // Per thread scratch space for the data derived from a frame
+    struct Buffers {
+        std::vector<float> color;           // color as RGBA float32 for tone mapping
+        std::vector<unsigned char> ldr;     // tonemapped color
+        std::vector<unsigned char> png;     // encoded PNG file
+        std::vector<unsigned char> depth;   // linear depth
+        CompressionBuffers compression[OutputFormat::NUM_CHANNELS];
+    };
+    void run(int index);
+    void write(const FrameData& frame, Buffers& buffers);
+};
@@ -0,0 +1,190 @@
+#include <iostream>
+#include <cassert>
+
+#include "utils.h"
+#include "shader.h"
+#include "gpu_cache.h"
+
+namespace {
+
+// Separates the key spaces of programs and meshes
+const uint64_t kProgramSeed = hash_bytes("program", 7);
+const uint64_t kMeshSeed = hash_bytes("mesh", 4);
+
+size_t index_size(GLenum index_type)
+{
+    return index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+}
+
+}
+
+GPUResourceCache::GPUResourceCache(size_t budget_bytes)
+    : mBudget(budget_bytes), mStats()
+{
+}
+
+GPUResourceCache::~GPUResourceCache()
+{
+    for(auto& it: mEntries) {
+        destroy(it.second);
+    }
+}
+
+void GPUResourceCache::setBudget(size_t budget_bytes)
+{
+    mBudget = budget_bytes;
+    evict();
+}
+
+GPUResourceCache::Entry* GPUResourceCache::lookup(uint64_t key)
+{
+    auto it = mEntries.find(key);
+    if(it == mEntries.end()) {
+        mStats.misses++;
+        return nullptr;
+    }
+    Entry& entry = it->second;
+    if(entry.refcount++ == 0) {
+        mLRU.erase(entry.lru);
+    }
+    mStats.hits++;
+    return &entry;
+}
+
+GLuint GPUResourceCache::acquireProgram(const std::string& vs_code, const std::string& fs_code)
+{
+    uint64_t key = hash_bytes(vs_code.data(), vs_code.size(), kProgramSeed);
+    key = hash_bytes(fs_code.data(), fs_code.size(), key);
+    Entry* entry = lookup(key);
+    if(entry) {
+        return entry->program;
+    }
+
+    Entry& new_entry = mEntries[key];
+    new_entry.type = PROGRAM;
+    new_entry.key = key;
+    new_entry.refcount = 1;
+    // nominal size, the driver does not report the size of a program
+    new_entry.bytes = vs_code.size() + fs_code.size();
+    new_entry.program = LoadShadersFromSource(vs_code, fs_code);
+    mProgramKeys[new_entry.program] = key;
+    mStats.bytes += new_entry.bytes;
+    evict();
+    return new_entry.program;
+}
+
+void GPUResourceCache::releaseProgram(GLuint program)
+{
+    auto it = mProgramKeys.find(program);
+    assert(it != mProgramKeys.end());
+    release(it->second);
+}
+
+GLuint GPUResourceCache::acquireMesh(uint64_t content_hash, const MeshArrays& arrays, const VertexLayout& layout)
+{
+    uint64_t key = hash_bytes(&content_hash, sizeof(content_hash), kMeshSeed);
+    Entry* entry = lookup(key);
+    if(!entry) {
+        entry = &mEntries[key];
+        entry->type = MESH;
+        entry->key = key;
+        entry->refcount = 1;
+        entry->program = 0;
+
+        size_t vertex_bytes = arrays.num_vertices * sizeof(Vertex);
+        size_t texcoord_bytes = arrays.texcoords ? arrays.num_vertices * sizeof(glm::uint32) : 0;
+        size_t index_bytes = arrays.num_indices * index_size(arrays.index_type);
+        glGenBuffers(3, entry->buffers);
+        glBindBuffer(GL_ARRAY_BUFFER, entry->buffers[0]);
+        glBufferData(GL_ARRAY_BUFFER, vertex_bytes, arrays.vertices, GL_STATIC_DRAW);
+        if(texcoord_bytes > 0) {
+            glBindBuffer(GL_ARRAY_BUFFER, entry->buffers[1]);
+            glBufferData(GL_ARRAY_BUFFER, texcoord_bytes, arrays.texcoords, GL_STATIC_DRAW);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, entry->buffers[2]);
+        glBufferData(GL_COPY_WRITE_BUFFER, index_bytes, arrays.indices, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        entry->bytes = vertex_bytes + texcoord_bytes + index_bytes;
+        mStats.bytes += entry->bytes;
+        std::cout << "Uploaded mesh: " << arrays.num_vertices << " vertices, "
+            << entry->bytes << " bytes" << std::endl;
+    }
+
+    for(auto& vao: entry->vertex_arrays) {
+        if(vao.first == layout)
+            return vao.second;
+    }
+
+    // Vertex array for this layout, recording the buffers above
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, entry->buffers[0]);
+    glEnableVertexAttribArray(layout.position);
+    glVertexAttribPointer(layout.position, 3, GL_FLOAT, GL_FALSE,
+                          sizeof(Vertex), (void*) offsetof(Vertex, position));
+    if(layout.normal >= 0) {
+        glEnableVertexAttribArray(layout.normal);
+        glVertexAttribPointer(layout.normal, 4, GL_INT_2_10_10_10_REV, GL_TRUE,
+                              sizeof(Vertex), (void*) offsetof(Vertex, normal));
+    }
+    if(arrays.texcoords && layout.texcoord >= 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, entry->buffers[1]);
+        glEnableVertexAttribArray(layout.texcoord);
+        glVertexAttribPointer(layout.texcoord, 2, GL_HALF_FLOAT, GL_FALSE,
+                              sizeof(glm::uint32), (void*) 0);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, entry->buffers[2]);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    entry->vertex_arrays.push_back(std::make_pair(layout, vao));
+
+    evict();
+    return vao;
+}
+
+void GPUResourceCache::releaseMesh(uint64_t content_hash)
+{
+    release(hash_bytes(&content_hash, sizeof(content_hash), kMeshSeed));
+}
+
+void GPUResourceCache::release(uint64_t key)
+{
+    auto it = mEntries.find(key);
+    assert(it != mEntries.end() && it->second.refcount > 0);
+    Entry& entry = it->second;
+    if(--entry.refcount == 0) {
+        mLRU.push_front(key);
+        entry.lru = mLRU.begin();
+        evict();
+    }
+}
+
+void GPUResourceCache::evict()
+{
+    while(mStats.bytes > mBudget && !mLRU.empty()) {
+        auto it = mEntries.find(mLRU.back());
+        mLRU.pop_back();
+        destroy(it->second);
+        mStats.bytes -= it->second.bytes;
+        mStats.evictions++;
+        mEntries.erase(it);
+    }
+    mStats.entries = mEntries.size();
+}
+
+void GPUResourceCache::destroy(Entry& entry)
+{
+    if(entry.type == PROGRAM) {
+        mProgramKeys.erase(entry.program);
+        glDeleteProgram(entry.program);
+        return;
+    }
+    for(auto& vao: entry.vertex_arrays) {
+        glDeleteVertexArrays(1, &vao.second);
+    }
+    glDeleteBuffers(3, entry.buffers);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+
+#include <glad/glad.h>
+
+#include "object.h"
+
+// Attribute locations a vertex array object is built for
+struct VertexLayout {
+    GLint position;
+    GLint normal;
+    GLint texcoord;
+
+    bool operator==(const VertexLayout& other) const {
+        return position == other.position && normal == other.normal && texcoord == other.texcoord;
+    }
+};
+
+// GPU resources shared by all scenes rendered with one GL context. Programs
+// are keyed by their shader sources and meshes by the content of their
+// vertex and index arrays, so scenes referencing the same shaders or OBJ
+// files reuse the objects created for an earlier scene.
+//
+// Resources are reference counted by the objects using them. Unreferenced
+// resources stay cached until the total size exceeds the budget; they are
+// then evicted least recently used first. Resources in use are never
+// evicted, so the budget may be exceeded by a single large scene.
+class GPUResourceCache {
+public:
+    struct Stats {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t bytes;       // size of all cached resources
+        size_t entries;
+    };
+
+    GPUResourceCache(size_t budget_bytes);
+    // Deletes all GL objects, the context must still be current
+    ~GPUResourceCache();
+
+    void setBudget(size_t budget_bytes);
+
+    // Program built from the given shader sources, compiled on a miss
+    GLuint acquireProgram(const std::string& vs_code, const std::string& fs_code);
+    void releaseProgram(GLuint program);
+
+    // Vertex array object of the mesh arrays for a vertex layout. The
+    // buffers are uploaded on a miss; content_hash identifies the arrays.
+    GLuint acquireMesh(uint64_t content_hash, const MeshArrays& arrays, const VertexLayout& layout);
+    void releaseMesh(uint64_t content_hash);
+
+    const Stats& getStats() const { return mStats; }
+private:
+    enum Type { PROGRAM, MESH };
+    struct Entry {
+        Type type;
+        uint64_t key;
+        int refcount;
+        size_t bytes;
+        GLuint program;
+        GLuint buffers[3];  // vertices, texture coordinates, indices
+        std::vector<std::pair<VertexLayout, GLuint>> vertex_arrays;
+        std::list<uint64_t>::iterator lru;  // valid while refcount == 0
+    };
+    size_t mBudget;
+    Stats mStats;
+    std::unordered_map<uint64_t, Entry> mEntries;
+    std::unordered_map<GLuint, uint64_t> mProgramKeys;
+    // Unreferenced entries, most recently used first
+    std::list<uint64_t> mLRU;
+
+    Entry* lookup(uint64_t key);
+    void release(uint64_t key);
+    void evict();
+    void destroy(Entry& entry);
+};
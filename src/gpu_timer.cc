@@ -0,0 +1,67 @@
+#include "gpu_timer.h"
+
+void GPUTimer::begin(const char* name)
+{
+    if(!Profiler::enabled())
+        return;
+    if(mQueries.empty()) {
+        mQueries.resize(kNumQueries);
+        for(auto& query: mQueries) {
+            glGenQueries(1, &query.id);
+        }
+    }
+    if(mPending == kNumQueries)
+        collectOldest(true);
+
+    Query& query = mQueries[(mHead + mPending) % kNumQueries];
+    query.name = name;
+    query.submitted = Profiler::Clock::now();
+    glBeginQuery(GL_TIME_ELAPSED, query.id);
+    mActive = true;
+}
+
+void GPUTimer::end()
+{
+    if(!mActive)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    mActive = false;
+    mPending++;
+}
+
+bool GPUTimer::collectOldest(bool wait)
+{
+    Query& query = mQueries[mHead];
+    if(!wait) {
+        GLint available = 0;
+        glGetQueryObjectiv(query.id, GL_QUERY_RESULT_AVAILABLE, &available);
+        if(!available)
+            return false;
+    }
+    GLuint64 elapsed_ns = 0;
+    glGetQueryObjectui64v(query.id, GL_QUERY_RESULT, &elapsed_ns);
+    // The work cannot have taken longer than the time since it was
+    // submitted. llvmpipe reports the time since startup for the first
+    // query that draws, such results are dropped.
+    auto since_submit = std::chrono::duration_cast<std::chrono::nanoseconds>(Profiler::Clock::now() - query.submitted);
+    if(elapsed_ns <= GLuint64(since_submit.count()))
+        Profiler::instance().recordGPU(query.name, query.submitted, elapsed_ns);
+    mHead = (mHead + 1) % kNumQueries;
+    mPending--;
+    return true;
+}
+
+void GPUTimer::collect(bool wait)
+{
+    while(mPending > 0 && collectOldest(wait)) {
+    }
+}
+
+void GPUTimer::release()
+{
+    collect(true);
+    for(auto& query: mQueries) {
+        glDeleteQueries(1, &query.id);
+    }
+    mQueries.clear();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <glad/glad.h>
+
+#include "profiler.h"
+
+// GL_TIME_ELAPSED queries around GPU work, reported to the Profiler. The
+// queries live in a ring and their results are collected once available,
+// so timing does not stall the pipeline. Does nothing while the profiler is
+// disabled. Queries cannot be nested.
+class GPUTimer {
+public:
+    GPUTimer(): mHead(0), mPending(0), mActive(false) {}
+
+    void begin(const char* name);
+    void end();
+    // Report the finished queries; with wait, all pending ones
+    void collect(bool wait);
+    // Delete the queries, while the context is still current
+    void release();
+private:
+    static const int kNumQueries = 64;
+    struct Query {
+        GLuint id;
+        const char* name;
+        Profiler::Clock::time_point submitted;
+    };
+    std::vector<Query> mQueries;
+    int mHead;      // oldest pending query
+    int mPending;
+    bool mActive;
+
+    bool collectOldest(bool wait);
+};
@@ -0,0 +1,69 @@
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "keyframes.h"
+
+namespace {
+
+// Rotation from camera to world space of a look-at camera
+glm::quat camera_orientation(const Camera& camera)
+{
+    glm::mat4 camera_to_world = glm::inverse(camera.getViewMatrix());
+    return glm::normalize(glm::quat_cast(glm::mat3(camera_to_world)));
+}
+
+// Tangent of the position spline at keyframe i, in units per second
+glm::vec3 tangent(const std::vector<Keyframe>& keyframes, size_t i)
+{
+    size_t prev = i > 0 ? i - 1 : i;
+    size_t next = i + 1 < keyframes.size() ? i + 1 : i;
+    double dt = keyframes[next].time - keyframes[prev].time;
+    if(dt <= 0.0)
+        return glm::vec3(0.0f);
+    return (keyframes[next].camera.getPosition() - keyframes[prev].camera.getPosition()) / float(dt);
+}
+
+}
+
+Camera interpolate_keyframes(const std::vector<Keyframe>& keyframes, double time)
+{
+    if(time <= keyframes.front().time || keyframes.size() == 1)
+        return keyframes.front().camera;
+    if(time >= keyframes.back().time)
+        return keyframes.back().camera;
+
+    // keyframes a and b = a + 1 enclose time
+    auto after = std::upper_bound(keyframes.begin(), keyframes.end(), time,
+        [](double t, const Keyframe& keyframe) { return t < keyframe.time; });
+    size_t b = after - keyframes.begin();
+    size_t a = b - 1;
+    const Camera& ca = keyframes[a].camera;
+    const Camera& cb = keyframes[b].camera;
+    float dt = float(keyframes[b].time - keyframes[a].time);
+    float s = float((time - keyframes[a].time) / (keyframes[b].time - keyframes[a].time));
+
+    // cubic Hermite basis
+    float s2 = s * s, s3 = s2 * s;
+    float h00 = 2 * s3 - 3 * s2 + 1;
+    float h10 = s3 - 2 * s2 + s;
+    float h01 = -2 * s3 + 3 * s2;
+    float h11 = s3 - s2;
+    glm::vec3 pos = h00 * ca.getPosition() + h10 * dt * tangent(keyframes, a)
+        + h01 * cb.getPosition() + h11 * dt * tangent(keyframes, b);
+
+    glm::quat orientation = glm::slerp(camera_orientation(ca), camera_orientation(cb), s);
+    glm::vec3 forward = orientation * glm::vec3(0.0f, 0.0f, -1.0f);
+    glm::vec3 up = orientation * glm::vec3(0.0f, 1.0f, 0.0f);
+    float distance = glm::mix(glm::length(ca.getLookAt() - ca.getPosition()),
+                              glm::length(cb.getLookAt() - cb.getPosition()), s);
+
+    return Camera(pos, pos + distance * forward, up,
+        glm::mix(ca.getFocalLength(), cb.getFocalLength(), s),
+        glm::mix(ca.getFovy(), cb.getFovy(), s),
+        glm::mix(ca.getNear(), cb.getNear(), s),
+        glm::mix(ca.getFar(), cb.getFar(), s),
+        ca.getViewport());
+}
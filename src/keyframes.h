@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+
+#include "camera.h"
+
+// Camera at `time` between keyframes sorted by time. Times outside the
+// keyframes are clamped to the first or last one.
+//
+// The position follows a Catmull-Rom spline through the keyframe positions,
+// with tangents taken from the neighbouring keyframes and scaled by their
+// time differences so that unevenly spaced keyframes keep a smooth speed.
+// The orientation is a slerp between the keyframe orientations, and the
+// distance to the look-at point, fovy, focal length, near and far are
+// interpolated linearly. The viewport is the one of the earlier keyframe.
+Camera interpolate_keyframes(const std::vector<Keyframe>& keyframes, double time);
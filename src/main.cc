@@ -1,37 +1,200 @@
 #include <iostream>
 #include <string>
+#include <fstream>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <cxxopts/cxxopts.hpp>
 
 #include <glad/glad.h>
-#include <GLFW/glfw3.h>
-
-#if USE_NATIVE_OSMESA
-    #define GLFW_EXPOSE_NATIVE_OSMESA
-    #include <GLFW/glfw3native.h>
-#endif
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb/stb_image_write.h>
 
 #include "object.h"
 #include "light.h"
 #include "utils.h"
 #include "scene.h"
 #include "renderer.h"
+#include "software_renderer.h"
+#include "ray_caster.h"
 #include "camera.h"
+#include "context.h"
+#include "mesh_cache.h"
+#include "program_cache.h"
+#include "server.h"
+#include "stacked_output.h"
+#include "profiler.h"
+
+// Fill the mesh cache for scene files and OBJ files; directories are
+// searched recursively for OBJ files. No GL context is needed.
+static void prewarm_mesh_cache(const std::vector<std::string>& paths)
+{
+    for(auto& path: paths) {
+        std::vector<std::string> obj_files;
+        if(is_directory(path)) {
+            obj_files = list_files(path, ".obj");
+        } else if(ends_with(path, ".obj")) {
+            obj_files.push_back(path);
+        } else if(!std::ifstream(path.c_str())) {
+            std::cout << "Error: Unable to read " << path << std::endl;
+            continue;
+        } else {
+            std::cout << "Prewarming scene " << path << std::endl;
+            try {
+                Scene scene(path);
+            } catch(const std::exception& e) {
+                std::cout << "Error: " << e.what() << std::endl;
+            }
+            continue;
+        }
+        for(auto& obj_file: obj_files) {
+            std::cout << "Prewarming " << obj_file << std::endl;
+            TriangleMesh mesh(obj_file, Material());
+        }
+    }
+}
+
+// Fork num_workers render processes. Returns the worker index in the
+// children. The parent waits for all of them and returns -1, with *failed
+// set if a worker did not exit successfully.
+static int fork_workers(int num_workers, bool* failed)
+{
+    // buffered output would be written once by every process
+    std::cout.flush();
+    fflush(stdout);
+    std::vector<pid_t> pids;
+    for(int i = 0; i < num_workers; i++) {
+        pid_t pid = fork();
+        if(pid == 0) {
+            return i;
+        }
+        if(pid < 0) {
+            std::cout << "Error: unable to start worker " << i << ": " << strerror(errno) << std::endl;
+            break;
+        }
+        pids.push_back(pid);
+    }
+    *failed = int(pids.size()) < num_workers;
+    for(size_t i = 0; i < pids.size(); i++) {
+        int status = 0;
+        if(waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cout << "Error: worker " << i << " failed" << std::endl;
+            *failed = true;
+        }
+    }
+    return -1;
+}
+
+// GLRenderer, or one of the CPU renderers for the "software" and "raycast"
+// backends. Without a scene the renderer starts with a small framebuffer
+// that is resized to the first scene set.
+static Renderer* create_renderer(const std::string& backend_name, GLContext::Backend backend, Scene* scene,
+    const std::string& out_dir, bool interactive, int num_writers, size_t gpu_cache_bytes)
+{
+    if(backend_name == "software") {
+        if(scene)
+            return new SoftwareRenderer(scene, out_dir, num_writers);
+        return new SoftwareRenderer(out_dir, 64, 64, num_writers);
+    }
+    if(backend_name == "raycast") {
+        if(scene)
+            return new RayCaster(scene, out_dir, num_writers);
+        return new RayCaster(out_dir, 64, 64, num_writers);
+    }
+    GLRenderer* renderer = scene ? new GLRenderer(scene, out_dir, backend, interactive, num_writers) :
+        new GLRenderer(out_dir, 64, 64, backend, interactive, num_writers);
+    renderer->getResourceCache()->setBudget(gpu_cache_bytes);
+    return renderer;
+}
 
+// Parse "i/N"
+static bool parse_shard(const std::string& spec, int* shard, int* num_shards)
+{
+    char slash;
+    std::istringstream ss(spec);
+    return (ss >> *shard >> slash >> *num_shards) && slash == '/' && ss.eof() &&
+        *num_shards > 0 && *shard >= 0 && *shard < *num_shards;
+}
 
 int main(int argc, char** argv) {
-    std::cout << "Render Server\nBuild date: " << __DATE__ << " " << __TIME__ << "\n" << std::endl;
     cxxopts::Options options("Render", "Render Server");
     options.add_options()
     ("s,scene", "Scene specification json file", cxxopts::value<std::string>())
     ("t,trajectory", "Trajectory specification json file", cxxopts::value<std::string>())
+    ("fps", "Treat the trajectory as keyframes with timestamps and render cameras interpolated at this frame rate", cxxopts::value<double>())
     ("o,output-dir", "Output directory", cxxopts::value<std::string>())
-    ("g,gui", "Interactive mode with GUI", cxxopts::value<bool>());
+    ("g,gui", "Interactive mode with GUI", cxxopts::value<bool>())
+    ("b,backend", "OpenGL context backend: auto, glfw, egl or osmesa; or software (rasterizer) or raycast to render on the CPU", cxxopts::value<std::string>()->default_value("auto"))
+    ("w,writers", "Number of frame writer threads", cxxopts::value<int>()->default_value("2"))
+    ("mesh-cache", "Directory of the preprocessed mesh cache", cxxopts::value<std::string>())
+    ("program-cache", "Directory of the cache of linked shader program binaries", cxxopts::value<std::string>())
+    ("prewarm", "Fill the mesh cache for a scene file, OBJ file or directory and exit (repeatable)", cxxopts::value<std::vector<std::string>>())
+    ("batch", "Number of trajectory views rendered in one pass", cxxopts::value<int>()->default_value("1"))
+    ("workers", "Number of render processes the trajectory frames are split across", cxxopts::value<int>()->default_value("1"))
+    ("shard", "Render only part i/N of the trajectory frames, e.g. 0/4", cxxopts::value<std::string>())
+    ("output-format", "files: seven files per frame, stack: one container per trajectory", cxxopts::value<std::string>()->default_value("files"))
+    ("compress", "Deflate level 1-9: write channels as byte shuffled, compressed .npyz files (see npyz_decompress)", cxxopts::value<int>()->default_value("0"))
+    ("channels", "Output channels, overrides the scene's \"output\" entry, e.g. color=rgb:float16,position=off,depth=on", cxxopts::value<std::string>())
+    ("merge-meshes", "Draw all meshes from shared buffers with one multi-draw call per pass", cxxopts::value<bool>())
+    ("gpu-cache-mb", "Memory budget of programs and meshes kept on the GPU between scenes", cxxopts::value<int>()->default_value("512"))
+    ("profile", "Time the render stages on the CPU and GPU and print histograms", cxxopts::value<bool>())
+    ("trace", "Write a Chrome trace-event file of the timed stages, the last 1M events (implies --profile)", cxxopts::value<std::string>())
+    ("serve", "Keep running and read JSON jobs from a Unix socket path, or from stdin with '-'", cxxopts::value<std::string>());
 
     auto args = options.parse(argc, argv);
 
+    // When serving on stdin, stdout only carries job messages: log to stderr
+    bool serve_stdin = args["serve"].count() > 0 && args["serve"].as<std::string>() == "-";
+    if(serve_stdin)
+        std::cout.rdbuf(std::cerr.rdbuf());
+    std::cout << "Render Server\nBuild date: " << __DATE__ << " " << __TIME__ << "\n" << std::endl;
+
+    if(args["mesh-cache"].count() > 0) {
+        MeshCache::setDirectory(args["mesh-cache"].as<std::string>());
+    }
+    if(args["program-cache"].count() > 0) {
+        ProgramCache::setDirectory(args["program-cache"].as<std::string>());
+    }
+    if(args["prewarm"].count() > 0) {
+        if(!MeshCache::enabled()) {
+            std::cout << "Error: --prewarm needs --mesh-cache." << std::endl;
+            return -1;
+        }
+        prewarm_mesh_cache(args["prewarm"].as<std::vector<std::string>>());
+        return 0;
+    }
+
+    GLContext::Backend backend = GLContext::AUTO;
+    std::string backend_name = args["backend"].as<std::string>();
+    bool cpu_backend = backend_name == "software" || backend_name == "raycast";
+    if(!cpu_backend && !GLContext::parseBackend(backend_name, &backend)) {
+        std::cout << "Error: Unknown context backend " << args["backend"].as<std::string>() << std::endl;
+        return -1;
+    }
+    int num_writers = std::max(1, args["writers"].as<int>());
+    size_t gpu_cache_bytes = size_t(std::max(0, args["gpu-cache-mb"].as<int>())) << 20;
+
+    std::string trace_path;
+    if(args["trace"].count() > 0)
+        trace_path = args["trace"].as<std::string>();
+    if(args["profile"].as<bool>() || !trace_path.empty()) {
+        Profiler::instance().enable(!trace_path.empty());
+        Profiler::instance().setThreadName("main");
+    }
+
+    if(args["serve"].count() > 0) {
+        std::string endpoint = args["serve"].as<std::string>();
+        RenderServer server(create_renderer(backend_name, backend, nullptr, "", false, num_writers, gpu_cache_bytes),
+            args["batch"].as<int>());
+        int result = serve_stdin ? server.serveStdin() : server.serveSocket(endpoint);
+        if(!trace_path.empty())
+            Profiler::instance().writeTrace(trace_path);
+        return result;
+    }
+
     if(args["scene"].count() == 0) {
         std::cout << "Error: Specify scene file path." << std::endl;
         return -1;
@@ -44,26 +207,134 @@ int main(int argc, char** argv) {
     if(out_dir.size() > 0)
         out_dir = out_dir + "/";
     bool bGUIMode = args["gui"].as<bool>();
+    // Only GLFW opens a window, headless contexts never ask to close
+    GLContext::Backend gui_backend = backend == GLContext::AUTO ? GLContext::defaultBackend(true) : backend;
+    if(bGUIMode && (cpu_backend || gui_backend != GLContext::GLFW)) {
+        std::cout << "Error: --gui needs the glfw backend." << std::endl;
+        return -1;
+    }
 
-    CameraTrajectory *cam_traj = nullptr;
-    std::string trajectory_file = "";
-    if(args["trajectory"].count() > 0) {
-        trajectory_file = args["trajectory"].as<std::string>();
-        cam_traj = new CameraTrajectory(trajectory_file);
+    int shard = 0, num_shards = 1;
+    if(args["shard"].count() > 0 && !parse_shard(args["shard"].as<std::string>(), &shard, &num_shards)) {
+        std::cout << "Error: Invalid shard " << args["shard"].as<std::string>() << ", expected i/N" << std::endl;
+        return -1;
+    }
+    int num_workers = std::max(1, args["workers"].as<int>());
+    if((num_workers > 1 || num_shards > 1) && (args["trajectory"].count() == 0 || bGUIMode)) {
+        std::cout << "Error: --workers and --shard split the frames of a trajectory and need --trajectory without --gui." << std::endl;
+        return -1;
+    }
+    std::string output_format = args["output-format"].as<std::string>();
+    if(output_format != "files" && output_format != "stack") {
+        std::cout << "Error: Unknown output format " << output_format << std::endl;
+        return -1;
+    }
+    if(output_format == "stack" && (args["trajectory"].count() == 0 || bGUIMode)) {
+        std::cout << "Error: --output-format stack needs --trajectory without --gui." << std::endl;
+        return -1;
+    }
+    double keyframe_rate = 0.0;
+    if(args["fps"].count() > 0) {
+        keyframe_rate = args["fps"].as<double>();
+        if(!(keyframe_rate > 0.0) || args["trajectory"].count() == 0) {
+            std::cout << "Error: --fps takes a positive frame rate and needs --trajectory." << std::endl;
+            return -1;
+        }
+    }
+    int compression_level = args["compress"].as<int>();
+    if(compression_level < 0 || compression_level > 9) {
+        std::cout << "Error: --compress takes a deflate level from 1 to 9" << std::endl;
+        return -1;
+    }
+    if(compression_level > 0 && output_format == "stack") {
+        std::cout << "Error: --compress writes files per frame, it cannot be combined with --output-format stack." << std::endl;
+        return -1;
     }
 
-    std::cout << "Using scene file: " << scene_filename << std::endl;
-    std::cout << "Output directory: " << out_dir << std::endl;
+    CameraTrajectory *cam_traj = nullptr;
+    std::unique_ptr<Scene> scene_ptr;
+    try {
+        if(args["trajectory"].count() > 0) {
+            cam_traj = new CameraTrajectory(args["trajectory"].as<std::string>(), keyframe_rate);
+        }
 
-    Scene scene(scene_filename);
+        std::cout << "Using scene file: " << scene_filename << std::endl;
+        std::cout << "Output directory: " << out_dir << std::endl;
+
+        ScopedTimer timer("load scene");
+        scene_ptr.reset(new Scene(scene_filename));
+        if(args["channels"].count() > 0) {
+            OutputFormat format = scene_ptr->getOutputFormat();
+            format.applyOverrides(args["channels"].as<std::string>());
+            scene_ptr->setOutputFormat(format);
+        }
+        if(args["merge-meshes"].count() > 0) {
+            scene_ptr->setMergeMeshes(true);
+        }
+    } catch(const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+    Scene& scene = *scene_ptr;
     std::cout << "scene width: " << scene.getWidth() << " " << scene.getHeight() << std::endl;
-    GLRenderer renderer(&scene, out_dir);
+
+    // Created before the workers are started so that they all write into
+    // the same files
+    std::unique_ptr<StackedOutput> stacked_output;
+    if(output_format == "stack") {
+        try {
+            stacked_output.reset(new StackedOutput(out_dir, cam_traj->size(), scene.getWidth(), scene.getHeight(),
+                scene.getOutputFormat()));
+        } catch(const std::exception& e) {
+            std::cout << "Error: " << e.what() << std::endl;
+            return -1;
+        }
+        try {
+            for(size_t i = 0; i < cam_traj->size(); i++) {
+                stacked_output->addFrame(i, out_dir + CameraTrajectory::getFilename(i), cam_traj->getCamera(i)->toJson());
+            }
+        } catch(const std::exception& e) {
+            std::cout << "Error: " << e.what() << std::endl;
+            return -1;
+        }
+    }
+
+    // The scene is loaded once and shared copy-on-write by the workers,
+    // each of them creates its own GL context. Worker w renders shard w of
+    // the frames selected by --shard.
+    if(num_workers > 1) {
+        bool failed = false;
+        int worker = fork_workers(num_workers, &failed);
+        if(worker < 0) {
+            if(stacked_output && !failed)
+                stacked_output->writeIndex();
+            return failed ? -1 : 0;
+        }
+        shard = shard * num_workers + worker;
+        num_shards *= num_workers;
+        // one trace per worker, e.g. trace.json -> trace.1.json
+        if(!trace_path.empty()) {
+            size_t ext = ends_with(trace_path, ".json") ? trace_path.size() - 5 : trace_path.size();
+            trace_path.insert(ext, "." + std::to_string(worker));
+        }
+    }
+    if(cam_traj != nullptr && num_shards > 1) {
+        cam_traj->setShard(shard, num_shards);
+        std::cout << "Rendering shard " << shard << "/" << num_shards << std::endl;
+    }
+    std::unique_ptr<Renderer> renderer_ptr(create_renderer(backend_name, backend, &scene, out_dir,
+        bGUIMode, num_writers, gpu_cache_bytes));
+    Renderer& renderer = *renderer_ptr;
+    renderer.setStackedOutput(stacked_output.get());
+    renderer.setCompression(compression_level);
+    if(!bGUIMode)
+        renderer.setBatchSize(args["batch"].as<int>());
     
     const Camera *camera = nullptr;
     if(bGUIMode) {
         // if in interactive mode
         while(!renderer.shouldClose()) {
-            glfwPollEvents();
+            renderer.pollEvents();
             if(cam_traj != nullptr) {
                 // get next trajectory
                 camera = cam_traj->getNext(true);
@@ -73,16 +344,48 @@ int main(int argc, char** argv) {
         }
     } else {
         if(cam_traj != nullptr) {
-            while(true) {
-                auto cam_fname = cam_traj->getNextCameraAndFilename();
-                if(cam_fname.first == nullptr)
-                    break;
-                renderer.render(cam_fname.first, cam_fname.second);
+            // the trajectory only keeps its current chunk, batches hold copies
+            std::vector<Camera> batch;
+            std::vector<const Camera*> cameras;
+            std::vector<std::string> names;
+            try {
+                while(true) {
+                    auto cam_fname = cam_traj->getNextCameraAndFilename();
+                    if(cam_fname.first != nullptr) {
+                        batch.push_back(*cam_fname.first);
+                        names.push_back(cam_fname.second);
+                    }
+                    if(!batch.empty() && (cam_fname.first == nullptr || int(batch.size()) == renderer.getBatchSize())) {
+                        for(auto& camera: batch) {
+                            cameras.push_back(&camera);
+                        }
+                        renderer.render(cameras, names);
+                        batch.clear();
+                        cameras.clear();
+                        names.clear();
+                    }
+                    if(cam_fname.first == nullptr)
+                        break;
+                }
+            } catch(const std::exception& e) {
+                std::cout << "Error: " << e.what() << std::endl;
+                renderer.finish();
+                return -1;
             }
         } else {
             renderer.render();
         }
     }
 
+    renderer.finish();
+    // the workers leave the index to the parent process
+    if(stacked_output && num_workers == 1)
+        stacked_output->writeIndex();
+    if(Profiler::enabled()) {
+        Profiler::instance().printSummary();
+        if(!trace_path.empty())
+            Profiler::instance().writeTrace(trace_path);
+    }
+
     return 0;
 }
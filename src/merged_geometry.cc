@@ -0,0 +1,205 @@
+#include <iostream>
+#include <unordered_map>
+#include <algorithm>
+#include <cstddef>
+
+#include "shader.h"
+#include "merged_geometry.h"
+
+namespace {
+
+template<typename T>
+void append_indices(const MeshArrays& arrays, std::vector<T>& indices)
+{
+    if(arrays.index_type == GL_UNSIGNED_SHORT) {
+        const GLushort* src = static_cast<const GLushort*>(arrays.indices);
+        indices.insert(indices.end(), src, src + arrays.num_indices);
+    } else {
+        const GLuint* src = static_cast<const GLuint*>(arrays.indices);
+        indices.insert(indices.end(), src, src + arrays.num_indices);
+    }
+}
+
+}
+
+MergedGeometry::MergedGeometry()
+    : mVAO(0), mIndirectBuffer(0), mIndexType(GL_UNSIGNED_INT), mIndirect(false),
+    mNumVertices(0), mNumIndices(0), mNumDrawCalls(0)
+{
+    for(int i = 0; i < 4; i++) {
+        mBuffers[i] = 0;
+    }
+}
+
+void MergedGeometry::build(const std::vector<const TriangleMesh*>& meshes, int max_views)
+{
+    release();
+    mMeshes = meshes;
+    mIndirect = (GLAD_GL_VERSION_4_3 || (GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_base_instance))
+        && glMultiDrawElementsIndirect != nullptr;
+
+    // Indices stay relative to their mesh, the base vertex offsets them.
+    // 16 bits are kept if every mesh has them.
+    mIndexType = GL_UNSIGNED_SHORT;
+    bool has_texcoords = false;
+    for(auto mesh: meshes) {
+        if(mesh->getArrays().index_type != GL_UNSIGNED_SHORT)
+            mIndexType = GL_UNSIGNED_INT;
+        has_texcoords = has_texcoords || mesh->getArrays().texcoords != nullptr;
+    }
+
+    std::vector<Vertex> vertices;
+    std::vector<glm::uint32> texcoords;
+    std::vector<GLushort> indices16;
+    std::vector<GLuint> indices32;
+    std::unordered_map<uint64_t, MeshRange> shared;
+    mRanges.resize(meshes.size());
+    for(size_t i = 0; i < meshes.size(); i++) {
+        auto it = shared.find(meshes[i]->getContentHash());
+        if(it != shared.end()) {
+            mRanges[i] = it->second;
+            continue;
+        }
+        const MeshArrays& arrays = meshes[i]->getArrays();
+        MeshRange range;
+        range.first_index = mIndexType == GL_UNSIGNED_SHORT ? indices16.size() : indices32.size();
+        range.base_vertex = GLint(vertices.size());
+        vertices.insert(vertices.end(), arrays.vertices, arrays.vertices + arrays.num_vertices);
+        if(has_texcoords) {
+            if(arrays.texcoords)
+                texcoords.insert(texcoords.end(), arrays.texcoords, arrays.texcoords + arrays.num_vertices);
+            else
+                texcoords.resize(vertices.size(), 0);
+        }
+        if(mIndexType == GL_UNSIGNED_SHORT)
+            append_indices(arrays, indices16);
+        else
+            append_indices(arrays, indices32);
+        mRanges[i] = range;
+        shared[meshes[i]->getContentHash()] = range;
+    }
+    mNumVertices = vertices.size();
+    mNumIndices = mIndexType == GL_UNSIGNED_SHORT ? indices16.size() : indices32.size();
+
+    glGenVertexArrays(1, &mVAO);
+    glBindVertexArray(mVAO);
+    glGenBuffers(4, mBuffers);
+    glBindBuffer(GL_ARRAY_BUFFER, mBuffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(ATTRIB_POSITION);
+    glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE,
+                          sizeof(Vertex), (void*) offsetof(Vertex, position));
+    glEnableVertexAttribArray(ATTRIB_NORMAL);
+    glVertexAttribPointer(ATTRIB_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE,
+                          sizeof(Vertex), (void*) offsetof(Vertex, normal));
+    if(has_texcoords) {
+        glBindBuffer(GL_ARRAY_BUFFER, mBuffers[1]);
+        glBufferData(GL_ARRAY_BUFFER, texcoords.size() * sizeof(glm::uint32), texcoords.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(ATTRIB_TEXCOORD);
+        glVertexAttribPointer(ATTRIB_TEXCOORD, 2, GL_HALF_FLOAT, GL_FALSE,
+                              sizeof(glm::uint32), (void*) 0);
+    }
+    if(mIndirect) {
+        // element i holds i; with a divisor of at least the instance count
+        // every instance of a draw reads the element at its base instance
+        std::vector<GLuint> draw_ids(meshes.size());
+        for(size_t i = 0; i < draw_ids.size(); i++) {
+            draw_ids[i] = GLuint(i);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, mBuffers[3]);
+        glBufferData(GL_ARRAY_BUFFER, draw_ids.size() * sizeof(GLuint), draw_ids.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(ATTRIB_DRAW_ID);
+        glVertexAttribIPointer(ATTRIB_DRAW_ID, 1, GL_UNSIGNED_INT, sizeof(GLuint), (void*) 0);
+        glVertexAttribDivisor(ATTRIB_DRAW_ID, std::max(1, max_views));
+        glGenBuffers(1, &mIndirectBuffer);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mBuffers[2]);
+    if(mIndexType == GL_UNSIGNED_SHORT)
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices16.size() * sizeof(GLushort), indices16.data(), GL_STATIC_DRAW);
+    else
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices32.size() * sizeof(GLuint), indices32.data(), GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    std::cout << "Merged " << meshes.size() << " meshes into " << mNumVertices << " vertices, "
+        << mNumIndices << " indices, drawn with "
+        << (mIndirect ? "glMultiDrawElementsIndirect" : "glMultiDrawElementsBaseVertex") << std::endl;
+}
+
+void MergedGeometry::release()
+{
+    if(mVAO == 0)
+        return;
+    glDeleteVertexArrays(1, &mVAO);
+    glDeleteBuffers(4, mBuffers);
+    if(mIndirectBuffer != 0)
+        glDeleteBuffers(1, &mIndirectBuffer);
+    mVAO = mIndirectBuffer = 0;
+    for(int i = 0; i < 4; i++) {
+        mBuffers[i] = 0;
+    }
+    mMeshes.clear();
+    mCommands.clear();
+}
+
+void MergedGeometry::add(size_t i, int num_views, const Frustum* frusta, DrawStats* stats)
+{
+    mScratch.clear();
+    mMeshes[i]->collectRanges(num_views, frusta, mScratch, stats);
+    for(auto& range: mScratch) {
+        Command command;
+        command.count = GLuint(range.num_indices);
+        command.instance_count = GLuint(num_views);
+        command.first_index = GLuint(mRanges[i].first_index + range.first_index);
+        command.base_vertex = mRanges[i].base_vertex;
+        command.base_instance = GLuint(i);
+        mCommands.push_back(command);
+    }
+}
+
+void MergedGeometry::draw(int num_views)
+{
+    mNumDrawCalls = 0;
+    if(mCommands.empty())
+        return;
+    glBindVertexArray(mVAO);
+    if(mIndirect) {
+        // a new store each pass, the previous one may still be read by the GPU
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mIndirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, mCommands.size() * sizeof(Command), mCommands.data(), GL_STREAM_DRAW);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, mIndexType, nullptr, GLsizei(mCommands.size()), 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        mNumDrawCalls = 1;
+    } else {
+        size_t index_size = (mIndexType == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+        for(size_t begin = 0; begin < mCommands.size();) {
+            // the commands of one mesh are consecutive
+            GLuint draw_id = mCommands[begin].base_instance;
+            size_t end = begin;
+            mCounts.clear();
+            mOffsets.clear();
+            mBaseVertices.clear();
+            for(; end < mCommands.size() && mCommands[end].base_instance == draw_id; end++) {
+                mCounts.push_back(GLsizei(mCommands[end].count));
+                mOffsets.push_back((const void*) (mCommands[end].first_index * index_size));
+                mBaseVertices.push_back(mCommands[end].base_vertex);
+            }
+            glVertexAttribI1ui(ATTRIB_DRAW_ID, draw_id);
+            if(num_views == 1) {
+                glMultiDrawElementsBaseVertex(GL_TRIANGLES, mCounts.data(), mIndexType, mOffsets.data(),
+                    GLsizei(mCounts.size()), mBaseVertices.data());
+                mNumDrawCalls++;
+            } else {
+                for(size_t j = 0; j < mCounts.size(); j++) {
+                    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, mCounts[j], mIndexType, mOffsets[j],
+                        num_views, mBaseVertices[j]);
+                }
+                mNumDrawCalls += mCounts.size();
+            }
+            begin = end;
+        }
+    }
+    glBindVertexArray(0);
+    mCommands.clear();
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glad/glad.h>
+
+#include "object.h"
+
+// The vertex and index arrays of many meshes packed into shared buffers,
+// so that a pass draws all of them with one multi-draw call instead of a
+// vertex array bind and a draw per mesh. Meshes with the same arrays
+// share one copy.
+//
+// Mesh i of build() is drawn with draw id i, which the vertex shader gets
+// in the draw_id attribute (ATTRIB_DRAW_ID) to fetch its transform and
+// material. With GL 4.3 or ARB_multi_draw_indirect and ARB_base_instance
+// the draws are submitted from an indirect buffer with the draw id as the
+// base instance of an instanced draw id array. Otherwise they are
+// submitted with glMultiDrawElementsBaseVertex, one call per mesh, with
+// the draw id as the current attribute value.
+class MergedGeometry {
+public:
+    MergedGeometry();
+
+    // Upload the merged arrays. max_views is the largest instance count
+    // of a draw.
+    void build(const std::vector<const TriangleMesh*>& meshes, int max_views);
+    // Needs the GL context that was current during build()
+    void release();
+
+    // Queue the parts of mesh i visible in any of the object space frusta,
+    // all of it with nullptr, like TriangleMesh::render()
+    void add(size_t i, int num_views, const Frustum* frusta, DrawStats* stats);
+    // Draw the queued parts with num_views instances each and clear the queue
+    void draw(int num_views);
+
+    bool usesIndirect() const { return mIndirect; }
+    size_t getNumVertices() const { return mNumVertices; }
+    size_t getNumIndices() const { return mNumIndices; }
+    // GL draw calls of the last draw()
+    size_t getNumDrawCalls() const { return mNumDrawCalls; }
+private:
+    // Layout of glMultiDrawElementsIndirect
+    struct Command {
+        GLuint count;
+        GLuint instance_count;
+        GLuint first_index;
+        GLint base_vertex;
+        GLuint base_instance;   // draw id
+    };
+    struct MeshRange {
+        size_t first_index;
+        GLint base_vertex;
+    };
+
+    std::vector<const TriangleMesh*> mMeshes;
+    std::vector<MeshRange> mRanges;     // per mesh
+    GLuint mVAO;
+    GLuint mBuffers[4];     // vertices, texture coordinates, indices, draw ids
+    GLuint mIndirectBuffer;
+    GLenum mIndexType;
+    bool mIndirect;
+    size_t mNumVertices, mNumIndices;
+    size_t mNumDrawCalls;
+
+    std::vector<Command> mCommands;
+    std::vector<IndexRange> mScratch;
+    // per call of glMultiDrawElementsBaseVertex
+    std::vector<GLsizei> mCounts;
+    std::vector<const void*> mOffsets;
+    std::vector<GLint> mBaseVertices;
+};
@@ -0,0 +1,221 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <thread>
+#include <cstdlib>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "mesh_cache.h"
+
+namespace {
+
+const char kMagic[8] = { 'R', 'S', 'M', 'E', 'S', 'H', '\0', '\0' };
+// Bump when Vertex, the index layout or the OBJ processing changes
+const uint32_t kFormatVersion = 1;
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_size;
+    uint64_t source_size;
+    int64_t source_mtime_ns;
+    uint32_t options;
+    uint32_t index_type;
+    uint64_t num_vertices;
+    uint64_t num_indices;
+    uint64_t has_texcoords;
+};
+
+struct SourceInfo {
+    std::string path;   // absolute
+    uint64_t size;
+    int64_t mtime_ns;
+};
+
+bool get_source_info(const std::string& filename, SourceInfo* info)
+{
+    char resolved[PATH_MAX];
+    struct stat st;
+    if(realpath(filename.c_str(), resolved) == nullptr || stat(resolved, &st) != 0)
+        return false;
+    info->path = resolved;
+    info->size = st.st_size;
+    info->mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+uint32_t pack_options(const MeshLoadOptions& options)
+{
+    return options.smooth_normals ? 1u : 0u;
+}
+
+std::string cache_filename(const SourceInfo& info, const MeshLoadOptions& options)
+{
+    uint32_t packed_options = pack_options(options);
+    uint64_t h = hash_bytes(info.path.data(), info.path.size());
+    h = hash_bytes(&info.size, sizeof(info.size), h);
+    h = hash_bytes(&info.mtime_ns, sizeof(info.mtime_ns), h);
+    h = hash_bytes(&packed_options, sizeof(packed_options), h);
+    h = hash_bytes(&kFormatVersion, sizeof(kFormatVersion), h);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mesh", (unsigned long long) h);
+    return MeshCache::getDirectory() + "/" + name;
+}
+
+size_t align16(size_t offset)
+{
+    return (offset + 15) & ~size_t(15);
+}
+
+size_t index_size(GLenum index_type)
+{
+    return index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+}
+
+std::string gCacheDir;
+
+}
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return nullptr;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return nullptr;
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    file->mData = static_cast<const unsigned char*>(data);
+    file->mSize = st.st_size;
+    return file;
+}
+
+MappedFile::~MappedFile()
+{
+    if(mData)
+        munmap(const_cast<unsigned char*>(mData), mSize);
+}
+
+void MeshCache::setDirectory(const std::string& dir)
+{
+    gCacheDir = dir;
+    while(gCacheDir.size() > 1 && gCacheDir.back() == '/')
+        gCacheDir.pop_back();
+    if(!gCacheDir.empty())
+        mkdir(gCacheDir.c_str(), 0755);
+}
+
+const std::string& MeshCache::getDirectory()
+{
+    return gCacheDir;
+}
+
+bool MeshCache::load(const std::string& obj_filename, const MeshLoadOptions& options, MeshArrays* arrays)
+{
+    SourceInfo info;
+    if(!enabled() || !get_source_info(obj_filename, &info))
+        return false;
+    std::shared_ptr<MappedFile> file = MappedFile::open(cache_filename(info, options));
+    if(!file || file->size() < sizeof(MeshCacheHeader))
+        return false;
+
+    MeshCacheHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+    if(memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.version != kFormatVersion ||
+        header.vertex_size != sizeof(Vertex) ||
+        header.source_size != info.size ||
+        header.source_mtime_ns != info.mtime_ns ||
+        header.options != pack_options(options) ||
+        (header.index_type != GL_UNSIGNED_SHORT && header.index_type != GL_UNSIGNED_INT)) {
+        return false;
+    }
+
+    size_t vertex_offset = align16(sizeof(MeshCacheHeader));
+    size_t texcoord_offset = align16(vertex_offset + header.num_vertices * sizeof(Vertex));
+    size_t index_offset = texcoord_offset;
+    if(header.has_texcoords)
+        index_offset = align16(texcoord_offset + header.num_vertices * sizeof(glm::uint32));
+    size_t end = index_offset + header.num_indices * index_size(header.index_type);
+    if(end > file->size())
+        return false;
+
+    arrays->vertices = reinterpret_cast<const Vertex*>(file->data() + vertex_offset);
+    arrays->texcoords = header.has_texcoords ?
+        reinterpret_cast<const glm::uint32*>(file->data() + texcoord_offset) : nullptr;
+    arrays->indices = file->data() + index_offset;
+    arrays->num_vertices = header.num_vertices;
+    arrays->num_indices = header.num_indices;
+    arrays->index_type = header.index_type;
+    arrays->mapping = file;
+    return true;
+}
+
+bool MeshCache::store(const std::string& obj_filename, const MeshLoadOptions& options, const MeshArrays& arrays)
+{
+    SourceInfo info;
+    if(!enabled() || !get_source_info(obj_filename, &info))
+        return false;
+
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kFormatVersion;
+    header.vertex_size = sizeof(Vertex);
+    header.source_size = info.size;
+    header.source_mtime_ns = info.mtime_ns;
+    header.options = pack_options(options);
+    header.index_type = arrays.index_type;
+    header.num_vertices = arrays.num_vertices;
+    header.num_indices = arrays.num_indices;
+    header.has_texcoords = arrays.texcoords != nullptr;
+
+    // Write to a temporary file and rename so that concurrent readers never
+    // see a partial entry
+    std::string filename = cache_filename(info, options);
+    char tmp_suffix[64];
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".%d.%zx.tmp", int(getpid()),
+             std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::string tmp_filename = filename + tmp_suffix;
+    {
+        std::ofstream out(tmp_filename.c_str(), std::ios::out | std::ios::binary);
+        if(!out)
+            return false;
+        const char zeros[16] = { 0 };
+        size_t offset = 0;
+        auto write_aligned = [&](const void* data, size_t size) {
+            size_t aligned = align16(offset);
+            out.write(zeros, aligned - offset);
+            out.write(static_cast<const char*>(data), size);
+            offset = aligned + size;
+        };
+        write_aligned(&header, sizeof(header));
+        write_aligned(arrays.vertices, arrays.num_vertices * sizeof(Vertex));
+        if(arrays.texcoords)
+            write_aligned(arrays.texcoords, arrays.num_vertices * sizeof(glm::uint32));
+        write_aligned(arrays.indices, arrays.num_indices * index_size(arrays.index_type));
+        if(!out) {
+            out.close();
+            unlink(tmp_filename.c_str());
+            return false;
+        }
+    }
+    if(rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        unlink(tmp_filename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include "object.h"
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    static std::shared_ptr<MappedFile> open(const std::string& filename);
+    ~MappedFile();
+
+    const unsigned char* data() const { return mData; }
+    size_t size() const { return mSize; }
+private:
+    MappedFile(): mData(nullptr), mSize(0) {}
+    const unsigned char* mData;
+    size_t mSize;
+};
+
+// On-disk cache of preprocessed OBJ meshes. An entry is keyed by the
+// absolute source path, its size and mtime and the load options, and holds
+// the final vertex/index arrays so that a hit is a single mmap.
+class MeshCache {
+public:
+    // An empty directory disables the cache (the default)
+    static void setDirectory(const std::string& dir);
+    static const std::string& getDirectory();
+    static bool enabled() { return !getDirectory().empty(); }
+
+    static bool load(const std::string& obj_filename, const MeshLoadOptions& options, MeshArrays* arrays);
+    static bool store(const std::string& obj_filename, const MeshLoadOptions& options, const MeshArrays& arrays);
+};
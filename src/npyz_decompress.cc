@@ -0,0 +1,45 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <stdexcept>
+
+#include "compressed_array.h"
+
+// Turns .npyz files written with --compress back into .npy files next to
+// them, e.g. im_0000000.npyz -> im_0000000.npy
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+        std::cout << "Usage: " << argv[0] << " file.npyz..." << std::endl;
+        return -1;
+    }
+
+    int failed = 0;
+    std::vector<char> npy;
+    for(int i = 1; i < argc; i++) {
+        std::string filename = argv[i];
+        if(filename.size() < 5 || filename.substr(filename.size() - 5) != ".npyz") {
+            std::cout << "Error: " << filename << " is not a .npyz file" << std::endl;
+            failed++;
+            continue;
+        }
+        try {
+            auto start = std::chrono::steady_clock::now();
+            load_npyz(filename, npy);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::string out_filename = filename.substr(0, filename.size() - 1);
+            std::ofstream out(out_filename, std::ofstream::binary);
+            out.write(npy.data(), npy.size());
+            if(!out) {
+                throw std::runtime_error("Unable to write " + out_filename);
+            }
+            std::cout << out_filename << ": " << npy.size() << " bytes, "
+                << npy.size() / 1048576.0 / elapsed.count() << " MB/s" << std::endl;
+        } catch(const std::exception& e) {
+            std::cout << "Error: " << e.what() << std::endl;
+            failed++;
+        }
+    }
+    return failed > 0 ? -1 : 0;
+}
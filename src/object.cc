@@ -1,56 +1,110 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <map>
+#include <algorithm>
 
 #include <glad/glad.h>
 
 #include "utils.h"
 #include "object.h"
 #include "shader.h"
+#include "mesh_cache.h"
+#include "gpu_cache.h"
 
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 #include <tiny_obj_loader.h>
 
 
-struct TinyObjIndexComparator {
-    using is_transparent = std::true_type;
+#include <unordered_map>
 
-    bool operator()(const tinyobj::index_t& lhs, const tinyobj::index_t& rhs) const
+struct TinyObjIndexHash {
+    size_t operator()(const tinyobj::index_t& idx) const
     {
-        //std::cout << "{" << lhs.vertex_index << " " << lhs.normal_index << " " << lhs.texcoord_index << "}, "
-        //    << "{" << rhs.vertex_index << " " << rhs.normal_index << " " << rhs.texcoord_index << "}\n";
-        if(lhs.vertex_index < rhs.vertex_index)
-            return true;
-
-        if(lhs.normal_index < rhs.normal_index)
-            return true;
-
-        return lhs.texcoord_index < rhs.texcoord_index;
+        size_t h = std::hash<int>()(idx.vertex_index);
+        h ^= std::hash<int>()(idx.normal_index) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        h ^= std::hash<int>()(idx.texcoord_index) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        return h;
     }
+};
 
-    bool operator()(const tinyobj::index_t* const lhs, const tinyobj::index_t* const rhs) const
+struct TinyObjIndexEqual {
+    bool operator()(const tinyobj::index_t& lhs, const tinyobj::index_t& rhs) const
     {
-        //std::cout << "{" << lhs->vertex_index << " " << lhs->normal_index << " " << lhs->texcoord_index << "}, "
-        //    << "{" << rhs->vertex_index << " " << rhs->normal_index << " " << rhs->texcoord_index << "}\n";
-        if(lhs->vertex_index < rhs->vertex_index)
-            return true;
-
-        if(lhs->normal_index < rhs->normal_index)
-            return true;
-
-        return lhs->texcoord_index < rhs->texcoord_index;
+        return lhs.vertex_index == rhs.vertex_index &&
+            lhs.normal_index == rhs.normal_index &&
+            lhs.texcoord_index == rhs.texcoord_index;
     }
 };
 
+// Triangles per culling chunk
+const size_t kChunkTriangles = 2048;
+
 glm::vec3 computeNormal(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2)
 {
     return glm::normalize(glm::cross(v1 - v0, v2 - v0));
 }
 
 void TriangleMesh::loadObj(const std::string& filename,
-    Material mat)
+    Material mat, const MeshLoadOptions& options)
 {
     mMaterial = mat;
+    mLoadedFromCache = MeshCache::load(filename, options, &mArrays);
+    if(!mLoadedFromCache) {
+        parseObj(filename, options);
+        storeArrays(filename, options);
+    }
+
+    // Computed here on the loader thread, keeps setup() on the GL thread cheap
+    uint64_t h = hash_bytes(&mArrays.index_type, sizeof(mArrays.index_type));
+    h = hash_bytes(mArrays.vertices, mArrays.num_vertices * sizeof(Vertex), h);
+    if(mArrays.texcoords)
+        h = hash_bytes(mArrays.texcoords, mArrays.num_vertices * sizeof(glm::uint32), h);
+    size_t index_size = (mArrays.index_type == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+    mContentHash = hash_bytes(mArrays.indices, mArrays.num_indices * index_size, h);
+
+    computeChunks();
+}
+
+void TriangleMesh::computeChunks()
+{
+    // Chunks follow the index order of the OBJ faces, which usually keeps
+    // neighboring triangles together
+    const size_t chunk_indices = 3 * kChunkTriangles;
+    mChunks.clear();
+    mBounds = AABB();
+    for(size_t first = 0; first < mArrays.num_indices; first += chunk_indices) {
+        Chunk chunk;
+        chunk.first_index = first;
+        chunk.num_indices = std::min(chunk_indices, mArrays.num_indices - first);
+        for(size_t i = first; i < first + chunk.num_indices; i++) {
+            chunk.bounds.extend(mArrays.vertices[mArrays.index(i)].position);
+        }
+        mBounds.extend(chunk.bounds);
+        mChunks.push_back(chunk);
+    }
+}
+
+void TriangleMesh::storeArrays(const std::string& filename, const MeshLoadOptions& options)
+{
+    mArrays.vertices = mBuffer.data();
+    mArrays.texcoords = mTexCoords.empty() ? nullptr : mTexCoords.data();
+    mArrays.num_vertices = mBuffer.size();
+    if(mArrays.index_type == GL_UNSIGNED_SHORT) {
+        mArrays.indices = mIndices16.data();
+        mArrays.num_indices = mIndices16.size();
+    } else {
+        mArrays.indices = mIndices32.data();
+        mArrays.num_indices = mIndices32.size();
+    }
+    if(MeshCache::enabled() && !MeshCache::store(filename, options, mArrays)) {
+        std::cout << "Warning: unable to write mesh cache entry for " + filename + "\n" << std::flush;
+    }
+}
+
+void TriangleMesh::parseObj(const std::string& filename, const MeshLoadOptions& options)
+{
     std::string basedir = get_basedir(filename);
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -59,12 +113,12 @@ void TriangleMesh::loadObj(const std::string& filename,
     std::string errors;
     bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials,
     &warnings, &errors, filename.c_str(), basedir.c_str());
-    std::cout << "LoadObj ret " << ret << std::endl;
-    std::cout << "warnings " << warnings << std::endl;
-    std::cout << "errors " << errors << std::endl;
-    std::cout << "num vertices: " << attrib.vertices.size() << std::endl;
-    std::cout << "num normals: " << attrib.normals.size() << std::endl;
-    std::cout << "num shapes: " << shapes.size() << std::endl;
+    // Meshes may be loaded concurrently: print each message in one piece
+    if(!ret || !warnings.empty() || !errors.empty()) {
+        std::stringstream ss;
+        ss << filename << ": LoadObj ret " << ret << " warnings: " << warnings << " errors: " << errors << "\n";
+        std::cout << ss.str() << std::flush;
+    }
 
     std::vector<glm::vec3> raw_vertices;
     for(size_t i = 0; i < attrib.vertices.size() / 3; i++) {
@@ -81,7 +135,26 @@ void TriangleMesh::loadObj(const std::string& filename,
         raw_texcoords.push_back({attrib.texcoords[i * 2], attrib.texcoords[i * 2 + 1]});
     }
 
-    if(raw_normals.size() == 0) { // each face will have a unique normal
+    if(raw_normals.size() == 0 && options.smooth_normals) {
+        // area weighted vertex normals, shared by all faces around a vertex
+        raw_normals.assign(raw_vertices.size(), glm::vec3(0.0));
+        for(size_t i = 0; i < shapes.size(); i++) {
+            for(size_t f = 0; f < shapes[i].mesh.indices.size() / 3; f++) {
+                auto idx = &shapes[i].mesh.indices[3 * f];
+                const glm::vec3& v0 = raw_vertices[idx[0].vertex_index];
+                glm::vec3 n = glm::cross(raw_vertices[idx[1].vertex_index] - v0,
+                    raw_vertices[idx[2].vertex_index] - v0);
+                for(int k = 0; k < 3; k++) {
+                    raw_normals[idx[k].vertex_index] += n;
+                    idx[k].normal_index = idx[k].vertex_index;
+                }
+            }
+        }
+        for(auto& n: raw_normals) {
+            float len = glm::length(n);
+            n = (len > 0.0f) ? n / len : glm::vec3(0.0f, 0.0f, 1.0f);
+        }
+    } else if(raw_normals.size() == 0) { // each face will have a unique normal
         for(size_t i = 0; i < shapes.size(); i++) {
             for(size_t f = 0; f < shapes[i].mesh.indices.size() / 3; f++) {
                 auto idx = &shapes[i].mesh.indices[3 * f];
@@ -94,61 +167,58 @@ void TriangleMesh::loadObj(const std::string& filename,
         }
     }
     //assert(shapes.size() <= 1); // for now, 1 shape per obj file
-    std::cout << "Number of shapes: " << shapes.size() << std::endl;
-    //mMaterial.albedo = glm::vec3(0.8); // TODO: FIX
-    //mMaterial.coeffs = glm::vec3(1, 0, 0);
 
+    // Build VBO and IBO data: one vertex per unique (vertex, normal, texcoord)
+    std::unordered_map<tinyobj::index_t, GLuint, TinyObjIndexHash, TinyObjIndexEqual> Idx_LUT;
+    std::vector<GLuint> indices;
+    size_t num_face_vertices = 0;
     for(size_t i = 0; i < shapes.size(); i++) {
-        std::cout << "shapes[i].mesh.indices.size() " << shapes[i].mesh.indices.size() << std::endl;
-        for(size_t f = 0; f < shapes[i].mesh.indices.size() / 3; f++) {
-            // per-face vertex information
-            auto idx = &shapes[i].mesh.indices[3 * f];
-            for(int k = 0; k < 3; k++) {
-                Vertex v;
-                v.position = raw_vertices[idx[k].vertex_index];
-                v.normal = raw_normals[idx[k].normal_index];
-                v.material = mMaterial;
-                mBuffer.push_back(v);
-            }
-        }
+        num_face_vertices += shapes[i].mesh.indices.size() / 3 * 3;
     }
-    /* // Build VBO and IBO data structures
-    std::map<tinyobj::index_t*, int, TinyObjIndexComparator> Idx_LUT;
+    Idx_LUT.reserve(num_face_vertices);
+    indices.reserve(num_face_vertices);
+    bool has_texcoords = !raw_texcoords.empty();
     for(size_t i = 0; i < shapes.size(); i++) {
-        std::cout << "shapes[i].mesh.indices.size() " << shapes[i].mesh.indices.size() << std::endl;
         for(size_t f = 0; f < shapes[i].mesh.indices.size() / 3; f++) {
-            glm::ivec3 index_buffer_idx;
             for(int k = 0; k < 3; k++) {
-                tinyobj::index_t *idx = &shapes[i].mesh.indices[3 * f + k];
-                std::cout << "Searching ... " << idx->vertex_index << " " << idx->normal_index << " " << idx->texcoord_index  << std::endl;
-                if(Idx_LUT.find(idx) == Idx_LUT.end()) {
-                    std::cout << "Assigning " << idx->vertex_index << " " << idx->normal_index << " " << idx->texcoord_index << " ";
-                    mVertices.push_back(raw_vertices[idx->vertex_index]);
-                    mNormals.push_back(raw_normals[idx->normal_index]);
-                    if(idx->texcoord_index >= 0)
-                        mTexCoords.push_back(raw_texcoords[idx->texcoord_index]);
-                    std::cout << "to index " << mVertices.size() - 1 << " >> ";
-                    //Idx_LUT.insert(std::make_pair<tinyobj::index_t, int>(idx, (int)(mVertices.size()) - 1));
-                    std::cout << "idx: " << idx << std::endl;
-                    //Idx_LUT[idx] = (int)(mVertices.size()) - 1;
-                    Idx_LUT.emplace(idx, (int) mVertices.size() - 1);
-                    auto find_idx = Idx_LUT.find(idx);
-                    std::cout << ((find_idx == Idx_LUT.end()) ? "Not Found" : "Found") << std::endl;
-                    assert(find_idx != Idx_LUT.end());
-                    std::cout << "check (" << find_idx->first->vertex_index << "," << find_idx->first->normal_index << "," << find_idx->first->texcoord_index << ") " << 
-                     find_idx->second << std::endl;
+                const tinyobj::index_t& idx = shapes[i].mesh.indices[3 * f + k];
+                auto found = Idx_LUT.find(idx);
+                if(found == Idx_LUT.end()) {
+                    Vertex v;
+                    v.position = raw_vertices[idx.vertex_index];
+                    v.normal = glm::packSnorm3x10_1x2(glm::vec4(raw_normals[idx.normal_index], 0.0f));
+                    mBuffer.push_back(v);
+                    if(has_texcoords) {
+                        glm::vec2 uv = (idx.texcoord_index >= 0) ? raw_texcoords[idx.texcoord_index] : glm::vec2(0.0f);
+                        mTexCoords.push_back(glm::packHalf2x16(uv));
+                    }
+                    found = Idx_LUT.emplace(idx, GLuint(mBuffer.size() - 1)).first;
                 }
-                std::cout << "Using index : " << Idx_LUT[idx] << " for " << idx->vertex_index << " " << idx->normal_index << " " << idx->texcoord_index << std::endl;
-                index_buffer_idx[k] = Idx_LUT[idx];
+                indices.push_back(found->second);
             }
-            mIndices.push_back(index_buffer_idx);
         }
-    } */
-    
-    //assert(mNormals.size() == mVertices.size());
-    /*for(auto& idx: mIndices) {
-        std::cout << idx[0] << " " << idx[1] << " " << idx[2] << std::endl;
-    }*/
+    }
+
+    // 16-bit indices whenever the mesh is small enough
+    size_t index_count = indices.size();
+    if(mBuffer.size() <= 65536) {
+        mArrays.index_type = GL_UNSIGNED_SHORT;
+        mIndices16.assign(indices.begin(), indices.end());
+    } else {
+        mArrays.index_type = GL_UNSIGNED_INT;
+        mIndices32.swap(indices);
+    }
+
+    // compared against the previous layout: position, normal, albedo, coeffs
+    size_t unindexed_bytes = num_face_vertices * 4 * sizeof(glm::vec3);
+    size_t vertex_bytes = mBuffer.size() * sizeof(Vertex) + mTexCoords.size() * sizeof(glm::uint32);
+    size_t index_bytes = index_count * (mArrays.index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+    std::stringstream ss;
+    ss << filename << ": " << shapes.size() << " shapes, " << num_face_vertices << " -> " << mBuffer.size()
+        << " vertices (" << (mBuffer.size() ? float(num_face_vertices) / mBuffer.size() : 0.0f) << "x), "
+        << unindexed_bytes << " -> " << vertex_bytes + index_bytes << " bytes ("
+        << (mArrays.index_type == GL_UNSIGNED_SHORT ? 16 : 32) << "-bit indices)\n";
+    std::cout << ss.str() << std::flush;
 }
 
 void TriangleMesh::set_transformations(glm::vec3 translate, 
@@ -159,62 +229,84 @@ void TriangleMesh::set_transformations(glm::vec3 translate,
     mScale = scale;
 }
 
-void TriangleMesh::setup(GLSLVarMap& var_map) {
-    GLuint vpos_location = var_map["position"];
-    GLuint vnormal_location = var_map["normal"];
-    GLuint albedo_location = var_map["albedo"];
-    GLuint coeffs_location = var_map["coeffs"];
+void TriangleMesh::setup(GLSLVarMap& var_map, GPUResourceCache* cache) {
+    VertexLayout layout;
+    layout.position = var_map["position"];
+    layout.normal = var_map["normal"];
+    layout.texcoord = var_map.count("texcoord") ? GLint(var_map["texcoord"]) : -1;
 
-    GLsizei pos_stride = sizeof(Vertex); //sizeof(glm::vec3) + sizeof(Material);
-    GLsizei normal_stride = sizeof(Vertex); //sizeof(Material) + sizeof(glm::vec3);
-    GLsizei albedo_stride = sizeof(Vertex); //sizeof(glm::vec3) + sizeof(glm::vec3) + sizeof(glm::vec3);
-    GLsizei coeffs_stride = sizeof(Vertex); //albedo_stride;
+    // buffers are uploaded only if no other mesh with the same arrays is cached
+    mCache = cache;
+    mVAO = mCache->acquireMesh(mContentHash, mArrays, layout);
+}
 
-    glGenVertexArrays(1, &mVAO);
+void TriangleMesh::render(const DrawLocations& locations, int num_views,
+    const Frustum* frusta, DrawStats* stats)
+{
+    // -1 when the material comes from the object's uniform block
+    if(locations.albedo >= 0)
+        glUniform3fv(locations.albedo, 1, glm::value_ptr(mMaterial.albedo));
+    if(locations.coeffs >= 0)
+        glUniform3fv(locations.coeffs, 1, glm::value_ptr(mMaterial.coeffs));
     glBindVertexArray(mVAO);
-
-    glGenBuffers(1, &mVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, mVBO);
-
-    std::cout << "Buffer elements: " << mBuffer.size() << std::endl;
-    std::cout << "Buffer size: " << sizeof(mBuffer[0]) * mBuffer.size() << std::endl;
-    std::cout << "position offset: " << offsetof(Vertex, position) << std::endl;
-    std::cout << "normal offset: " << offsetof(Vertex, normal) << std::endl;
-    std::cout << "albedo offset: " << offsetof(Vertex, material.albedo) << std::endl;
-    std::cout << "coeffs offset: " << offsetof(Vertex, material.coeffs) << std::endl;
-    //glBufferData(GL_ARRAY_BUFFER, mVertices.size() * sizeof(glm::vec3), mVertices.data(), GL_STATIC_DRAW);
-    glBufferData(GL_ARRAY_BUFFER, mBuffer.size() * sizeof(mBuffer[0]), mBuffer.data(), GL_STATIC_DRAW);
-    glEnableVertexAttribArray(vpos_location);
-    glVertexAttribPointer(vpos_location, 3, GL_FLOAT, GL_FALSE,
-                          pos_stride, (void*) offsetof(Vertex, position));
-    glEnableVertexAttribArray(vnormal_location);
-    glVertexAttribPointer(vnormal_location, 3, GL_FLOAT, GL_FALSE,
-                          normal_stride, (void*) offsetof(Vertex, normal));
-    glEnableVertexAttribArray(albedo_location);
-    glVertexAttribPointer(albedo_location, 3, GL_FLOAT, GL_FALSE,
-                          albedo_stride, (void*) offsetof(Vertex, material.albedo));
-    glEnableVertexAttribArray(coeffs_location);
-    glVertexAttribPointer(coeffs_location, 3, GL_FLOAT, GL_FALSE,
-                          coeffs_stride, (void*) offsetof(Vertex, material.coeffs));
-    // glEnableVertexAttribArray(vcol_location);
-    // glVertexAttribPointer(vcol_location, 3, GL_FLOAT, GL_FALSE,
-    //                     sizeof(vertices[0]), (void*) (sizeof(float) * 2));
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-    /* // Element buffer
-    glGenBuffers(1, &mIBO);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mIndices.size() * sizeof(glm::ivec3), mIndices.data(), GL_STATIC_DRAW);
-    
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0); */
+    thread_local std::vector<IndexRange> ranges;
+    ranges.clear();
+    collectRanges(num_views, frusta, ranges, stats);
+    for(auto& range: ranges) {
+        drawRange(range.first_index, range.num_indices, num_views);
+    }
     glBindVertexArray(0);
 }
 
-void TriangleMesh::render(GLint model_matrix_location)
+void TriangleMesh::collectRanges(int num_views, const Frustum* frusta,
+    std::vector<IndexRange>& ranges, DrawStats* stats) const
 {
-    glBindVertexArray(mVAO);
-    //glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIBO);
-    glDrawArrays(GL_TRIANGLES, 0, mBuffer.size() * 3);
-    //glDrawElements(GL_TRIANGLES, mIndices.size() * 3, GL_UNSIGNED_INT, (void*) 0);
-    glBindVertexArray(0);
+    if(frusta == nullptr) {
+        ranges.push_back(IndexRange{ 0, mArrays.num_indices });
+        stats->chunks_drawn += mChunks.size();
+        return;
+    }
+    // Draw the chunks visible in any view, merging adjacent chunks into
+    // one draw call
+    size_t first = 0, count = 0;
+    for(auto& chunk: mChunks) {
+        bool visible = false;
+        for(int v = 0; v < num_views && !visible; v++) {
+            visible = frusta[v].classify(chunk.bounds) != Frustum::OUTSIDE;
+        }
+        if(!visible) {
+            stats->chunks_culled++;
+            continue;
+        }
+        stats->chunks_drawn++;
+        if(count > 0 && first + count == chunk.first_index) {
+            count += chunk.num_indices;
+        } else {
+            if(count > 0)
+                ranges.push_back(IndexRange{ first, count });
+            first = chunk.first_index;
+            count = chunk.num_indices;
+        }
+    }
+    if(count > 0)
+        ranges.push_back(IndexRange{ first, count });
+}
+
+void TriangleMesh::drawRange(size_t first_index, size_t num_indices, int num_views)
+{
+    size_t index_size = (mArrays.index_type == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+    void* offset = (void*) (first_index * index_size);
+    if(num_views == 1) {
+        glDrawElements(GL_TRIANGLES, num_indices, mArrays.index_type, offset);
+    } else {
+        glDrawElementsInstanced(GL_TRIANGLES, num_indices, mArrays.index_type, offset, num_views);
+    }
+}
+
+void TriangleMesh::release()
+{
+    if(mVAO == 0)
+        return;
+    mCache->releaseMesh(mContentHash);
+    mVAO = 0;
 }
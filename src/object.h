@@ -3,25 +3,64 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <cstdint>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glad/glad.h>
 
+#include "bvh.h"
 
 struct Object {
 public:
+    virtual ~Object() {}
     virtual glm::mat4 get_transformation() const = 0;
     virtual void set_transformations(glm::vec3 translate, glm::mat4 rotate, glm::vec3 scale) = 0;
 };
 
 using GLSLVarMap = std::map<std::string, GLuint>;
 
+class GPUResourceCache;
+
+// Uniform locations of the active program used by the draw calls
+struct DrawLocations {
+    GLint model;
+    GLint albedo;
+    GLint coeffs;
+};
+
+// Consecutive indices of a mesh drawn by one draw call
+struct IndexRange {
+    size_t first_index;
+    size_t num_indices;
+};
+
+// Chunks of geometry drawn and culled in a frame
+struct DrawStats {
+    size_t chunks_drawn;
+    size_t chunks_culled;
+
+    DrawStats(): chunks_drawn(0), chunks_culled(0) {}
+};
+
 class GLRenderableObject: public Object {
     // Objects that can be rendered using OpenGL
 public:
-    virtual void setup(GLSLVarMap& var_map) = 0;
-    virtual void render(GLint model_matrix_location) = 0;
+    // GPU resources may be shared with other objects through the cache
+    virtual void setup(GLSLVarMap& var_map, GPUResourceCache* cache) = 0;
+    // Draws num_views instances, one per view of a batch. frusta holds the
+    // view frusta in object space, the parts of the object outside all of
+    // them may be skipped; with nullptr the whole object is drawn.
+    virtual void render(const DrawLocations& locations, int num_views,
+        const Frustum* frusta, DrawStats* stats) = 0;
+    // Object space bounds
+    virtual AABB getBounds() const = 0;
+    // Number of separately culled parts
+    virtual size_t getNumChunks() const { return 1; }
+    // Free the GPU resources created by setup(). Needs the GL context
+    // that was current during setup().
+    virtual void release() = 0;
 };
 
 struct Material {
@@ -29,28 +68,28 @@ struct Material {
     glm::vec3 coeffs; // kd, ks, specular highight N in (cos(theta))^N
 };
 
+// Compact vertex layout, 16 bytes. The normal is packed as signed
+// normalized 10:10:10:2 (GL_INT_2_10_10_10_REV). The material is the same
+// for the whole mesh and is set per draw through the albedo/coeffs uniforms.
 struct Vertex {
     glm::vec3 position;
-    glm::vec3 normal;
-    Material material;
+    glm::uint32 normal;
 };
 
 class TestTriangle : public GLRenderableObject {
 public:
-    TestTriangle() {
+    TestTriangle(): vbo(0), vao(0) {
         // constructor only for creating the geometry
     }
 
-    void setup(GLSLVarMap& var_map) override {
+    void setup(GLSLVarMap& var_map, GPUResourceCache* /*cache*/) override {
         GLuint vpos_location = var_map["position"];
-        GLuint vcol_location = var_map["albedo"];
         const struct {
             float x, y, z;
-            float r, g, b;
         } vertices[3] = {
-            { -0.6f, -0.4f, 0.0f, 1.f, 0.f, 0.f },
-            {  0.6f, -0.4f, 0.0f, 0.f, 1.f, 0.f },
-            {   0.f,  0.6f, 0.0f, 0.f, 0.f, 1.f }
+            { -0.6f, -0.4f, 0.0f },
+            {  0.6f, -0.4f, 0.0f },
+            {   0.f,  0.6f, 0.0f }
         };
         // create vao??
         glGenVertexArrays(1, &vao);
@@ -64,13 +103,10 @@ public:
         glEnableVertexAttribArray(vpos_location);
         glVertexAttribPointer(vpos_location, 3, GL_FLOAT, GL_FALSE,
                             sizeof(vertices[0]), (void*) 0);
-        glEnableVertexAttribArray(vcol_location);
-        glVertexAttribPointer(vcol_location, 3, GL_FLOAT, GL_FALSE,
-                            sizeof(vertices[0]), (void*) (sizeof(float) * 3));
         glBindBuffer(GL_ARRAY_BUFFER, 0);
         glBindVertexArray(0);
     }
-    void set_transformations(glm::vec3 translate, glm::mat4 rotate, glm::vec3 scale) override
+    void set_transformations(glm::vec3 /*translate*/, glm::mat4 /*rotate*/, glm::vec3 /*scale*/) override
     {}
 
     glm::mat4 get_transformation() const override
@@ -78,12 +114,25 @@ public:
         return glm::mat4(1.0);
     }
 
-    void render(GLint model_matrix_location) override {
+    AABB getBounds() const override {
+        return AABB(glm::vec3(-0.6f, -0.4f, 0.0f), glm::vec3(0.6f, 0.6f, 0.0f));
+    }
+
+    void render(const DrawLocations& locations, int num_views,
+        const Frustum* /*frusta*/, DrawStats* stats) override {
+        stats->chunks_drawn++;
+        glUniform3f(locations.albedo, 1.f, 0.f, 0.f);
         glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 3, num_views);
         glBindVertexArray(0);
     }
 
+    void release() override {
+        glDeleteBuffers(1, &vbo);
+        glDeleteVertexArrays(1, &vao);
+        vbo = vao = 0;
+    }
+
 private:
     GLuint vbo;
     GLuint vao;
@@ -99,6 +148,35 @@ private:
     glm::vec4 normal;
 };
 
+struct MeshLoadOptions {
+    // Generate shared per-vertex normals for meshes without normals instead
+    // of one normal per face. Lets faces share vertices in the index buffer.
+    bool smooth_normals;
+
+    MeshLoadOptions(): smooth_normals(false) {}
+};
+
+class MappedFile;
+
+// GPU ready arrays of a mesh, as uploaded by TriangleMesh::setup. They point
+// either into the mesh's own vectors or into a memory mapped cache file.
+struct MeshArrays {
+    const Vertex* vertices;
+    const glm::uint32* texcoords;  // nullptr if the mesh has none
+    const void* indices;
+    size_t num_vertices;
+    size_t num_indices;
+    GLenum index_type;             // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    std::shared_ptr<MappedFile> mapping;  // keeps mapped arrays alive
+
+    // Vertex of the i-th index, for either index type
+    size_t index(size_t i) const {
+        return index_type == GL_UNSIGNED_SHORT ?
+            static_cast<const GLushort*>(indices)[i] :
+            static_cast<const GLuint*>(indices)[i];
+    }
+};
+
 class TriangleMesh: public GLRenderableObject {
     // Renderable triangle mesh
     // List of vertices and faces of triangles
@@ -106,27 +184,61 @@ public:
     TriangleMesh(const std::string& obj_filename,
         Material mat, glm::vec3 translate=glm::vec3(0.0),
         glm::mat4 rotate=glm::mat4(1.0),
-        glm::vec3 scale=glm::vec3(1.0))
-        : mTranslation(translate), mRotation(rotate),
+        glm::vec3 scale=glm::vec3(1.0),
+        const MeshLoadOptions& options=MeshLoadOptions())
+        : mVAO(0), mCache(nullptr),
+        mTranslation(translate), mRotation(rotate),
         mScale(scale) {
-        loadObj(obj_filename, mat);
+        loadObj(obj_filename, mat, options);
     }
 
     void set_transformations(glm::vec3 translate, glm::mat4 rotate, glm::vec3 scale) override;
     glm::mat4 get_transformation() const override { 
         return glm::translate(glm::mat4(1.0), mTranslation) * mRotation * glm::scale(glm::mat4(1.0), mScale);
     }
-    void setup(GLSLVarMap& var_map) override;
-    void render(GLint model_matrix_location) override;
+    void setup(GLSLVarMap& var_map, GPUResourceCache* cache) override;
+    void render(const DrawLocations& locations, int num_views,
+        const Frustum* frusta, DrawStats* stats) override;
+    void release() override;
+    AABB getBounds() const override { return mBounds; }
+    size_t getNumChunks() const override { return mChunks.size(); }
+    // Index ranges render() would draw, for drawing the mesh from merged
+    // buffers: the chunks visible in any of the frusta (all with nullptr),
+    // adjacent ones joined
+    void collectRanges(int num_views, const Frustum* frusta, std::vector<IndexRange>& ranges,
+        DrawStats* stats) const;
+
+    const MeshArrays& getArrays() const { return mArrays; }
+    const Material& getMaterial() const { return mMaterial; }
+    size_t getNumVertices() const { return mArrays.num_vertices; }
+    size_t getNumTriangles() const { return mArrays.num_indices / 3; }
+    bool loadedFromCache() const { return mLoadedFromCache; }
+    // Hash of the vertex and index arrays, identifies the mesh in the GPU cache
+    uint64_t getContentHash() const { return mContentHash; }
 private:
     GLuint mVAO;
-    GLuint mVBO;
-    //GLuint mIBO;
-    std::vector<Vertex> mBuffer;
-    //std::vector<glm::vec3> mVertices;
-    //std::vector<glm::vec3> mNormals;
-    //std::vector<glm::vec2> mTexCoords;
-    //std::vector<glm::ivec3> mIndices;   // vertex indices forming a face
+    GPUResourceCache* mCache;   // owner of mVAO and its buffers
+    MeshArrays mArrays;
+    uint64_t mContentHash;
+
+    // Consecutive runs of triangles with their bounds, the units of culling
+    struct Chunk {
+        size_t first_index;
+        size_t num_indices;
+        AABB bounds;
+    };
+    std::vector<Chunk> mChunks;
+    AABB mBounds;
+    bool mLoadedFromCache;
+
+    // Storage of mArrays when the mesh was parsed from the OBJ file
+    std::vector<Vertex> mBuffer;    // unique vertices
+    // Half-float texture coordinates, one per vertex. Empty for meshes
+    // without texture coordinates.
+    std::vector<glm::uint32> mTexCoords;
+    // Triangle list indices into mBuffer, only one of the two is used
+    std::vector<GLushort> mIndices16;
+    std::vector<GLuint> mIndices32;
 
     Material mMaterial; // single material for all faces
     
@@ -134,6 +246,11 @@ private:
     glm::mat4 mRotation;
     glm::vec3 mScale;
 
-    void loadObj(const std::string& filename, Material mat);
+    void loadObj(const std::string& filename, Material mat, const MeshLoadOptions& options);
+    void parseObj(const std::string& filename, const MeshLoadOptions& options);
+    // Point mArrays at the parsed arrays and add them to the mesh cache
+    void storeArrays(const std::string& filename, const MeshLoadOptions& options);
+    void computeChunks();
+    void drawRange(size_t first_index, size_t num_indices, int num_views);
 };
 
@@ -0,0 +1,169 @@
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+
+#include <glm/gtc/packing.hpp>
+
+#include "output_format.h"
+
+size_t ChannelFormat::pixelBytes() const
+{
+    return components * (type == FLOAT32 ? sizeof(float) : sizeof(uint16_t));
+}
+
+const char* ChannelFormat::dtype() const
+{
+    switch(type) {
+    case FLOAT16: return "<f2";
+    case UNORM16: return "<u2";
+    default: return "<f4";
+    }
+}
+
+OutputFormat::OutputFormat()
+{
+    channels[DEPTH] = ChannelFormat(false, 1, ChannelFormat::FLOAT32);
+}
+
+bool OutputFormat::operator==(const OutputFormat& other) const
+{
+    for(int c = 0; c < NUM_CHANNELS; c++) {
+        if(channels[c] != other.channels[c])
+            return false;
+    }
+    return true;
+}
+
+const char* OutputFormat::channelName(int channel)
+{
+    static const char* names[NUM_CHANNELS] = { "color", "position", "normal", "depth" };
+    return names[channel];
+}
+
+void OutputFormat::set(int channel, const std::string& option)
+{
+    ChannelFormat& format = channels[channel];
+    if(option == "on") {
+        format.enabled = true;
+    } else if(option == "off") {
+        format.enabled = false;
+    } else if(option == "rgb" || option == "rgba") {
+        format.enabled = true;
+        format.components = option == "rgb" ? 3 : 4;
+    } else if(option == "float32" || option == "float16" || option == "unorm16") {
+        format.enabled = true;
+        format.type = option == "float32" ? ChannelFormat::FLOAT32 :
+            (option == "float16" ? ChannelFormat::FLOAT16 : ChannelFormat::UNORM16);
+    } else {
+        throw std::runtime_error("Unknown option '" + option + "' for output channel " + channelName(channel));
+    }
+}
+
+void OutputFormat::validate() const
+{
+    for(int c = 0; c < NUM_CHANNELS; c++) {
+        const ChannelFormat& format = channels[c];
+        if(c == DEPTH ? format.components != 1 : format.components < 3) {
+            throw std::runtime_error(std::string("Invalid layout for output channel ") + channelName(c));
+        }
+        // only color is in [0, 1]
+        if(format.type == ChannelFormat::UNORM16 && c != COLOR) {
+            throw std::runtime_error(std::string("unorm16 is only supported for the color channel, not ") + channelName(c));
+        }
+    }
+}
+
+OutputFormat OutputFormat::fromJson(const Json::Value& output_spec)
+{
+    OutputFormat output;
+    if(output_spec.isNull())
+        return output;
+    if(!output_spec.isObject()) {
+        throw std::runtime_error("Scene 'output' entry must be an object");
+    }
+
+    for(int c = 0; c < NUM_CHANNELS; c++) {
+        const Json::Value& spec = output_spec[channelName(c)];
+        if(spec.isNull())
+            continue;
+        if(spec.isBool()) {
+            output.channels[c].enabled = spec.asBool();
+            continue;
+        }
+        if(!spec.isObject()) {
+            throw std::runtime_error(std::string("Invalid output specification for ") + channelName(c));
+        }
+        if(spec.isMember("format"))
+            output.set(c, spec["format"].asString());
+        if(spec.isMember("type"))
+            output.set(c, spec["type"].asString());
+        if(spec.isMember("enabled"))
+            output.channels[c].enabled = spec["enabled"].asBool();
+    }
+    output.validate();
+    return output;
+}
+
+void OutputFormat::applyOverrides(const std::string& spec)
+{
+    std::stringstream ss(spec);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        if(item.empty())
+            continue;
+        size_t eq = item.find('=');
+        std::string name = item.substr(0, eq);
+        int channel = 0;
+        while(channel < NUM_CHANNELS && name != channelName(channel))
+            channel++;
+        if(channel == NUM_CHANNELS || eq == std::string::npos) {
+            throw std::runtime_error("Invalid output channel specification '" + item + "'");
+        }
+        std::stringstream options(item.substr(eq + 1));
+        std::string option;
+        while(std::getline(options, option, ':')) {
+            set(channel, option);
+        }
+    }
+    validate();
+}
+
+void channel_to_rgba_float(const ChannelFormat& format, const void* src, size_t num_pixels, float* dst)
+{
+    int n = format.components;
+    for(size_t i = 0; i < num_pixels; i++) {
+        float* out = dst + i * 4;
+        out[3] = 1.0f;
+        for(int c = 0; c < n; c++) {
+            size_t k = i * n + c;
+            switch(format.type) {
+            case ChannelFormat::FLOAT32:
+                out[c] = static_cast<const float*>(src)[k];
+                break;
+            case ChannelFormat::FLOAT16:
+                out[c] = glm::unpackHalf1x16(static_cast<const uint16_t*>(src)[k]);
+                break;
+            case ChannelFormat::UNORM16:
+                out[c] = static_cast<const uint16_t*>(src)[k] / 65535.0f;
+                break;
+            }
+        }
+    }
+}
+
+void linearize_depth(const ChannelFormat& format, const float* src, size_t num_pixels,
+    float near, float far, void* dst)
+{
+    // inverse of the depth mapping of glm::perspective with [-1, 1] clip z
+    float a = 2.0f * near * far;
+    float b = far + near;
+    float c = far - near;
+    for(size_t i = 0; i < num_pixels; i++) {
+        float d = src[i];
+        float z = d < 1.0f ? a / (b - (2.0f * d - 1.0f) * c) : 0.0f;
+        if(format.type == ChannelFormat::FLOAT16)
+            static_cast<uint16_t*>(dst)[i] = glm::packHalf1x16(z);
+        else
+            static_cast<float*>(dst)[i] = z;
+    }
+}
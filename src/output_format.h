@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <json/json.h>
+
+// Layout and precision of one output channel
+struct ChannelFormat {
+    enum Type { FLOAT32 = 0, FLOAT16, UNORM16 };
+
+    bool enabled;
+    int components;     // 4 (RGBA) or 3 (RGB), 1 for depth
+    Type type;
+
+    ChannelFormat(bool enabled_ = true, int components_ = 4, Type type_ = FLOAT32):
+        enabled(enabled_), components(components_), type(type_) {}
+
+    size_t pixelBytes() const;
+    // numpy type string, e.g. "<f4"
+    const char* dtype() const;
+
+    bool operator==(const ChannelFormat& other) const {
+        return enabled == other.enabled && components == other.components && type == other.type;
+    }
+    bool operator!=(const ChannelFormat& other) const { return !(*this == other); }
+};
+
+// Which G-buffer channels are read back and written, and how. Mirrors the
+// "output" scene key, e.g.
+//   "output": {"color": {"format": "rgb", "type": "float16"},
+//              "position": false, "normal": {"type": "float16"},
+//              "depth": true}
+// Channels not mentioned keep their default: color, position and normal as
+// RGBA float32, no depth. Depth is the linear view space depth computed from
+// the depth attachment, 0 where nothing was drawn.
+struct OutputFormat {
+    enum Channel { COLOR = 0, POSITION, NORMAL, DEPTH, NUM_CHANNELS };
+
+    ChannelFormat channels[NUM_CHANNELS];
+
+    OutputFormat();
+
+    const ChannelFormat& operator[](int channel) const { return channels[channel]; }
+    bool operator==(const OutputFormat& other) const;
+    bool operator!=(const OutputFormat& other) const { return !(*this == other); }
+
+    // "color", "position", "normal", "depth"
+    static const char* channelName(int channel);
+
+    // Throw std::runtime_error on invalid specifications
+    static OutputFormat fromJson(const Json::Value& output_spec);
+    // Apply a command line specification on top of this format: comma
+    // separated channel=options with options separated by ':', e.g.
+    //   color=rgb:float16,position=off,depth=on
+    void applyOverrides(const std::string& spec);
+private:
+    void set(int channel, const std::string& option);
+    void validate() const;
+};
+
+// Expand a color channel to RGBA float32 (alpha 1 for RGB), e.g. for tone
+// mapping
+void channel_to_rgba_float(const ChannelFormat& format, const void* src, size_t num_pixels, float* dst);
+
+// Convert a [0, 1] perspective depth buffer into linear view space depth,
+// stored as float32 or float16 according to format
+void linearize_depth(const ChannelFormat& format, const float* src, size_t num_pixels,
+    float near, float far, void* dst);
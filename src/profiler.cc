@@ -0,0 +1,179 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <unistd.h>
+
+#include "profiler.h"
+
+std::atomic<bool> Profiler::sEnabled(false);
+
+Profiler& Profiler::instance()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::Profiler(): mTrace(false), mEpoch(Clock::now()), mGPUEnd_us(0.0), mOldestEvent(0),
+    mDroppedEvents(0)
+{
+}
+
+void Profiler::enable(bool trace)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTrace = mTrace || trace;
+    sEnabled = true;
+}
+
+int Profiler::threadId()
+{
+    static std::atomic<int> next_id(1);
+    thread_local int id = next_id++;
+    return id;
+}
+
+void Profiler::setThreadName(const std::string& name)
+{
+    int tid = threadId();
+    std::lock_guard<std::mutex> lock(mMutex);
+    mThreadNames[tid] = name;
+}
+
+void Profiler::record(const char* name, Clock::time_point start, Clock::time_point end)
+{
+    double ts = std::chrono::duration<double, std::micro>(start - mEpoch).count();
+    double dur = std::chrono::duration<double, std::micro>(end - start).count();
+    int tid = threadId();
+    std::lock_guard<std::mutex> lock(mMutex);
+    add(name, tid, ts, dur);
+}
+
+void Profiler::recordGPU(const char* name, Clock::time_point submitted, uint64_t duration_ns)
+{
+    double ts = std::chrono::duration<double, std::micro>(submitted - mEpoch).count();
+    double dur = duration_ns / 1000.0;
+    std::lock_guard<std::mutex> lock(mMutex);
+    ts = std::max(ts, mGPUEnd_us);
+    mGPUEnd_us = ts + dur;
+    // the GPU track has thread id 0
+    add(name, 0, ts, dur);
+}
+
+void Profiler::add(const char* name, int tid, double ts_us, double dur_us)
+{
+    // GPU stages are kept apart from the CPU side of the same stage
+    if(tid == 0)
+        mHistograms[std::string("gpu ") + name].add(dur_us);
+    else
+        mHistograms[name].add(dur_us);
+    if(mTrace) {
+        Event event = { name, tid, ts_us, dur_us };
+        if(mEvents.size() < kMaxEvents) {
+            mEvents.push_back(event);
+        } else {
+            mEvents[mOldestEvent] = event;
+            mOldestEvent = (mOldestEvent + 1) % kMaxEvents;
+            mDroppedEvents++;
+        }
+    }
+}
+
+void Profiler::Histogram::add(double us)
+{
+    int bucket = us <= 1.0 ? 0 : int(std::log2(us) * 4.0);
+    buckets[std::min(bucket, kNumBuckets - 1)]++;
+    count++;
+    total_us += us;
+    max_us = std::max(max_us, us);
+}
+
+double Profiler::Histogram::percentile(double p) const
+{
+    // upper bound of the bucket holding the percentile
+    size_t rank = size_t(std::ceil(p * count));
+    size_t seen = 0;
+    for(int i = 0; i < kNumBuckets; i++) {
+        seen += buckets[i];
+        if(seen >= rank && seen > 0)
+            return std::min(std::exp2((i + 1) / 4.0), max_us);
+    }
+    return max_us;
+}
+
+void Profiler::resetHistograms()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mHistograms.clear();
+}
+
+Json::Value Profiler::summary() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Json::Value summary(Json::objectValue);
+    for(auto& it: mHistograms) {
+        const Histogram& h = it.second;
+        Json::Value& stage = summary[it.first];
+        stage["count"] = Json::UInt64(h.count);
+        stage["total_ms"] = h.total_us / 1e3;
+        stage["mean_ms"] = h.total_us / 1e3 / h.count;
+        stage["p50_ms"] = h.percentile(0.5) / 1e3;
+        stage["p90_ms"] = h.percentile(0.9) / 1e3;
+        stage["p99_ms"] = h.percentile(0.99) / 1e3;
+        stage["max_ms"] = h.max_us / 1e3;
+    }
+    return summary;
+}
+
+void Profiler::printSummary() const
+{
+    Json::Value stages = summary();
+    std::cout << "Timings (ms)                 count       total      mean       p50       p90       p99       max" << std::endl;
+    for(auto& name: stages.getMemberNames()) {
+        const Json::Value& s = stages[name];
+        std::cout << "  " << std::left << std::setw(24) << name << std::right
+            << std::setw(9) << s["count"].asUInt64() << std::fixed << std::setprecision(3);
+        const char* columns[6] = { "total_ms", "mean_ms", "p50_ms", "p90_ms", "p99_ms", "max_ms" };
+        for(int i = 0; i < 6; i++) {
+            std::cout << " " << std::setw(i == 0 ? 11 : 9) << s[columns[i]].asDouble();
+        }
+        std::cout << std::defaultfloat << std::endl;
+    }
+}
+
+bool Profiler::writeTrace(const std::string& filename) const
+{
+    std::ofstream out(filename);
+    if(!out) {
+        std::cout << "Error: unable to write trace " << filename << std::endl;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    int pid = getpid();
+    // written by hand, a Json::Value of all events would double the memory
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": " << pid
+        << ", \"tid\": 0, \"args\": {\"name\": \"GPU\"}}";
+    for(auto& it: mThreadNames) {
+        out << ",\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": " << pid
+            << ", \"tid\": " << it.first << ", \"args\": {\"name\": \"" << it.second << "\"}}";
+    }
+    out << std::fixed << std::setprecision(3);
+    for(size_t i = 0; i < mEvents.size(); i++) {
+        const Event& e = mEvents[(mOldestEvent + i) % mEvents.size()];
+        out << ",\n{\"ph\": \"X\", \"name\": \"" << e.name << "\", \"cat\": \""
+            << (e.tid == 0 ? "gpu" : "cpu") << "\", \"pid\": " << pid << ", \"tid\": " << e.tid
+            << ", \"ts\": " << e.ts_us << ", \"dur\": " << e.dur_us << "}";
+    }
+    out << "\n]}\n";
+    if(!out) {
+        std::cout << "Error: unable to write trace " << filename << std::endl;
+        return false;
+    }
+    std::cout << "Trace with " << mEvents.size() << " events written to " << filename;
+    if(mDroppedEvents > 0)
+        std::cout << ", " << mDroppedEvents << " older events dropped";
+    std::cout << std::endl;
+    return true;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <json/json.h>
+
+// Process wide timing of named stages, e.g.
+//
+//   {
+//       ScopedTimer timer("encode png");
+//       ...
+//   }
+//
+// Every stage gets a histogram of its durations. With tracing on, the
+// individual events are kept as well, the last kMaxEvents of them, and can
+// be written as a Chrome trace-event file (chrome://tracing, Perfetto).
+// Disabled by default, then a ScopedTimer costs a single branch. Stage names
+// must be string literals.
+class Profiler {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    static Profiler& instance();
+    static bool enabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+    void enable(bool trace);
+
+    // Name of the calling thread in the trace
+    void setThreadName(const std::string& name);
+
+    void record(const char* name, Clock::time_point start, Clock::time_point end);
+    // An event on the GPU track, duration from a timer query. GPU events run
+    // one after the other; they are placed at their submission time or
+    // after the previous GPU event, whichever is later.
+    void recordGPU(const char* name, Clock::time_point submitted, uint64_t duration_ns);
+
+    // Clear the histograms, e.g. at the start of a job. Trace events are kept,
+    // up to kMaxEvents over all jobs.
+    void resetHistograms();
+    // Per stage count, total, mean, percentiles and max in milliseconds
+    Json::Value summary() const;
+    void printSummary() const;
+
+    // Trace events kept, older ones are dropped beyond this (about 32 MB)
+    static const size_t kMaxEvents = size_t(1) << 20;
+    bool writeTrace(const std::string& filename) const;
+private:
+    Profiler();
+
+    // Durations in 1/4 octaves of microseconds
+    struct Histogram {
+        static const int kNumBuckets = 160;
+        size_t count;
+        double total_us, max_us;
+        std::vector<size_t> buckets;
+
+        Histogram(): count(0), total_us(0.0), max_us(0.0), buckets(kNumBuckets) {}
+        void add(double us);
+        double percentile(double p) const;
+    };
+    struct Event {
+        const char* name;
+        int tid;
+        double ts_us, dur_us;
+    };
+
+    static std::atomic<bool> sEnabled;
+    bool mTrace;
+    Clock::time_point mEpoch;
+    double mGPUEnd_us;  // end of the last GPU event
+    mutable std::mutex mMutex;
+    std::map<std::string, Histogram> mHistograms;
+    std::vector<Event> mEvents;     // ring buffer once kMaxEvents are kept
+    size_t mOldestEvent;
+    size_t mDroppedEvents;
+    std::map<int, std::string> mThreadNames;
+
+    int threadId();
+    void add(const char* name, int tid, double ts_us, double dur_us);
+};
+
+// With seconds the duration is also added to *seconds, profiler enabled or
+// not, so that per stage counters and the profiler share one clock.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(const char* name, double* seconds = nullptr):
+        mName(Profiler::enabled() ? name : nullptr), mSeconds(seconds) {
+        if(mName || mSeconds)
+            mStart = Profiler::Clock::now();
+    }
+    ~ScopedTimer() {
+        if(!mName && !mSeconds)
+            return;
+        Profiler::Clock::time_point end = Profiler::Clock::now();
+        if(mName)
+            Profiler::instance().record(mName, mStart, end);
+        if(mSeconds)
+            *mSeconds += std::chrono::duration<double>(end - mStart).count();
+    }
+private:
+    const char* mName;
+    double* mSeconds;
+    Profiler::Clock::time_point mStart;
+};
@@ -0,0 +1,166 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "program_cache.h"
+
+namespace {
+
+const char kMagic[8] = { 'R', 'S', 'P', 'R', 'O', 'G', '\0', '\0' };
+// Bump when the header or the attribute bindings of the programs change
+const uint32_t kFormatVersion = 2;
+
+struct ProgramCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t binary_format;
+    uint64_t key;           // checked again against hash collisions of the name
+    uint64_t vs_size;
+    uint64_t fs_size;
+    uint64_t binary_size;
+};
+
+std::string gl_string(GLenum name)
+{
+    const GLubyte* str = glGetString(name);
+    return str ? reinterpret_cast<const char*>(str) : "";
+}
+
+uint64_t program_key(const std::string& vs_code, const std::string& fs_code)
+{
+    uint64_t h = hash_bytes(&kFormatVersion, sizeof(kFormatVersion));
+    for(GLenum name: { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+        std::string str = gl_string(name);
+        h = hash_bytes(str.data(), str.size() + 1, h);
+    }
+    h = hash_bytes(vs_code.data(), vs_code.size() + 1, h);
+    h = hash_bytes(fs_code.data(), fs_code.size() + 1, h);
+    return h;
+}
+
+std::string cache_filename(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.prog", (unsigned long long) key);
+    return ProgramCache::getDirectory() + "/" + name;
+}
+
+std::string gCacheDir;
+
+}
+
+void ProgramCache::setDirectory(const std::string& dir)
+{
+    gCacheDir = dir;
+    while(gCacheDir.size() > 1 && gCacheDir.back() == '/')
+        gCacheDir.pop_back();
+    if(!gCacheDir.empty())
+        mkdir(gCacheDir.c_str(), 0755);
+}
+
+const std::string& ProgramCache::getDirectory()
+{
+    return gCacheDir;
+}
+
+bool ProgramCache::enabled()
+{
+    if(gCacheDir.empty() || !glProgramBinary || !glGetProgramBinary)
+        return false;
+    GLint num_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    return num_formats > 0;
+}
+
+GLuint ProgramCache::load(const std::string& vs_code, const std::string& fs_code)
+{
+    if(!enabled())
+        return 0;
+    uint64_t key = program_key(vs_code, fs_code);
+    std::ifstream in(cache_filename(key).c_str(), std::ios::in | std::ios::binary);
+    if(!in)
+        return 0;
+
+    ProgramCacheHeader header;
+    if(!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.version != kFormatVersion ||
+        header.key != key ||
+        header.vs_size != vs_code.size() ||
+        header.fs_size != fs_code.size() ||
+        header.binary_size == 0) {
+        return 0;
+    }
+    std::vector<char> binary(header.binary_size);
+    if(!in.read(binary.data(), binary.size()))
+        return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.binary_format, binary.data(), GLsizei(binary.size()));
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if(!linked) {
+        // rejected by the driver, e.g. after an update that kept the version string
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+bool ProgramCache::store(const std::string& vs_code, const std::string& fs_code, GLuint program)
+{
+    if(!enabled())
+        return false;
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0)
+        return false;
+    std::vector<char> binary(length);
+    GLenum binary_format = 0;
+    glGetProgramBinary(program, length, &length, &binary_format, binary.data());
+    if(length <= 0)
+        return false;
+
+    uint64_t key = program_key(vs_code, fs_code);
+    ProgramCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kFormatVersion;
+    header.binary_format = binary_format;
+    header.key = key;
+    header.vs_size = vs_code.size();
+    header.fs_size = fs_code.size();
+    header.binary_size = length;
+
+    // Write to a temporary file and rename so that concurrent readers never
+    // see a partial entry
+    std::string filename = cache_filename(key);
+    char tmp_suffix[64];
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".%d.%zx.tmp", int(getpid()),
+             std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::string tmp_filename = filename + tmp_suffix;
+    {
+        std::ofstream out(tmp_filename.c_str(), std::ios::out | std::ios::binary);
+        if(!out)
+            return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(binary.data(), length);
+        if(!out) {
+            out.close();
+            unlink(tmp_filename.c_str());
+            return false;
+        }
+    }
+    if(rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        unlink(tmp_filename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+#include <glad/glad.h>
+
+// On-disk cache of linked program binaries (glGetProgramBinary). An entry is
+// keyed by the vertex and fragment source and the driver's vendor, renderer
+// and version strings, so a driver update or a shader edit simply misses.
+// Drivers may still reject a binary they wrote; load() then fails and the
+// caller compiles from source.
+class ProgramCache {
+public:
+    // An empty directory disables the cache (the default)
+    static void setDirectory(const std::string& dir);
+    static const std::string& getDirectory();
+    // Also false when the context offers no binary formats
+    static bool enabled();
+
+    // A new, linked program from the cached binary, or 0 on a miss
+    static GLuint load(const std::string& vs_code, const std::string& fs_code);
+    static bool store(const std::string& vs_code, const std::string& fs_code, GLuint program);
+};
@@ -0,0 +1,143 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <future>
+
+#include "utils.h"
+#include "ray_caster.h"
+#include "profiler.h"
+
+RayCaster::RayCaster(const std::string& output_dir, int width, int height,
+    int num_writers, int num_threads)
+    : CPURenderer(output_dir, nullptr, width, height, num_writers, num_threads),
+    mBuildSeconds(0.0), mNumRays(0), mTraceSeconds(0.0)
+{
+    std::cout << "Renderer: ray caster on " << mPool.size() << " threads" << std::endl;
+}
+
+RayCaster::RayCaster(Scene* scene, const std::string& output_dir,
+    int num_writers, int num_threads)
+    : CPURenderer(output_dir, scene, scene->getWidth(), scene->getHeight(), num_writers, num_threads),
+    mBuildSeconds(0.0), mNumRays(0), mTraceSeconds(0.0)
+{
+    std::cout << "Renderer: ray caster on " << mPool.size() << " threads" << std::endl;
+    sceneChanged();
+}
+
+RayCaster::~RayCaster()
+{
+    if(mNumRays > 0) {
+        std::cout << "Ray caster: " << mNumRays << " rays in " << mTraceSeconds << " s, "
+            << mNumRays / mTraceSeconds / 1e6 << " Mrays/s" << std::endl;
+    }
+}
+
+void RayCaster::sceneChanged()
+{
+    ScopedTimer timer("build bvh");
+    auto start = std::chrono::steady_clock::now();
+    mMeshes.clear();
+    mMeshTriangles.assign(1, 0);
+    for(auto object: mScene->getObjects()) {
+        const TriangleMesh* mesh = dynamic_cast<const TriangleMesh*>(object);
+        if(!mesh)
+            continue;
+        mMeshes.push_back(mesh);
+        mMeshTriangles.push_back(mMeshTriangles.back() + mesh->getNumTriangles());
+    }
+
+    std::vector<glm::vec3> vertices(3 * mMeshTriangles.back());
+    for(size_t m = 0; m < mMeshes.size(); m++) {
+        glm::mat4 model = mMeshes[m]->get_transformation();
+        const MeshArrays& arrays = mMeshes[m]->getArrays();
+        glm::vec3* out = &vertices[3 * mMeshTriangles[m]];
+        for(size_t i = 0; i < arrays.num_indices; i++) {
+            out[i] = glm::vec3(model * glm::vec4(arrays.vertices[arrays.index(i)].position, 1.0f));
+        }
+    }
+    mBVH.build(vertices);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    mBuildSeconds = elapsed.count();
+    std::cout << "Built BVH over " << mBVH.getNumTriangles() << " triangles, "
+        << mBVH.getNumNodes() << " nodes in " << mBuildSeconds * 1e3 << " ms" << std::endl;
+}
+
+void RayCaster::drawView(const Camera* camera, FrameSlot& slot)
+{
+    // only for the statistics, the BVH covers the whole scene
+    std::vector<Frustum::Result> visibility;
+    mScene->cullObjects(camera, visibility);
+
+    mModelView.resize(mMeshes.size());
+    mNormalMatrices.resize(mMeshes.size());
+    for(size_t m = 0; m < mMeshes.size(); m++) {
+        mModelView[m] = mView.view * mMeshes[m]->get_transformation();
+        mNormalMatrices[m] = normal_matrix(mMeshes[m]->get_transformation());
+    }
+    mInvViewProjection = glm::inverse(glm::dmat4(mView.projection) * glm::dmat4(mView.view));
+
+    ScopedTimer timer("cast rays");
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::future<void>> tasks;
+    for(int ty = 0; ty < mTilesY; ty++) {
+        for(int tx = 0; tx < mTilesX; tx++) {
+            tasks.push_back(mPool.enqueue([this, tx, ty, &slot] { castTile(tx, ty, slot); }));
+        }
+    }
+    for(auto& task: tasks) {
+        task.get();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    mTraceSeconds += elapsed.count();
+    mNumRays += size_t(mWidth) * mHeight;
+}
+
+void RayCaster::castTile(int tile_x, int tile_y, FrameSlot& slot)
+{
+    thread_local std::vector<float> depth;
+    thread_local PixelBlock block;
+    depth.assign(kTileSize * kTileSize, 1.0f);
+    block.pixels.clear();
+    int x0 = tile_x * kTileSize, y0 = tile_y * kTileSize;
+    int x1 = std::min(x0 + kTileSize, mWidth), y1 = std::min(y0 + kTileSize, mHeight);
+
+    for(int y = y0; y < y1; y++) {
+        for(int x = x0; x < x1; x++) {
+            // from the near to the far plane through the pixel center
+            double ndc_x = (x + 0.5) / mWidth * 2.0 - 1.0;
+            double ndc_y = (y + 0.5) / mHeight * 2.0 - 1.0;
+            glm::dvec4 near = mInvViewProjection * glm::dvec4(ndc_x, ndc_y, -1.0, 1.0);
+            glm::dvec4 far = mInvViewProjection * glm::dvec4(ndc_x, ndc_y, 1.0, 1.0);
+            glm::dvec3 origin = glm::dvec3(near) / near.w;
+            Ray ray;
+            ray.origin = glm::vec3(origin);
+            ray.direction = glm::vec3(glm::dvec3(far) / far.w - origin);
+            ray.tmin = 0.0f;
+            ray.tmax = 1.0f;
+            RayHit hit;
+            if(!mBVH.intersect(ray, hit))
+                continue;
+
+            // interpolated outputs of the phong vertex shader
+            size_t m = std::upper_bound(mMeshTriangles.begin(), mMeshTriangles.end(), size_t(hit.triangle))
+                - mMeshTriangles.begin() - 1;
+            const MeshArrays& arrays = mMeshes[m]->getArrays();
+            size_t first_index = 3 * (hit.triangle - mMeshTriangles[m]);
+            float w[3] = { 1.0f - hit.u - hit.v, hit.u, hit.v };
+            glm::vec3 object_position(0.0f), normal(0.0f);
+            for(int i = 0; i < 3; i++) {
+                const Vertex& vertex = arrays.vertices[arrays.index(first_index + i)];
+                object_position += w[i] * vertex.position;
+                normal += w[i] * glm::vec3(transformNormal(vertex.normal, mNormalMatrices[m]));
+            }
+            glm::vec4 position = mModelView[m] * glm::vec4(object_position, 1.0f);
+            glm::vec4 clip = mView.projection * position;
+            int p = (y - y0) * kTileSize + (x - x0);
+            depth[p] = clip.z / clip.w * 0.5f + 0.5f;
+            block.add(p, glm::vec3(position), normal, mMeshes[m]->getMaterial().albedo);
+        }
+    }
+    shadePixels(block);
+    writeTile(block, depth.data(), tile_x, tile_y, slot);
+}
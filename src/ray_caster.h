@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "cpu_renderer.h"
+#include "triangle_bvh.h"
+
+// Casts one ray per pixel through a BVH over the world space triangles of
+// all TriangleMesh objects of the scene, built when the scene is set. Gives
+// the same G-buffer as the rasterizers without a GL context; it pays off
+// for large scenes and jobs that only need the position, normal and depth
+// channels. Tiles of rays are traced on a pool of threads.
+class RayCaster: public CPURenderer {
+public:
+    // num_threads 0: one per core
+    RayCaster(const std::string& output_dir, int width, int height,
+        int num_writers = 2, int num_threads = 0);
+    RayCaster(Scene* scene, const std::string& output_dir,
+        int num_writers = 2, int num_threads = 0);
+    ~RayCaster();
+
+    double getBuildSeconds() const { return mBuildSeconds; }
+    // Rays cast and time spent casting them since the start
+    size_t getNumRays() const { return mNumRays; }
+    double getTraceSeconds() const { return mTraceSeconds; }
+private:
+    TriangleBVH mBVH;
+    std::vector<const TriangleMesh*> mMeshes;
+    std::vector<size_t> mMeshTriangles; // first BVH triangle of each mesh, and the total
+    std::vector<glm::mat4> mModelView;  // per mesh, of the current view
+    std::vector<glm::mat3> mNormalMatrices; // per mesh
+    glm::dmat4 mInvViewProjection;      // normalized device coordinates to world space
+    double mBuildSeconds;
+    size_t mNumRays;
+    double mTraceSeconds;
+
+    void sceneChanged() override;
+    void drawView(const Camera* camera, FrameSlot& slot) override;
+    void castTile(int tile_x, int tile_y, FrameSlot& slot);
+};
@@ -0,0 +1,447 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cxxopts/cxxopts.hpp>
+#include <json/json.h>
+
+#include <glad/glad.h>
+
+#include "utils.h"
+#include "scene.h"
+#include "camera.h"
+#include "renderer.h"
+#include "software_renderer.h"
+#include "ray_caster.h"
+#include "context.h"
+
+// Stage level benchmark on synthetic scenes. Every combination of the
+// triangle, object, light, resolution and frame counts given on the command
+// line is generated as a scene of UV spheres with an orbiting camera
+// trajectory, rendered twice and reported as JSON on stdout:
+//
+// - a profiled pass that waits for the GPU after every stage, giving the
+//   time spent drawing, reading back, encoding and writing the frames
+// - a pipelined pass as in normal use, giving the end to end frame rate
+//
+// Loading is timed in two parts, parsing the JSON files and loading the
+// OBJ files, and setting up the scene on the GPU as upload. All log output
+// goes to stderr.
+
+namespace {
+
+struct BenchConfig {
+    int triangles;  // per object
+    int objects;
+    int lights;
+    int width, height;
+    int frames;
+    bool merge_meshes;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::vector<int> parse_int_list(const std::string& list)
+{
+    std::vector<int> values;
+    std::stringstream ss(list);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        values.push_back(std::max(1, atoi(item.c_str())));
+    }
+    return values;
+}
+
+// "640x480,1920x1080"
+std::vector<std::pair<int, int>> parse_resolutions(const std::string& list)
+{
+    std::vector<std::pair<int, int>> values;
+    std::stringstream ss(list);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        int w = 0, h = 0;
+        if(sscanf(item.c_str(), "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+            throw std::runtime_error("Invalid resolution " + item + ", expected WxH");
+        }
+        values.push_back(std::make_pair(w, h));
+    }
+    return values;
+}
+
+// UV sphere with about num_triangles triangles
+void write_sphere_obj(const std::string& path, int num_triangles, float radius)
+{
+    int rings = std::max(2, int(std::sqrt(num_triangles / 4.0)));
+    int segments = std::max(3, 2 * rings);
+    std::ofstream out(path);
+    out << "# synthetic sphere, " << rings << " rings, " << segments << " segments\n";
+    for(int r = 0; r <= rings; r++) {
+        float theta = float(M_PI) * r / rings;
+        for(int s = 0; s < segments; s++) {
+            float phi = 2.0f * float(M_PI) * s / segments;
+            glm::vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            out << "v " << radius * n.x << " " << radius * n.y << " " << radius * n.z << "\n";
+            out << "vn " << n.x << " " << n.y << " " << n.z << "\n";
+        }
+    }
+    for(int r = 0; r < rings; r++) {
+        for(int s = 0; s < segments; s++) {
+            // 1-based OBJ indices
+            int a = r * segments + s + 1;
+            int b = r * segments + (s + 1) % segments + 1;
+            int c = a + segments;
+            int d = b + segments;
+            if(r > 0)
+                out << "f " << a << "//" << a << " " << b << "//" << b << " " << c << "//" << c << "\n";
+            if(r < rings - 1)
+                out << "f " << b << "//" << b << " " << d << "//" << d << " " << c << "//" << c << "\n";
+        }
+    }
+    if(!out) {
+        throw std::runtime_error("Unable to write " + path);
+    }
+}
+
+Json::Value make_camera(const BenchConfig& config, const glm::vec3& eye)
+{
+    Json::Value camera;
+    camera["proj_type"] = "perspective";
+    int viewport[4] = { 0, 0, config.width, config.height };
+    for(int i = 0; i < 4; i++) {
+        camera["viewport"].append(viewport[i]);
+    }
+    camera["fovy"] = 1.04;
+    camera["focal_length"] = 1.0;
+    float at[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    float up[4] = { 0.0f, 1.0f, 0.0f, 0.0f };
+    for(int i = 0; i < 4; i++) {
+        camera["eye"].append(i < 3 ? eye[i] : 1.0f);
+        camera["at"].append(at[i]);
+        camera["up"].append(up[i]);
+    }
+    camera["near"] = 0.1;
+    camera["far"] = 1000.0;
+    return camera;
+}
+
+void write_json(const std::string& path, const Json::Value& value)
+{
+    std::ofstream out(path);
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = " ";
+    out << Json::writeString(builder, value) << std::endl;
+    if(!out) {
+        throw std::runtime_error("Unable to write " + path);
+    }
+}
+
+void copy_file(const std::string& from, const std::string& to)
+{
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    out << in.rdbuf();
+    if(!in || !out) {
+        throw std::runtime_error("Unable to copy " + from + " to " + to);
+    }
+}
+
+// Objects on a square grid in the xy plane, seen by a camera orbiting the
+// grid. Every object gets its own OBJ file, slightly different so that the
+// meshes are not shared on the GPU.
+void generate_scene(const std::string& dir, const std::string& shader_dir, const BenchConfig& config)
+{
+    copy_file(shader_dir + "/vs.glsl", dir + "/vs.glsl");
+    copy_file(shader_dir + "/fs.glsl", dir + "/fs.glsl");
+
+    Json::Value scene;
+    scene["file-format"]["type"] = "diffrend";
+    scene["file-format"]["version"] = "0.1";
+    scene["glsl"]["vertex"] = "vs.glsl";
+    scene["glsl"]["fragment"] = "fs.glsl";
+
+    int grid = int(std::ceil(std::sqrt(double(config.objects))));
+    float extent = float(grid);
+    scene["camera"] = make_camera(config, glm::vec3(0.0f, 0.0f, extent + 2.0f));
+
+    const float colors[4][3] = { {1.0f, 1.0f, 1.0f}, {0.8f, 0.1f, 0.1f}, {0.2f, 0.8f, 0.2f}, {0.2f, 0.2f, 0.8f} };
+    for(int i = 0; i < 4; i++) {
+        Json::Value color;
+        for(int c = 0; c < 3; c++) {
+            color.append(colors[i][c]);
+        }
+        scene["colors"].append(color);
+    }
+    Json::Value& lights = scene["lights"];
+    for(int i = 0; i < config.lights; i++) {
+        float angle = 2.0f * float(M_PI) * i / config.lights;
+        Json::Value pos, attenuation;
+        pos.append(10.0f * std::cos(angle));
+        pos.append(10.0f);
+        pos.append(10.0f * std::sin(angle));
+        pos.append(1.0f);
+        attenuation.append(1.0f);
+        attenuation.append(0.0f);
+        attenuation.append(0.0f);
+        lights["pos"].append(pos);
+        lights["color_idx"].append(i % 4);
+        lights["attenuation"].append(attenuation);
+    }
+    for(int c = 0; c < 3; c++) {
+        lights["ambient"].append(0.01f);
+    }
+
+    Json::Value albedo, coeffs;
+    for(int c = 0; c < 3; c++) {
+        albedo.append(0.5f);
+        coeffs.append(c == 0 ? 1.0f : 0.0f);
+    }
+    scene["materials"]["albedo"].append(albedo);
+    scene["materials"]["coeffs"].append(coeffs);
+
+    for(int i = 0; i < config.objects; i++) {
+        std::string name = "obj_" + std::to_string(i) + ".obj";
+        write_sphere_obj(dir + "/" + name, config.triangles, 0.4f + 0.001f * i);
+        Json::Value obj;
+        obj["path"] = name;
+        obj["material_idx"] = 0;
+        obj["translate"].append(float(i % grid) - 0.5f * (grid - 1));
+        obj["translate"].append(float(i / grid) - 0.5f * (grid - 1));
+        obj["translate"].append(0.0f);
+        scene["objects"]["obj"].append(obj);
+    }
+    write_json(dir + "/scene.json", scene);
+
+    Json::Value trajectory(Json::arrayValue);
+    for(int i = 0; i < config.frames; i++) {
+        float angle = 2.0f * float(M_PI) * i / config.frames;
+        float radius = extent + 2.0f;
+        trajectory.append(make_camera(config, glm::vec3(radius * std::sin(angle), 0.5f, radius * std::cos(angle))));
+    }
+    write_json(dir + "/trajectory.json", trajectory);
+}
+
+void remove_tree(const std::string& dir)
+{
+    for(auto& file: list_files(dir, "")) {
+        unlink(file.c_str());
+    }
+    rmdir((dir + "/out").c_str());
+    rmdir(dir.c_str());
+}
+
+void render_trajectory(Renderer& renderer, CameraTrajectory& trajectory)
+{
+    std::vector<Camera> batch;
+    std::vector<const Camera*> cameras;
+    std::vector<std::string> names;
+    for(size_t i = 0; i < trajectory.size(); i++) {
+        batch.push_back(*trajectory.getCamera(i));
+        names.push_back(CameraTrajectory::getFilename(i));
+        if(int(batch.size()) == renderer.getBatchSize() || i + 1 == trajectory.size()) {
+            for(auto& camera: batch) {
+                cameras.push_back(&camera);
+            }
+            renderer.render(cameras, names);
+            batch.clear();
+            cameras.clear();
+            names.clear();
+        }
+    }
+    renderer.finish();
+}
+
+Json::Value run_benchmark(const BenchConfig& config, const std::string& work_dir,
+    const std::string& shader_dir, const std::string& backend_name, GLContext::Backend backend,
+    int num_writers, int batch_size, bool keep)
+{
+    char dir_template[4096];
+    snprintf(dir_template, sizeof(dir_template), "%s/render_bench_XXXXXX", work_dir.c_str());
+    if(mkdtemp(dir_template) == nullptr) {
+        throw std::runtime_error("Unable to create a directory in " + work_dir);
+    }
+    std::string dir = dir_template;
+    std::string out_dir = dir + "/out/";
+    mkdir(out_dir.c_str(), 0755);
+    generate_scene(dir, shader_dir, config);
+
+    Json::Value result;
+    Json::Value& cfg = result["config"];
+    cfg["triangles_per_object"] = config.triangles;
+    cfg["objects"] = config.objects;
+    cfg["lights"] = config.lights;
+    cfg["width"] = config.width;
+    cfg["height"] = config.height;
+    cfg["frames"] = config.frames;
+    cfg["merge_meshes"] = config.merge_meshes;
+    cfg["batch"] = batch_size;
+    cfg["writers"] = num_writers;
+    Json::Value& seconds = result["seconds"];
+
+    auto start = Clock::now();
+    Json::Value scene_spec;
+    {
+        std::ifstream ifs(dir + "/scene.json");
+        Json::CharReaderBuilder reader;
+        std::string err;
+        if(!Json::parseFromStream(reader, ifs, &scene_spec, &err)) {
+            throw std::runtime_error("Unable to parse the generated scene: " + err);
+        }
+    }
+    CameraTrajectory trajectory(dir + "/trajectory.json");
+    seconds["json_parse"] = seconds_since(start);
+
+    start = Clock::now();
+    Scene scene(scene_spec, dir);
+    scene.setMergeMeshes(config.merge_meshes);
+    seconds["obj_load"] = seconds_since(start);
+
+    start = Clock::now();
+    std::unique_ptr<Renderer> renderer_ptr;
+    RayCaster* ray_caster = nullptr;
+    bool software = backend_name == "software" || backend_name == "raycast";
+    if(backend_name == "software") {
+        renderer_ptr.reset(new SoftwareRenderer(out_dir, config.width, config.height, num_writers));
+        result["gl_renderer"] = "software";
+    } else if(backend_name == "raycast") {
+        ray_caster = new RayCaster(out_dir, config.width, config.height, num_writers);
+        renderer_ptr.reset(ray_caster);
+        result["gl_renderer"] = "raycast";
+    } else {
+        renderer_ptr.reset(new GLRenderer(out_dir, config.width, config.height, backend, false, num_writers));
+        result["gl_renderer"] = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    }
+    Renderer& renderer = *renderer_ptr;
+    seconds["context"] = seconds_since(start);
+    renderer.setBatchSize(batch_size);
+    cfg["batch"] = renderer.getBatchSize();
+
+    start = Clock::now();
+    renderer.setScene(&scene);
+    if(!software)
+        glFinish();
+    seconds["upload"] = seconds_since(start);
+    if(!software)
+        result["merged"] = scene.drawsMerged();
+    if(ray_caster)
+        seconds["bvh_build"] = ray_caster->getBuildSeconds();
+
+    renderer.setProfiling(true);
+    renderer.resetStageTimes();
+    render_trajectory(renderer, trajectory);
+    Renderer::StageTimes times = renderer.getStageTimes();
+    seconds["draw"] = times.draw_seconds;
+    seconds["readback"] = times.readback_seconds;
+    seconds["encode"] = times.writer.encode_seconds;
+    seconds["write"] = times.writer.write_seconds;
+    Json::Value& per_frame = result["ms_per_frame"];
+    double frames = std::max<size_t>(1, times.frames);
+    per_frame["draw"] = 1e3 * times.draw_seconds / frames;
+    per_frame["readback"] = 1e3 * times.readback_seconds / frames;
+    per_frame["encode"] = 1e3 * times.writer.encode_seconds / frames;
+    per_frame["write"] = 1e3 * times.writer.write_seconds / frames;
+    result["bytes_written_per_frame"] = Json::UInt64(times.writer.bytes_written / size_t(frames));
+    if(ray_caster)
+        result["rays_per_second"] = ray_caster->getNumRays() / ray_caster->getTraceSeconds();
+
+    renderer.setProfiling(false);
+    renderer.resetStageTimes();
+    start = Clock::now();
+    render_trajectory(renderer, trajectory);
+    double elapsed = seconds_since(start);
+    result["pipelined"]["seconds"] = elapsed;
+    result["pipelined"]["fps"] = config.frames / elapsed;
+
+    if(keep) {
+        result["directory"] = dir;
+    } else {
+        remove_tree(dir);
+    }
+    return result;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("render_bench", "Stage level benchmark on synthetic scenes");
+    options.add_options()
+    ("triangles", "Triangles per object, comma separated values are benchmarked in turn", cxxopts::value<std::string>()->default_value("20000"))
+    ("objects", "Number of objects", cxxopts::value<std::string>()->default_value("16"))
+    ("lights", "Number of lights, at most " + std::to_string(MAX_NUM_LIGHTS), cxxopts::value<std::string>()->default_value("4"))
+    ("resolution", "Image size WxH", cxxopts::value<std::string>()->default_value("640x480"))
+    ("frames", "Trajectory length", cxxopts::value<std::string>()->default_value("32"))
+    ("batch", "Number of trajectory views rendered in one pass", cxxopts::value<int>()->default_value("1"))
+    ("w,writers", "Number of frame writer threads", cxxopts::value<int>()->default_value("2"))
+    ("b,backend", "OpenGL context backend: auto, glfw, egl or osmesa; or software (rasterizer) or raycast to render on the CPU", cxxopts::value<std::string>()->default_value("auto"))
+    ("shaders", "Directory with the vs.glsl and fs.glsl used for the scenes", cxxopts::value<std::string>()->default_value("scenes/shaders/phong"))
+    ("work-dir", "Where the scenes and frames are written", cxxopts::value<std::string>()->default_value("/tmp"))
+    ("merge-meshes", "Draw all meshes from shared buffers with one multi-draw call per pass", cxxopts::value<bool>())
+    ("keep", "Keep the generated scenes and frames", cxxopts::value<bool>())
+    ("o,output", "Write the JSON report to a file instead of stdout", cxxopts::value<std::string>());
+    auto args = options.parse(argc, argv);
+
+    // stdout only carries the report
+    std::streambuf* stdout_buf = std::cout.rdbuf();
+    std::cout.rdbuf(std::cerr.rdbuf());
+
+    GLContext::Backend backend = GLContext::AUTO;
+    std::string backend_name = args["backend"].as<std::string>();
+    bool cpu_backend = backend_name == "software" || backend_name == "raycast";
+    if(!cpu_backend && !GLContext::parseBackend(args["backend"].as<std::string>(), &backend)) {
+        std::cout << "Error: Unknown context backend " << args["backend"].as<std::string>() << std::endl;
+        return -1;
+    }
+
+    Json::Value report;
+    report["build"] = std::string(__DATE__) + " " + __TIME__;
+    report["runs"] = Json::Value(Json::arrayValue);
+    try {
+        std::vector<int> triangles = parse_int_list(args["triangles"].as<std::string>());
+        std::vector<int> objects = parse_int_list(args["objects"].as<std::string>());
+        std::vector<int> lights = parse_int_list(args["lights"].as<std::string>());
+        std::vector<std::pair<int, int>> resolutions = parse_resolutions(args["resolution"].as<std::string>());
+        std::vector<int> frames = parse_int_list(args["frames"].as<std::string>());
+        for(int t: triangles) for(int o: objects) for(int l: lights)
+        for(auto& r: resolutions) for(int f: frames) {
+            BenchConfig config;
+            config.triangles = t;
+            config.objects = o;
+            config.lights = std::min(l, MAX_NUM_LIGHTS);
+            config.width = r.first;
+            config.height = r.second;
+            config.frames = f;
+            config.merge_meshes = args["merge-meshes"].as<bool>();
+            report["runs"].append(run_benchmark(config, args["work-dir"].as<std::string>(),
+                args["shaders"].as<std::string>(), backend_name, backend, std::max(1, args["writers"].as<int>()),
+                args["batch"].as<int>(), args["keep"].as<bool>()));
+        }
+    } catch(const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = " ";
+    std::string json = Json::writeString(builder, report);
+    if(args["output"].count() > 0) {
+        std::ofstream out(args["output"].as<std::string>());
+        out << json << std::endl;
+    } else {
+        std::cout.rdbuf(stdout_buf);
+        std::cout << json << std::endl;
+    }
+    return 0;
+}
@@ -1,209 +1,388 @@
 #include <iostream>
+#include <algorithm>
 #include <glad/glad.h>
 
 #include "renderer.h"
-#include <stb/stb_image_write.h>
-#include <fstream>
-#include <npy/npy.hpp>
-#include "SPSC_LockFreeQueue.hpp"
-#include <thread>
-
-template<typename T>
-struct StorageData {
-    struct Data {
-        T* mData;
-        int mWidth;
-        int mHeight;
-        int mChannels;
-
-        Data(const T* const data, int width, int height, int channels):
-            mWidth(width), mHeight(height), mChannels(channels) {
-                mData = new T[mWidth * mHeight * mChannels];
-                memcpy(mData, data, sizeof(T) * mWidth * mHeight * mChannels);
-            }
-    };
-    enum DType { INVALID=0, IMAGE, POSITION, NORMAL };
-    Data* image;
-    Data* position;
-    Data* normal;
-    //std::string mFilename;
-
-    //StorageData(std::string&& filename) { mFilename = filename; }
-    void set_image(const T* const data, int width, int height, int channels, DType dtype) {
-        Data** dst(nullptr);
-        if(dtype == DType::IMAGE)
-            dst = &image;
-        else if(dtype == DType::POSITION) {
-            dst = &position;
-        } else if(dtype == DType::NORMAL) {
-            dst = &normal;
-        }
-        *dst = new Data(data, width, height, channels);
-    }
-
-    void set_position(const T* const data, int width , int height, int channels) {
-        position = new Data(data, width, height, channels);
-    }
-};
 
-using MsgQueue = SPSC_LockFreeQueue<StorageData<float>, 3000>;
-MsgQueue gOutputQueue;
-std::atomic<bool> bTerminate;
+namespace {
 
-void WriteFrames(const std::string& out_filename_prefix,
-		 MsgQueue& output_queue,
-		 std::atomic<bool>& terminate)
+GLenum internal_format(const ChannelFormat& format)
 {
-  int frame_count = 0;
-  char buffer[5000];
-  try {
-    while(true) {
-      StorageData<float> data;
-      if(!output_queue.pop(data)) {
-        if(terminate) {
-          std::cout << "Terminating WriteFrames..." << std::endl;
-          break;
-        }
-        continue;
-      }
-      snprintf(buffer, sizeof(buffer), "%s/frame_%08d.tiff", out_filename_prefix.c_str(), frame_count);
-      //...
-      ++frame_count;
+    // Always RGBA: RGB float formats are not required to be renderable, RGB
+    // output drops alpha during the readback instead
+    switch(format.type) {
+    case ChannelFormat::FLOAT16: return GL_RGBA16F;
+    case ChannelFormat::UNORM16: return GL_RGBA16;
+    default: return GL_RGBA32F;
     }
-  } catch(std::exception& e) {
-    std::cout << "Exception in WriteFrames " << e.what() << std::endl;
-  }
 }
 
-/////
-static void error_callback(int error, const char* description) {
-    fprintf(stderr, "Error: %s\n", description);
+GLenum read_type(const ChannelFormat& format)
+{
+    switch(format.type) {
+    case ChannelFormat::FLOAT16: return GL_HALF_FLOAT;
+    case ChannelFormat::UNORM16: return GL_UNSIGNED_SHORT;
+    default: return GL_FLOAT;
+    }
 }
 
-void GLRenderer::key_callback(GLFWwindow* window, int key,
-			 int scancode, int action,
-			 int mods) {
-  if(key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-    glfwSetWindowShouldClose(window, true);
 }
 
 GLRenderer::~GLRenderer() {
-    bTerminate = true;
-    if(mRGBA) {
-        free(mRGBA);
-    }
-    if(mBuffer) {
-        free(mBuffer);
-    }
-    mFrameWriterThread.join();
-    glfwDestroyWindow(mWindow);
-    glfwTerminate();
+    // flush: every rendered frame is on disk before the context goes away
+    finish();
+    mFrameWriter->close();
+    delete mFrameWriter;
+    releaseFramebuffer();
+    mGPUTimer.release();
+    delete mResourceCache;
+    delete mContext;
 }
 
-void GLRenderer::init() {
-    glfwSetErrorCallback(error_callback);
-
-    glfwInitHint(GLFW_COCOA_MENUBAR, GLFW_FALSE);
-
-    if(!glfwInit()) {
-        exit(EXIT_FAILURE);
+void GLRenderer::init(GLContext::Backend backend, bool interactive) {
+    if(backend == GLContext::AUTO) {
+        backend = GLContext::defaultBackend(interactive);
     }
-
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    //glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-    mWindow = glfwCreateWindow(mWidth, mHeight, "Render Server", NULL, NULL);
-
-    if(!mWindow) {
-        glfwTerminate();
+    std::cout << "Context backend: " << GLContext::backendName(backend) << std::endl;
+    mContext = GLContext::create(backend, mWidth, mHeight, interactive);
+    if(!mContext) {
         exit(EXIT_FAILURE);
     }
-    glfwMakeContextCurrent(mWindow);
-    gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    
-    glfwSetWindowUserPointer(mWindow, this);
-    glfwSetKeyCallback(mWindow, key_callback);
+
     // get version info
     const GLubyte* renderer = glGetString(GL_RENDERER); // get renderer string
     const GLubyte* version = glGetString(GL_VERSION); // version as a string
-    printf("Renderer: %s\n", renderer);
-    printf("OpenGL version supported %s\n", version);
+    std::cout << "Renderer: " << renderer << std::endl;
+    std::cout << "OpenGL version supported " << version << std::endl;
 
-    // setting up framebuffer
-    glGenFramebuffers(1, &mFBO);
-    glBindFramebuffer(GL_FRAMEBUFFER, mFBO);
-    
-    glGenTextures(1, &mTexRGBA);
+    mResourceCache = new GPUResourceCache(kDefaultGPUCacheBytes);
 
-    glBindTexture(GL_TEXTURE_2D, mTexRGBA);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, mWidth, mHeight, 0, GL_RGBA, GL_FLOAT, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, mTexRGBA, 0);
+    mFrameWriter = new FrameWriter(mNumWriters, mNumWriters + MAX_VIEWS_PER_BATCH + 1,
+        [this](int slot) { releaseSlot(slot); });
 
-    glGenTextures(1, &mTexPosition);
-
-    glBindTexture(GL_TEXTURE_2D, mTexPosition);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, mWidth, mHeight, 0, GL_RGBA, GL_FLOAT, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, mTexPosition, 0);
+    initFramebuffer();
+    initReadback();
+}
 
-    glGenTextures(1, &mTexNormal);
+void GLRenderer::initFramebuffer() {
+    // Layered G-buffer, one layer per view of a batch. Views are drawn into
+    // all layers at once through mFBO and read back layer by layer through
+    // mLayerFBOs.
+    glGenFramebuffers(1, &mFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, mFBO);
 
-    glBindTexture(GL_TEXTURE_2D, mTexNormal);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, mWidth, mHeight, 0, GL_RGBA, GL_FLOAT, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, mTexNormal, 0);
+    // Disabled channels get no attachment, the fragment shader outputs for
+    // them are discarded
+    GLuint* textures[NUM_ATTACHMENTS] = { &mTexRGBA, &mTexPosition, &mTexNormal };
+    GLenum draw_buffers[NUM_ATTACHMENTS];
+    for(int k = 0; k < NUM_ATTACHMENTS; k++) {
+        *textures[k] = 0;
+        draw_buffers[k] = GL_NONE;
+        if(!mOutputFormat[k].enabled)
+            continue;
+        glGenTextures(1, textures[k]);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, *textures[k]);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internal_format(mOutputFormat[k]), mWidth, mHeight, mBatchSize, 0, GL_RGBA, GL_FLOAT, 0);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + k, *textures[k], 0);
+        draw_buffers[k] = GL_COLOR_ATTACHMENT0 + k;
+    }
 
-    // depth attachment
-    GLuint depth_buffer;
-    glGenRenderbuffers(1, &depth_buffer);
-    glBindRenderbuffer(GL_RENDERBUFFER, depth_buffer);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, mWidth, mHeight);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_buffer);
+    // depth attachment, layered as well. Full float precision when it is
+    // read back as linear depth.
+    GLenum depth_format = mOutputFormat[OutputFormat::DEPTH].enabled ? GL_DEPTH_COMPONENT32F : GL_DEPTH_COMPONENT;
+    glGenTextures(1, &mTexDepth);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, mTexDepth);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, depth_format, mWidth, mHeight, mBatchSize, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, mTexDepth, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 
-    GLenum draw_buffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2  };
-    glDrawBuffers(3, draw_buffers);
+    glDrawBuffers(NUM_ATTACHMENTS, draw_buffers);
 
     if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
         std::cout << "Framebuffer setup failed" << std::endl;
         assert(false);
     }
+
+    mLayerFBOs.resize(mBatchSize);
+    glGenFramebuffers(mBatchSize, mLayerFBOs.data());
+    for(int layer = 0; layer < mBatchSize; layer++) {
+        glBindFramebuffer(GL_FRAMEBUFFER, mLayerFBOs[layer]);
+        for(int k = 0; k < NUM_ATTACHMENTS; k++) {
+            if(*textures[k])
+                glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + k, *textures[k], 0, layer);
+        }
+        if(mOutputFormat[OutputFormat::DEPTH].enabled)
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, mTexDepth, 0, layer);
+    }
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    mBuffer = static_cast<char*>(calloc(4, mWidth * mHeight));
-    mRGBA = static_cast<float*>(calloc(4, mWidth * mHeight * sizeof(float)));
-    bTerminate = false;
-    mFrameWriterThread = std::thread(WriteFrames, mOutputDir,
-          std::ref(gOutputQueue),
-          std::ref(bTerminate));
+}
+
+void GLRenderer::releaseFramebuffer() {
+    for(auto& slot: mReadbackSlots) {
+        glDeleteBuffers(OutputFormat::NUM_CHANNELS, slot.pbo);
+    }
+    mReadbackSlots.clear();
+    GLuint textures[4] = { mTexRGBA, mTexPosition, mTexNormal, mTexDepth };
+    glDeleteTextures(4, textures);
+    glDeleteFramebuffers(mLayerFBOs.size(), mLayerFBOs.data());
+    mLayerFBOs.clear();
+    glDeleteFramebuffers(1, &mFBO);
+}
+
+void GLRenderer::resize(int width, int height) {
+    if(width == mWidth && height == mHeight)
+        return;
+    finish();
+    releaseFramebuffer();
+    mWidth = width;
+    mHeight = height;
+    initFramebuffer();
+    initReadback();
+}
+
+void GLRenderer::setBatchSize(int batch_size) {
+    // Views of a batch select their layer from the vertex shader
+    if(batch_size > 1 && !GLAD_GL_ARB_shader_viewport_layer_array && !GLAD_GL_AMD_vertex_shader_layer) {
+        std::cout << "Batched rendering needs GL_ARB_shader_viewport_layer_array, rendering views one by one" << std::endl;
+        batch_size = 1;
+    }
+    GLint max_layers = 1;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+    batch_size = std::max(1, std::min(std::min(batch_size, int(max_layers)), MAX_VIEWS_PER_BATCH));
+    if(batch_size == mBatchSize)
+        return;
+
+    finish();
+    releaseFramebuffer();
+    mBatchSize = batch_size;
+    initFramebuffer();
+    initReadback();
+    if(mScene) {
+        setupScene();
+    }
+}
+
+void GLRenderer::setScene(Scene* scene) {
+    // frames of the previous scene are written with its settings
+    finish();
+    mScene = scene;
+    resize(scene->getWidth(), scene->getHeight());
+    setupScene();
 }
 
 void GLRenderer::setupScene() {
-    glfwGetFramebufferSize(mWindow, &mWidth, &mHeight);
+    // only called without frames in flight
+    if(mScene->getOutputFormat() != mOutputFormat) {
+        releaseFramebuffer();
+        mOutputFormat = mScene->getOutputFormat();
+        initFramebuffer();
+        initReadback();
+    }
+    mFrameWriter->setOutputFormat(mOutputFormat);
+
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
     glEnable(GL_DEPTH_TEST);
     //ratio = mWidth / (float) mHeight;
-    mScene->setup();
+    mScene->setup(mResourceCache, mBatchSize);
+    mFrameWriter->setTonemap(mScene->getTonemap());
     glViewport(0, 0, mWidth, mHeight);
 }
 
 void GLRenderer::render(Scene* scene) {
-    mScene = scene;
-
     // Setup the resources on the GPU
-    setupScene();
+    setScene(scene);
 
     // Render
     render();
 }
 
-void store_as_npy(const std::string& outfilename_prefix,
-    int width, int height, int nchannels, float* data)
-{
-    unsigned long out_shape[] = {height, width, nchannels};
-    std::vector<float> out_data(height * width * nchannels);
-    memcpy(&out_data[0], data, sizeof(float) * height * width * nchannels);
-    npy::SaveArrayAsNumpy(outfilename_prefix + ".npy",
-        false, 3, out_shape, out_data);
+size_t GLRenderer::readbackBytes(int channel) const {
+    // depth is read back as float and linearized by the writers
+    size_t pixel_bytes = channel == OutputFormat::DEPTH ? sizeof(float) : mOutputFormat[channel].pixelBytes();
+    return size_t(mWidth) * mHeight * pixel_bytes;
+}
+
+void GLRenderer::initReadback() {
+    // rows of RGB and half float channels are not 4 byte aligned
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    // Each writer thread can hold one slot while the GL thread reads back
+    // a batch into others and keeps one more in flight.
+    mReadbackSlots.resize(mNumWriters + mBatchSize + 1);
+    for(auto& slot: mReadbackSlots) {
+        glGenBuffers(OutputFormat::NUM_CHANNELS, slot.pbo);
+        for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+            if(!mOutputFormat[c].enabled)
+                continue;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo[c]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, readbackBytes(c), nullptr, GL_STREAM_READ);
+        }
+        slot.fence = 0;
+        slot.state = SLOT_FREE;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    mReadbackHead = 0;
+    mNumPending = 0;
+}
+
+void GLRenderer::releaseSlot(int slot) {
+    // called from the writer threads
+    std::lock_guard<std::mutex> lock(mSlotMutex);
+    mReadbackSlots[slot].state = SLOT_WRITTEN;
+    mSlotWritten.notify_all();
+}
+
+void GLRenderer::recycleSlot(int slot_idx) {
+    // Block until the writers are done with the slot (this is where the GL
+    // thread is throttled when the disk can't keep up) and unmap it.
+    ReadbackSlot& slot = mReadbackSlots[slot_idx];
+    {
+        ScopedTimer timer("wait for writers");
+        std::unique_lock<std::mutex> lock(mSlotMutex);
+        mSlotWritten.wait(lock, [&slot] { return slot.state != SLOT_WRITING; });
+    }
+    if(slot.state == SLOT_WRITTEN) {
+        for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+            if(!mOutputFormat[c].enabled)
+                continue;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo[c]);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.state = SLOT_FREE;
+    }
+}
+
+void GLRenderer::resolveReadback(bool wait) {
+    // Hand the oldest pending frame to the writers once its readback has
+    // completed. The mapped PBOs are passed on directly and stay mapped
+    // until the slot is recycled. Returns without doing anything if the GPU
+    // has not finished the frame and wait is false.
+    if(mNumPending == 0)
+        return;
+    int slot_idx = mReadbackHead;
+    ReadbackSlot& slot = mReadbackSlots[slot_idx];
+    GLenum status;
+    {
+        ScopedTimer timer(wait ? "wait for readback" : nullptr);
+        status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                  wait ? GL_TIMEOUT_IGNORED : 0);
+    }
+    if(status == GL_TIMEOUT_EXPIRED)
+        return;
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+
+    FrameData frame;
+    bool mapped = true;
+    {
+        ScopedTimer timer("map readback", mProfiling ? &mStageTimes.readback_seconds : nullptr);
+        for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+            frame.data[c] = nullptr;
+            if(!mOutputFormat[c].enabled)
+                continue;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo[c]);
+            frame.data[c] = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readbackBytes(c), GL_MAP_READ_BIT);
+            mapped = mapped && frame.data[c] != nullptr;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    mReadbackHead = (mReadbackHead + 1) % mReadbackSlots.size();
+    mNumPending--;
+
+    {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        slot.state = mapped ? SLOT_WRITING : SLOT_WRITTEN;
+    }
+    if(!mapped) {
+        std::cout << "Error: failed to map readback buffers for " << slot.prefix << std::endl;
+        return;
+    }
+    frame.prefix = slot.prefix;
+    frame.width = mWidth;
+    frame.height = mHeight;
+    frame.near = slot.near;
+    frame.far = slot.far;
+    frame.slot = slot_idx;
+    ScopedTimer timer("queue frame");
+    mFrameWriter->push(frame);
+}
+
+void GLRenderer::finish() {
+    while(mNumPending > 0) {
+        resolveReadback(true);
+    }
+    mGPUTimer.collect(true);
+    for(size_t i = 0; i < mReadbackSlots.size(); i++) {
+        recycleSlot(i);
+    }
+}
+
+int GLRenderer::acquireSlot() {
+    // The slot we are about to reuse must have been written out
+    int slot_idx = (mReadbackHead + mNumPending) % mReadbackSlots.size();
+    if(mNumPending == int(mReadbackSlots.size())) {
+        resolveReadback(true);
+    }
+    recycleSlot(slot_idx);
+    return slot_idx;
+}
+
+void GLRenderer::queueReadback(int layer, const std::string& outfilename, const Camera* camera) {
+    int slot_idx = acquireSlot();
+    ReadbackSlot& slot = mReadbackSlots[slot_idx];
+    static const char* names[OutputFormat::NUM_CHANNELS] = {
+        "readback color", "readback position", "readback normal", "readback depth" };
+    {
+        // the channels are profiled apart, the stage times get their sum
+        ScopedTimer readback_timer(nullptr, mProfiling ? &mStageTimes.readback_seconds : nullptr);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, mLayerFBOs[layer]);
+        for(int k = 0; k < NUM_ATTACHMENTS; k++) {
+            const ChannelFormat& format = mOutputFormat[k];
+            if(!format.enabled)
+                continue;
+            ScopedTimer timer(names[k]);
+            mGPUTimer.begin(names[k]);
+            glReadBuffer(GL_COLOR_ATTACHMENT0 + k);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo[k]);
+            glReadPixels(0, 0, mWidth, mHeight, format.components == 3 ? GL_RGB : GL_RGBA,
+                         read_type(format), (void*) 0);
+            mGPUTimer.end();
+        }
+        if(mOutputFormat[OutputFormat::DEPTH].enabled) {
+            ScopedTimer timer(names[OutputFormat::DEPTH]);
+            mGPUTimer.begin(names[OutputFormat::DEPTH]);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo[OutputFormat::DEPTH]);
+            glReadPixels(0, 0, mWidth, mHeight, GL_DEPTH_COMPONENT, GL_FLOAT, (void*) 0);
+            mGPUTimer.end();
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        if(mProfiling)
+            glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    }
+    if(!camera)
+        camera = mScene->getCamera();
+    slot.near = camera->getNear();
+    slot.far = camera->getFar();
+    mStageTimes.frames++;
+    slot.prefix = mOutputDir + outfilename;
+    slot.state = SLOT_READBACK;
+    mNumPending++;
+}
+
+void GLRenderer::resolveCompleted() {
+    // Write out the previous frames whose readback already completed. The
+    // frame just submitted is left in flight so that its transfer overlaps
+    // with drawing the next one.
+    mGPUTimer.collect(false);
+    while(mNumPending > 1) {
+        int pending = mNumPending;
+        resolveReadback(false);
+        if(mNumPending == pending)
+            break;
+    }
 }
 
 void GLRenderer::render(const Camera* camera, const std::string& outfilename) {
@@ -213,47 +392,82 @@ void GLRenderer::render(const Camera* camera, const std::string& outfilename) {
      * for each object
      *   set transformation
      *   obj.render()
-     * Write buffer to file
+     * Queue the readback of the attachments into the next free PBO slot
+     * Write out frames whose readback has completed
      */
-    // set the FBO
-    glBindFramebuffer(GL_FRAMEBUFFER, mFBO);
-    glEnable(GL_DEPTH_TEST);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        mScene->render(camera);
-
-        // TODO: WRITE TO WRITER QUEUE
+    drawViews(&camera, 1);
+    queueReadback(0, outfilename, camera);
+    if(!mInteractive)
+        printCullStats(outfilename);
+
+    if(mInteractive && mOutputFormat[OutputFormat::COLOR].enabled) {
+        // show the color attachment in the window
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, mLayerFBOs[0]);
         glReadBuffer(GL_COLOR_ATTACHMENT0);
-        glReadPixels(0, 0, mWidth, mHeight, GL_RGBA, GL_FLOAT, mRGBA);
-        store_as_npy(mOutputDir + outfilename, mWidth, mHeight, 4, mRGBA);
-        {
-        std::ofstream outfile((mOutputDir + outfilename + ".dat").c_str(), std::ios::out | std::ios::binary);
-        outfile.write((const char*) mRGBA, mWidth * mHeight * 4 * sizeof(float));
-        }
-        glReadBuffer(GL_COLOR_ATTACHMENT1);
-        glReadPixels(0, 0, mWidth, mHeight, GL_RGBA, GL_FLOAT, mRGBA);
-        store_as_npy(mOutputDir + outfilename + "_pos", mWidth, mHeight, 4, mRGBA);
-        {
-        std::ofstream outfile((mOutputDir + outfilename + "_pos.dat").c_str(), std::ios::out | std::ios::binary);
-        outfile.write((const char*) mRGBA, mWidth * mHeight * 4 * sizeof(float));
-        }
-        glReadBuffer(GL_COLOR_ATTACHMENT2);
-        glReadPixels(0, 0, mWidth, mHeight, GL_RGBA, GL_FLOAT, mRGBA);
-        store_as_npy(mOutputDir + outfilename + "_normal", mWidth, mHeight, 4, mRGBA);
-        {
-        std::ofstream outfile((mOutputDir + outfilename + "_normal.dat").c_str(), std::ios::out | std::ios::binary);
-        outfile.write((const char*) mRGBA, mWidth * mHeight * 4 * sizeof(float));
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, mWidth, mHeight, 0, 0, mWidth, mHeight,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    resolveCompleted();
+}
+
+void GLRenderer::render(const std::vector<const Camera*>& cameras,
+    const std::vector<std::string>& outfilenames) {
+    assert(cameras.size() == outfilenames.size());
+    int num_views = cameras.size();
+    if(num_views == 1 || num_views > mScene->getMaxViews()) {
+        for(int i = 0; i < num_views; i++) {
+            render(cameras[i], outfilenames[i]);
         }
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return;
+    }
+
+    // all views in one pass, then one readback per layer
+    drawViews(cameras.data(), num_views);
+    for(int i = 0; i < num_views; i++) {
+        queueReadback(i, outfilenames[i], cameras[i]);
+    }
+    printCullStats(outfilenames.front() + ".." + outfilenames.back());
+    resolveCompleted();
+}
+
+void GLRenderer::drawViews(const Camera* const* cameras, int num_views) {
+    ScopedTimer timer("draw", mProfiling ? &mStageTimes.draw_seconds : nullptr);
+    mGPUTimer.begin("draw");
+    // set the FBO
+    glBindFramebuffer(GL_FRAMEBUFFER, mFBO);
     glEnable(GL_DEPTH_TEST);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    mScene->render(camera);
-
-    glReadPixels(0, 0, mWidth, mHeight, GL_RGBA, GL_UNSIGNED_BYTE, mBuffer);
-    // Write image Y-flipped because OpenGL
-    stbi_write_png((mOutputDir + outfilename + ".png").c_str(),
-                   mWidth, mHeight, 4,
-                   mBuffer + (mWidth * 4 * (mHeight - 1)),
-                   -mWidth * 4);
+    if(num_views == 1)
+        mScene->render(cameras[0]);
+    else
+        mScene->renderViews(cameras, num_views);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    mGPUTimer.end();
+    if(mProfiling)
+        glFinish();
+}
+
+Renderer::StageTimes Renderer::getStageTimes() {
+    StageTimes times = mStageTimes;
+    times.writer = mFrameWriter->getStats();
+    return times;
+}
+
+void Renderer::resetStageTimes() {
+    finish();
+    mStageTimes = StageTimes();
+    mFrameWriter->resetStats();
+}
+
+void Renderer::printCullStats(const std::string& name) {
+    const Scene::CullStats& stats = mScene->getCullStats();
+    std::cout << name << ": drawn " << stats.objects_drawn << "/"
+        << stats.objects_drawn + stats.objects_culled << " objects, "
+        << stats.chunks_drawn << "/" << stats.chunks_drawn + stats.chunks_culled
+        << " chunks" << std::endl;
 }
 
 void GLRenderer::updateCamera(const Camera& camera) {
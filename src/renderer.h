@@ -1,64 +1,192 @@
 #pragma once
 
 #include <glad/glad.h>
-#include <GLFW/glfw3.h>
-
-#if USE_NATIVE_OSMESA
-    #define GLFW_EXPOSE_NATIVE_OSMESA
-    #include <GLFW/glfw3native.h>
-#endif
 
+#include "context.h"
 #include "object.h"
 #include "scene.h"
 #include "camera.h"
-#include <thread>
+#include "frame_writer.h"
+#include "gpu_cache.h"
+#include "gpu_timer.h"
+#include <mutex>
+#include <condition_variable>
 
-class GLRenderer {
+// Interface shared by the OpenGL and the software renderer. A renderer
+// draws the current scene into a G-buffer with the channels of the scene's
+// output format and hands the frames to a FrameWriter, which writes them
+// out while later frames are rendered.
+class Renderer {
 public:
-    GLRenderer(const std::string& output_dir, int width, int height): mOutputDir(output_dir),
-    mWidth(width), mHeight(mHeight), mBuffer(nullptr),
-    mRGBA(nullptr) {
-        init();
+    virtual ~Renderer() {}
+
+    // Switch to another scene: pending frames are flushed and the G-buffer
+    // is resized to the scene's viewport
+    virtual void setScene(Scene* scene) = 0;
+    void setOutputDir(const std::string& output_dir) { mOutputDir = output_dir; }
+    // Write frames into a stacked container, nullptr for files per frame.
+    // Pending frames are flushed first.
+    void setStackedOutput(StackedOutput* output) { finish(); mFrameWriter->setStackedOutput(output); }
+    // Deflate level of compressed .npyz output, 0 for uncompressed files.
+    // Pending frames are flushed first.
+    void setCompression(int level) { finish(); mFrameWriter->setCompression(level); }
+
+    // Resize the G-buffer. Pending frames are flushed first.
+    virtual void resize(int width, int height) = 0;
+
+    // Render the current scene from a different viewpoint, nullptr for the
+    // scene camera. The frame is written out while later frames are drawn.
+    virtual void render(const Camera* camera = nullptr, const std::string& outfilename="offscreen") = 0;
+
+    // Render a batch of views, each written out to its own file
+    virtual void render(const std::vector<const Camera*>& cameras,
+        const std::vector<std::string>& outfilenames) = 0;
+
+    // Number of views rendered per pass. Pending frames are flushed first.
+    virtual void setBatchSize(int batch_size) = 0;
+    int getBatchSize() const { return mBatchSize; }
+
+    // Wait until all rendered frames have been written out
+    virtual void finish() = 0;
+
+    // Per stage timing for benchmarks. While profiling, the stages of a
+    // frame are not overlapped so that the time is attributed to the right
+    // stage.
+    void setProfiling(bool profiling) { mProfiling = profiling; }
+    struct StageTimes {
+        size_t frames;
+        double draw_seconds;        // submitting and executing the draw calls
+        double readback_seconds;    // transfer and mapping of the attachments
+        FrameWriter::Stats writer;  // complete after finish()
+
+        StageTimes(): frames(0), draw_seconds(0.0), readback_seconds(0.0) {}
+    };
+    StageTimes getStageTimes();
+    void resetStageTimes();
+
+    // Programs and meshes shared by the scenes rendered with this renderer,
+    // nullptr if it does not render on the GPU
+    virtual GPUResourceCache* getResourceCache() { return nullptr; }
+
+    // Window of the interactive mode
+    virtual int shouldClose() { return 0; }
+    virtual void swapBuffers() {}
+    virtual void pollEvents() {}
+protected:
+    Renderer(const std::string& output_dir, Scene* scene, int width, int height,
+        int num_writers, const OutputFormat& output_format):
+        mOutputDir(output_dir), mScene(scene), mWidth(width), mHeight(height),
+        mNumWriters(num_writers), mBatchSize(1), mOutputFormat(output_format),
+        mProfiling(false), mFrameWriter(nullptr) {}
+
+    std::string mOutputDir;
+    Scene* mScene;
+    int mWidth, mHeight;
+    int mNumWriters;
+    int mBatchSize;
+    // Channels and precisions of the G-buffer and the output, taken from
+    // the scene
+    OutputFormat mOutputFormat;
+    bool mProfiling;
+    StageTimes mStageTimes;
+    FrameWriter* mFrameWriter;
+
+    void printCullStats(const std::string& name);
+};
+
+class GLRenderer: public Renderer {
+public:
+    GLRenderer(const std::string& output_dir, int width, int height,
+        GLContext::Backend backend = GLContext::AUTO, bool interactive = false,
+        int num_writers = 2):
+        Renderer(output_dir, nullptr, width, height, num_writers, OutputFormat()),
+        mContext(nullptr), mInteractive(interactive) {
+        init(backend, interactive);
     }
-    GLRenderer(Scene* scene, const std::string& output_dir): 
-        mScene(scene), mOutputDir(output_dir), mBuffer(nullptr),
-        mRGBA(nullptr)
-        {   
-            mWidth = scene->getWidth();
-            mHeight = scene->getHeight();
-            init();
+    GLRenderer(Scene* scene, const std::string& output_dir,
+        GLContext::Backend backend = GLContext::AUTO, bool interactive = false,
+        int num_writers = 2):
+        Renderer(output_dir, scene, scene->getWidth(), scene->getHeight(), num_writers,
+            scene->getOutputFormat()),
+        mContext(nullptr), mInteractive(interactive)
+        {
+            init(backend, interactive);
             setupScene();
         }
     ~GLRenderer();
 
+    // The scene is set up on the GPU
+    void setScene(Scene* scene) override;
+
+    void resize(int width, int height) override;
+
     // Render a given scene. Useful when the scene is updated
     void render(Scene* scene);
 
-    // Render the current scene from a different viewpoint
-    void render(const Camera* camera = nullptr, const std::string& outfilename="offscreen");
+    // The readback is asynchronous: the frame is written out while later
+    // frames are drawn.
+    void render(const Camera* camera = nullptr, const std::string& outfilename="offscreen") override;
 
-    int shouldClose() { return glfwWindowShouldClose(mWindow); }
-    void swapBuffers() { glfwSwapBuffers(mWindow);  }
+    // If the scene supports it, up to getBatchSize() views are drawn in one
+    // pass.
+    void render(const std::vector<const Camera*>& cameras,
+        const std::vector<std::string>& outfilenames) override;
 
-    static void key_callback(GLFWwindow* window,
-        int key, int scancode, int action,
-        int mods);
+    // Clamped to what the GL implementation supports
+    void setBatchSize(int batch_size) override;
+
+    void finish() override;
+
+    GPUResourceCache* getResourceCache() override { return mResourceCache; }
+    static const size_t kDefaultGPUCacheBytes = size_t(512) << 20;
+
+    int shouldClose() override { return mContext->shouldClose(); }
+    void swapBuffers() override { mContext->swapBuffers(); }
+    void pollEvents() override { mContext->pollEvents(); }
 private:
-    std::string mOutputDir;
-    Scene* mScene;
-    GLFWwindow* mWindow;
-    int mWidth, mHeight;
-    char* mBuffer;
-    float* mRGBA;
+    GLContext* mContext;
+    bool mInteractive;
+    GPUTimer mGPUTimer;
+    GPUResourceCache* mResourceCache;
 
     GLuint mFBO;
     GLuint mTexRGBA;
     GLuint mTexPosition;
     GLuint mTexNormal;
+    GLuint mTexDepth;
+    std::vector<GLuint> mLayerFBOs;     // single layer views of the G-buffer for readback
 
-    std::thread mFrameWriterThread;
+    // color attachments, in the order of the OutputFormat channels
+    static const int NUM_ATTACHMENTS = 3;
+    // FREE -> READBACK (GL thread) -> WRITING (writer threads) -> WRITTEN -> FREE
+    enum SlotState { SLOT_FREE = 0, SLOT_READBACK, SLOT_WRITING, SLOT_WRITTEN };
+    // Preallocated frame buffers, recycled between the GL thread and the
+    // writer threads. Slots are used round robin.
+    struct ReadbackSlot {
+        GLuint pbo[OutputFormat::NUM_CHANNELS];
+        GLsync fence;
+        float near, far;        // depth range of the view
+        std::string prefix;     // output path without extension
+        SlotState state;
+    };
+    std::vector<ReadbackSlot> mReadbackSlots;
+    int mReadbackHead;      // oldest slot waiting for readback
+    int mNumPending;        // number of slots waiting for readback
+    std::mutex mSlotMutex;
+    std::condition_variable mSlotWritten;
 
-    void init();
+    void init(GLContext::Backend backend, bool interactive);
     void setupScene();
+    void initFramebuffer();
+    void releaseFramebuffer();
+    void initReadback();
+    void resolveReadback(bool wait);
+    void resolveCompleted();
+    int acquireSlot();
+    void queueReadback(int layer, const std::string& outfilename, const Camera* camera);
+    size_t readbackBytes(int channel) const;
+    void drawViews(const Camera* const* cameras, int num_views);
+    void recycleSlot(int slot_idx);
+    void releaseSlot(int slot_idx);
     void updateCamera(const Camera& camera);
 };
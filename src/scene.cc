@@ -1,26 +1,64 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
 
 #include <glad/glad.h>
 
 #include "utils.h"
 #include "object.h"
 #include "shader.h"
+#include "gpu_cache.h"
 #include "scene.h"
+#include "ThreadPool.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
 
-void Scene::loadScene(const std::string& filename)
+Scene::Scene(const std::string& filename, int num_load_threads)
+    : mCamera(nullptr), mCache(nullptr), mMaxViews(1), mMergeMeshes(false), mMerged(false),
+    mObjectTexture(0), mFrameUBO(0), mObjectUBO(0), mObjectStride(0), mAnyObjectDirty(false),
+    mTransformVersion(0)
 {
     std::ifstream ifs(filename);
-    std::string basedir = get_basedir(filename);
+    if(!ifs) {
+        throw std::runtime_error("Unable to read scene file " + filename);
+    }
 
     std::cout << "filename: " << filename << std::endl;
     Json::CharReaderBuilder reader;
     Json::Value obj;
     std::string json_err;
-    Json::parseFromStream(reader, ifs, &obj, &json_err);
+    if(!Json::parseFromStream(reader, ifs, &obj, &json_err)) {
+        throw std::runtime_error("Unable to parse scene file " + filename + ": " + json_err);
+    }
+    loadScene(obj, get_basedir(filename), num_load_threads);
+}
+
+Scene::Scene(const Json::Value& scene_spec, const std::string& basedir,
+    int num_load_threads)
+    : mCamera(nullptr), mCache(nullptr), mMaxViews(1), mMergeMeshes(false), mMerged(false),
+    mObjectTexture(0), mFrameUBO(0), mObjectUBO(0), mObjectStride(0), mAnyObjectDirty(false),
+    mTransformVersion(0)
+{
+    loadScene(scene_spec, basedir, num_load_threads);
+}
+
+Scene::~Scene()
+{
+    for(auto obj: mObjects) {
+        delete obj;
+    }
+    delete mCamera;
+}
+
+void Scene::loadScene(const Json::Value& obj, const std::string& basedir, int num_load_threads)
+{
+    if(!obj.isObject() || !obj["camera"].isObject() || !obj["glsl"].isObject()) {
+        throw std::runtime_error("Scene specification needs 'camera' and 'glsl' entries");
+    }
 
     mVertexShaderPath = basedir + "/" + obj["glsl"]["vertex"].asString();
     mFragmentShaderPath = basedir + "/" + obj["glsl"]["fragment"].asString();
@@ -29,15 +67,36 @@ void Scene::loadScene(const std::string& filename)
     std::cout << "Fragment shader path: " << mFragmentShaderPath << std::endl;
 
     mCamera = new Camera(obj["camera"]);
+    std::cout << mCamera->str() << std::endl;
 
     mColors = loadColors(obj["colors"]);
     loadLights(obj["lights"], mColors);
     loadMaterials(obj["materials"]);
+    mTonemap = Tonemap::fromJson(obj["tonemap"]);
+    mOutputFormat = OutputFormat::fromJson(obj["output"]);
+    mMergeMeshes = obj.get("merge_meshes", false).asBool();
 
     auto objects_specs = obj["objects"];
     std::cout << "objects: " << objects_specs << std::endl;
 
     //mObjects.push_back(new TestTriangle());
+    // Parse the object specs here, then load the meshes on a thread pool.
+    // Only CPU work happens here; uploads are done by setup() on the GL thread.
+    if(num_load_threads <= 0) {
+        num_load_threads = std::min<int>(std::max(1u, std::thread::hardware_concurrency()),
+                                         std::max<int>(1, objects_specs["obj"].size()));
+    }
+    for(auto obj: objects_specs["obj"]) {
+        int mat_idx = obj["material_idx"].asInt();
+        if(mat_idx < 0 || mat_idx >= int(mMaterials.size())) {
+            throw std::runtime_error("Invalid material_idx for object " + obj["path"].asString());
+        }
+    }
+    ThreadPool pool(num_load_threads);
+    std::vector<std::future<TriangleMesh*>> meshes;
+    std::vector<std::string> mesh_paths;
+    std::vector<double> load_times_ms(objects_specs["obj"].size());
+    auto load_start = std::chrono::steady_clock::now();
     for(auto obj: objects_specs["obj"]) {
         std::cout << obj["path"].asString() << std::endl;
         glm::vec3 translate(0.0);
@@ -70,9 +129,43 @@ void Scene::loadScene(const std::string& filename)
             }
         }
         int mat_idx = obj["material_idx"].asInt();
-        mObjects.push_back(new TriangleMesh(basedir + "/" + obj["path"].asString(), 
-            mMaterials[mat_idx], translate, rotate, scale));
+        MeshLoadOptions load_options;
+        load_options.smooth_normals = obj.get("smooth_normals", false).asBool();
+        std::string path = basedir + "/" + obj["path"].asString();
+        Material material = mMaterials[mat_idx];
+        double* load_time_ms = &load_times_ms[meshes.size()];
+        mesh_paths.push_back(path);
+        meshes.push_back(pool.enqueue([=]() {
+            auto start = std::chrono::steady_clock::now();
+            TriangleMesh* mesh = new TriangleMesh(path, material, translate, rotate, scale, load_options);
+            *load_time_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return mesh;
+        }));
+    }
+
+    double total_ms = 0.0;
+    for(size_t i = 0; i < meshes.size(); i++) {
+        TriangleMesh* mesh = meshes[i].get();
+        mObjects.push_back(mesh);
+        total_ms += load_times_ms[i];
+        std::cout << "Loaded " << mesh_paths[i] << ": " << mesh->getNumVertices() << " vertices, "
+            << mesh->getNumTriangles() << " triangles in " << load_times_ms[i] << " ms"
+            << (mesh->loadedFromCache() ? " (mesh cache)" : "") << std::endl;
     }
+    double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start).count();
+    std::cout << "Loaded " << meshes.size() << " objects in " << wall_ms << " ms on "
+        << pool.size() << " threads (" << total_ms << " ms sequential)" << std::endl;
+
+    buildBVH();
+}
+
+void Scene::buildBVH()
+{
+    std::vector<AABB> bounds;
+    for(auto obj: mObjects) {
+        bounds.push_back(obj->getBounds().transformed(obj->get_transformation()));
+    }
+    mBVH.build(bounds);
 }
 
 std::vector<glm::vec3> Scene::loadColors(const Json::Value& color_table)
@@ -121,36 +214,278 @@ void Scene::loadMaterials(const Json::Value& material_spec)
     }
 }
 
-void Scene::setup()
+void Scene::setup(GPUResourceCache* cache, int max_views)
+{
+    // setting up again replaces the previous setup
+    release();
+    mCache = cache;
+    std::string vs_code = load_shader_code(mVertexShaderPath);
+    std::string fs_code = load_shader_code(mFragmentShaderPath);
+    mMerged = mMergeMeshes && canMerge(vs_code);
+    setupPrograms(vs_code, fs_code, max_views);
+    if(mMerged && (!mProgram.merged || (mMaxViews > 1 && !mMultiviewProgram.merged))) {
+        std::cout << "Warning: the MERGED_DRAW variant of " << mVertexShaderPath
+            << " has no object_blocks texture buffer, drawing objects one by one" << std::endl;
+        releasePrograms();
+        mMerged = false;
+        setupPrograms(vs_code, fs_code, max_views);
+    }
+
+    if(mMerged) {
+        // the meshes get no buffers of their own
+        std::vector<const TriangleMesh*> meshes;
+        for(auto obj: mObjects) {
+            meshes.push_back(static_cast<const TriangleMesh*>(obj));
+        }
+        mMergedGeometry.build(meshes, mMaxViews);
+    } else {
+        std::map<std::string, GLuint> var_name_map;
+        var_name_map["position"] = ATTRIB_POSITION;
+        var_name_map["normal"] = ATTRIB_NORMAL;
+        var_name_map["texcoord"] = ATTRIB_TEXCOORD;
+        for(auto obj: mObjects) {
+            obj->setup(var_name_map, mCache);
+        }
+    }
+    if(mProgram.uniform_blocks)
+        setupUniformBuffers();
+}
+
+void Scene::setupPrograms(const std::string& vs_code, const std::string& fs_code, int max_views)
+{
+    std::vector<std::string> defines;
+    if(mMerged)
+        defines.push_back("MERGED_DRAW");
+    setupProgram(mProgram, mCache->acquireProgram(inject_defines(vs_code, defines),
+        inject_defines(fs_code, defines)), 1, mMerged);
+
+    // Batched views need shaders written for it (see shaders/phong)
+    mMaxViews = 1;
+    if(max_views > 1 && vs_code.find("MULTIVIEW") != std::string::npos) {
+        defines.push_back("MULTIVIEW");
+        defines.push_back("MAX_VIEWS " + std::to_string(max_views));
+        GLuint id = mCache->acquireProgram(inject_defines(vs_code, defines), inject_defines(fs_code, defines));
+        GLint linked = GL_FALSE;
+        glGetProgramiv(id, GL_LINK_STATUS, &linked);
+        if(linked) {
+            setupProgram(mMultiviewProgram, id, max_views, mMerged);
+            mMaxViews = max_views;
+        } else {
+            std::cout << "MULTIVIEW variant of " << mVertexShaderPath << " failed to link, rendering views one by one" << std::endl;
+            mCache->releaseProgram(id);
+        }
+    } else if(max_views > 1) {
+        std::cout << "Shader " << mVertexShaderPath << " has no MULTIVIEW support, rendering views one by one" << std::endl;
+    }
+}
+
+bool Scene::canMerge(const std::string& vs_code) const
+{
+    if(vs_code.find("MERGED_DRAW") == std::string::npos) {
+        std::cout << "Shader " << mVertexShaderPath << " has no MERGED_DRAW support, drawing objects one by one" << std::endl;
+        return false;
+    }
+    if(mObjects.empty())
+        return false;
+    for(auto obj: mObjects) {
+        if(!dynamic_cast<const TriangleMesh*>(obj)) {
+            std::cout << "Only scenes of triangle meshes are merged, drawing objects one by one" << std::endl;
+            return false;
+        }
+    }
+    GLint max_texels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+    size_t texels = mObjects.size() * objectBlockStride() / sizeof(glm::vec4);
+    if(texels > size_t(max_texels)) {
+        std::cout << "The object blocks of " << mObjects.size() << " objects exceed the texture buffer size "
+            << max_texels << ", drawing objects one by one" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Scene::setupProgram(ShaderProgram& program, GLuint id, int max_views, bool merged)
+{
+    bool multiview = max_views > 1;
+    program.id = id;
+    program.max_views = max_views;
+    program.model = glGetUniformLocation(id, "model");
+    program.view = glGetUniformLocation(id, multiview ? "views" : "view");
+    program.projection = glGetUniformLocation(id, multiview ? "projections" : "projection");
+    program.inv_model_view_transpose = glGetUniformLocation(id,
+        multiview ? "inv_model_view_transposes" : "inv_model_view_transpose");
+    // material is uniform per draw
+    program.draw.model = program.model;
+    program.draw.albedo = glGetUniformLocation(id, "albedo");
+    program.draw.coeffs = glGetUniformLocation(id, "coeffs");
+
+    program.ambient = glGetUniformLocation(id, "ambient");
+    program.light_pos = glGetUniformLocation(id, "light_pos");
+    program.light_color = glGetUniformLocation(id, "light_color");
+    program.light_attenuation = glGetUniformLocation(id, "light_attenuation");
+    program.cam_pos = glGetUniformLocation(id, "cam_pos");
+    program.num_lights = glGetUniformLocation(id, "num_lights");
+    program.object_blocks = glGetUniformLocation(id, "object_blocks");
+    program.object_block_texels = glGetUniformLocation(id, "object_block_texels");
+
+    // Uniform blocks are used if the program has both with the expected
+    // layout, otherwise the uniforms above are set one by one. Merged
+    // programs read the object blocks from a texture buffer instead.
+    program.uniform_blocks = false;
+    program.merged = false;
+    GLuint frame_block = glGetUniformBlockIndex(id, "FrameBlock");
+    GLuint object_block = glGetUniformBlockIndex(id, "ObjectBlock");
+    bool merged_draw = merged && program.object_blocks >= 0 && program.object_block_texels >= 0;
+    if(frame_block == GL_INVALID_INDEX || (object_block == GL_INVALID_INDEX && !merged_draw))
+        return;
+    GLint frame_size = 0, object_size = sizeof(ObjectUniforms);
+    glGetActiveUniformBlockiv(id, frame_block, GL_UNIFORM_BLOCK_DATA_SIZE, &frame_size);
+    if(object_block != GL_INVALID_INDEX)
+        glGetActiveUniformBlockiv(id, object_block, GL_UNIFORM_BLOCK_DATA_SIZE, &object_size);
+    if(size_t(frame_size) != sizeof(FrameUniforms) + 3 * max_views * sizeof(glm::mat4) ||
+        size_t(object_size) != sizeof(ObjectUniforms)) {
+        std::cout << "Warning: unexpected uniform block sizes " << frame_size << " and " << object_size
+            << " in " << mVertexShaderPath << ", setting uniforms one by one" << std::endl;
+        return;
+    }
+    glUniformBlockBinding(id, frame_block, FRAME_BLOCK_BINDING);
+    if(object_block != GL_INVALID_INDEX)
+        glUniformBlockBinding(id, object_block, OBJECT_BLOCK_BINDING);
+    program.uniform_blocks = true;
+    program.merged = merged_draw;
+}
+
+GLsizeiptr Scene::objectBlockStride()
 {
-    mProgram = LoadShaders(mVertexShaderPath, mFragmentShaderPath);
+    // object blocks are bound by offset, which must be aligned
+    GLint alignment = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    return (sizeof(ObjectUniforms) + alignment - 1) / alignment * alignment;
+}
+
+void Scene::setupUniformBuffers()
+{
+    // room for the frame block of the program with the most views
+    size_t frame_bytes = sizeof(FrameUniforms) + 3 * mMaxViews * sizeof(glm::mat4);
+    mFrameData.assign(frame_bytes, 0);
+    glGenBuffers(1, &mFrameUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, mFrameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, frame_bytes, nullptr, GL_STREAM_DRAW);
+
+    mObjectStride = objectBlockStride();
+    std::vector<unsigned char> object_data(std::max<size_t>(1, mObjects.size()) * mObjectStride, 0);
+    for(size_t k = 0; k < mObjects.size(); k++) {
+        writeObjectUniforms(k, *reinterpret_cast<ObjectUniforms*>(&object_data[k * mObjectStride]));
+    }
+    glGenBuffers(1, &mObjectUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, mObjectUBO);
+    glBufferData(GL_UNIFORM_BUFFER, object_data.size(), object_data.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    mObjectDirty.assign(mObjects.size(), 0);
+    mAnyObjectDirty = false;
+
+    if(mMerged) {
+        // the same blocks as texels for the merged draws, on texture unit 0
+        glGenTextures(1, &mObjectTexture);
+        glBindTexture(GL_TEXTURE_BUFFER, mObjectTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, mObjectUBO);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        for(const ShaderProgram* program: { &mProgram, &mMultiviewProgram }) {
+            if(program->id == 0)
+                continue;
+            glUseProgram(program->id);
+            glUniform1i(program->object_blocks, 0);
+            glUniform1i(program->object_block_texels, GLint(mObjectStride / sizeof(glm::vec4)));
+        }
+        glUseProgram(0);
+    }
+}
 
-    model_matrix_location = glGetUniformLocation(mProgram, "model");
-    view_matrix_location = glGetUniformLocation(mProgram, "view");
-    projection_matrix_location = glGetUniformLocation(mProgram, "projection");
-    inv_model_view_transpose_location = glGetUniformLocation(mProgram, "inv_model_view_transpose");
+void Scene::writeObjectUniforms(size_t k, ObjectUniforms& uniforms) const
+{
+    uniforms.model = mObjects[k]->get_transformation();
+    glm::mat3 normal = normal_matrix(uniforms.model);
+    for(int i = 0; i < 3; i++) {
+        uniforms.normal_matrix[i] = glm::vec4(normal[i], 0.0f);
+    }
+    // only meshes have a material, other objects draw in black
+    const TriangleMesh* mesh = dynamic_cast<const TriangleMesh*>(mObjects[k]);
+    uniforms.albedo = mesh ? mesh->getMaterial().albedo : glm::vec3(0.0f);
+    uniforms.coeffs = mesh ? mesh->getMaterial().coeffs : glm::vec3(0.0f);
+    uniforms.pad0 = uniforms.pad1 = 0.0f;
+}
+
+void Scene::uploadObjectUniforms()
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, mObjectUBO);
+    for(size_t k = 0; k < mObjects.size(); k++) {
+        if(!mObjectDirty[k])
+            continue;
+        ObjectUniforms uniforms;
+        writeObjectUniforms(k, uniforms);
+        glBufferSubData(GL_UNIFORM_BUFFER, k * mObjectStride, sizeof(uniforms), &uniforms);
+        mObjectDirty[k] = 0;
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    mAnyObjectDirty = false;
+}
 
-    position_location = glGetAttribLocation(mProgram, "position");
-    normal_location = glGetAttribLocation(mProgram, "normal");
-    albedo_location = glGetAttribLocation(mProgram, "albedo");
-    coeffs_location = glGetAttribLocation(mProgram, "coeffs");
+void Scene::uploadFrameUniforms(const ShaderProgram& program, const glm::mat4* views,
+    const glm::mat4* projections, const glm::mat4* inv_view_transposes, int num_views)
+{
+    FrameUniforms& frame = *reinterpret_cast<FrameUniforms*>(mFrameData.data());
+    for(int i = 0; i < MAX_NUM_LIGHTS; i++) {
+        frame.light_pos[i] = mLightPos[i];
+        frame.light_color[i] = glm::vec4(mLightColor[i], 0.0f);
+        frame.light_attenuation[i] = glm::vec4(mLightAttenuation[i], 0.0f);
+    }
+    frame.ambient = mAmbient;
+    frame.pad = 0.0f;
+    frame.cam_pos = mCamera->getPosition();
+    frame.num_lights = mNumLights;
+    // arrays sized for the views of the program, the unused views are left
+    // as they are
+    glm::mat4* matrices = reinterpret_cast<glm::mat4*>(mFrameData.data() + sizeof(FrameUniforms));
+    std::copy(views, views + num_views, matrices);
+    std::copy(projections, projections + num_views, matrices + program.max_views);
+    std::copy(inv_view_transposes, inv_view_transposes + num_views, matrices + 2 * program.max_views);
 
-    ambient_location = glGetUniformLocation(mProgram, "ambient");
-    light_pos_location = glGetUniformLocation(mProgram, "light_pos");
-    light_color_location = glGetUniformLocation(mProgram, "light_color");
-    light_attenuation_location = glGetUniformLocation(mProgram, "light_attenuation");
-    cam_pos_location = glGetUniformLocation(mProgram, "cam_pos");
-    num_lights_location = glGetUniformLocation(mProgram, "num_lights");
+    // a new store each frame, the previous one may still be read by the GPU
+    size_t bytes = sizeof(FrameUniforms) + 3 * program.max_views * sizeof(glm::mat4);
+    glBindBuffer(GL_UNIFORM_BUFFER, mFrameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, mFrameData.size(), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, bytes, mFrameData.data());
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, mFrameUBO);
+}
 
-    std::cout << "ambient_location : " << ambient_location << std::endl;
-    std::cout << "light_attenuation_location : " << light_attenuation_location << std::endl;
-    std::map<std::string, GLuint> var_name_map;
-    var_name_map["position"] = position_location;
-    var_name_map["normal"] = normal_location;
-    var_name_map["albedo"] = albedo_location;
-    var_name_map["coeffs"] = coeffs_location;
+void Scene::release()
+{
+    if(mProgram.id == 0)
+        return;
     for(auto obj: mObjects) {
-        obj->setup(var_name_map);
+        obj->release();
+    }
+    mMergedGeometry.release();
+    if(mObjectTexture != 0) {
+        glDeleteTextures(1, &mObjectTexture);
+        mObjectTexture = 0;
+    }
+    if(mFrameUBO != 0) {
+        glDeleteBuffers(1, &mFrameUBO);
+        glDeleteBuffers(1, &mObjectUBO);
+        mFrameUBO = mObjectUBO = 0;
+    }
+    releasePrograms();
+}
+
+void Scene::releasePrograms()
+{
+    mCache->releaseProgram(mProgram.id);
+    mProgram.id = 0;
+    if(mMultiviewProgram.id != 0) {
+        mCache->releaseProgram(mMultiviewProgram.id);
+        mMultiviewProgram.id = 0;
     }
 }
 
@@ -158,24 +493,120 @@ void Scene::render(const Camera* camera) {
     if(camera == nullptr) {
         camera = mCamera;
     }
+    renderViews(&camera, 1);
+}
+
+void Scene::renderViews(const Camera* const* cameras, int num_views) {
+    assert(num_views >= 1 && num_views <= mMaxViews);
+    const ShaderProgram& program = (num_views > 1) ? mMultiviewProgram : mProgram;
     glm::mat4 mModel = glm::mat4(1.0);
-    glm::mat4 mView = camera->getViewMatrix();
-    glm::mat4 mProjection = camera->getProjectionMatrix();
-    glUseProgram(mProgram);
-    
-    glUniform1i(num_lights_location, mNumLights);
-    glUniform3fv(cam_pos_location, 1, glm::value_ptr(mCamera->getPosition()));
-    glUniform3fv(ambient_location, 1, glm::value_ptr(mAmbient));
-    glUniform4fv(light_pos_location, MAX_NUM_LIGHTS, glm::value_ptr(mLightPos[0]));
-    glUniform3fv(light_color_location, MAX_NUM_LIGHTS, glm::value_ptr(mLightColor[0]));
-    glUniform3fv(light_attenuation_location, MAX_NUM_LIGHTS, glm::value_ptr(mLightAttenuation[0]));
-    glUniformMatrix4fv(view_matrix_location, 1, GL_FALSE, glm::value_ptr(mView));
-    glUniformMatrix4fv(projection_matrix_location, 1, GL_FALSE, glm::value_ptr(mProjection));
-    for(auto obj: mObjects) {
+    glm::mat4 mView[MAX_VIEWS_PER_BATCH];
+    glm::mat4 mProjection[MAX_VIEWS_PER_BATCH];
+    glm::mat4 inv_model_view_transpose_tform[MAX_VIEWS_PER_BATCH];
+    for(int i = 0; i < num_views; i++) {
+        mView[i] = cameras[i]->getViewMatrix();
+        mProjection[i] = cameras[i]->getProjectionMatrix();
+        inv_model_view_transpose_tform[i] = glm::transpose(glm::inverse(mView[i] * mModel));
+    }
+    glUseProgram(program.id);
+
+    if(program.uniform_blocks) {
+        if(mAnyObjectDirty)
+            uploadObjectUniforms();
+        uploadFrameUniforms(program, mView, mProjection, inv_model_view_transpose_tform, num_views);
+    } else {
+        glUniform1i(program.num_lights, mNumLights);
+        glUniform3fv(program.cam_pos, 1, glm::value_ptr(mCamera->getPosition()));
+        glUniform3fv(program.ambient, 1, glm::value_ptr(mAmbient));
+        glUniform4fv(program.light_pos, MAX_NUM_LIGHTS, glm::value_ptr(mLightPos[0]));
+        glUniform3fv(program.light_color, MAX_NUM_LIGHTS, glm::value_ptr(mLightColor[0]));
+        glUniform3fv(program.light_attenuation, MAX_NUM_LIGHTS, glm::value_ptr(mLightAttenuation[0]));
+        glUniformMatrix4fv(program.view, num_views, GL_FALSE, glm::value_ptr(mView[0]));
+        glUniformMatrix4fv(program.projection, num_views, GL_FALSE, glm::value_ptr(mProjection[0]));
+        glUniformMatrix4fv(program.inv_model_view_transpose, num_views, GL_FALSE, glm::value_ptr(inv_model_view_transpose_tform[0]));
+    }
+
+    // Objects outside all view frusta are skipped; objects intersecting a
+    // frustum boundary are culled chunk by chunk
+    Frustum world_frusta[MAX_VIEWS_PER_BATCH];
+    std::vector<Frustum::Result> visibility(mObjects.size(), Frustum::OUTSIDE);
+    std::vector<Frustum::Result> view_visibility(mObjects.size());
+    for(int i = 0; i < num_views; i++) {
+        world_frusta[i] = Frustum::fromMatrix(mProjection[i] * mView[i]);
+        mBVH.classify(world_frusta[i], view_visibility);
+        for(size_t k = 0; k < mObjects.size(); k++) {
+            visibility[k] = std::max(visibility[k], view_visibility[k]);
+        }
+    }
+
+    mCullStats = CullStats();
+    DrawStats draw_stats;
+    Frustum object_frusta[MAX_VIEWS_PER_BATCH];
+    if(mMerged) {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_BUFFER, mObjectTexture);
+    }
+    for(size_t k = 0; k < mObjects.size(); k++) {
+        auto obj = mObjects[k];
+        if(visibility[k] == Frustum::OUTSIDE) {
+            mCullStats.objects_culled++;
+            draw_stats.chunks_culled += obj->getNumChunks();
+            continue;
+        }
+        mCullStats.objects_drawn++;
         glm::mat4 curr_model_tform = mModel * obj->get_transformation();
-        glm::mat4 inv_model_view_transpose_tform = glm::transpose(glm::inverse(mView * mModel));
-        glUniformMatrix4fv(model_matrix_location, 1, GL_FALSE, glm::value_ptr(curr_model_tform));
-        glUniformMatrix4fv(inv_model_view_transpose_location, 1, GL_FALSE, glm::value_ptr(inv_model_view_transpose_tform));
-        obj->render(model_matrix_location);
+        // merged draws select the object block by their draw id
+        if(!mMerged && program.uniform_blocks)
+            glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, mObjectUBO, k * mObjectStride, sizeof(ObjectUniforms));
+        else if(!mMerged)
+            glUniformMatrix4fv(program.model, 1, GL_FALSE, glm::value_ptr(curr_model_tform));
+        const Frustum* frusta = nullptr;
+        if(visibility[k] == Frustum::INTERSECTS) {
+            for(int i = 0; i < num_views; i++) {
+                object_frusta[i] = Frustum::fromMatrix(mProjection[i] * mView[i] * curr_model_tform);
+            }
+            frusta = object_frusta;
+        }
+        if(mMerged)
+            mMergedGeometry.add(k, num_views, frusta, &draw_stats);
+        else
+            obj->render(program.draw, num_views, frusta, &draw_stats);
+    }
+    if(mMerged) {
+        mMergedGeometry.draw(num_views);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+    mCullStats.chunks_drawn = draw_stats.chunks_drawn;
+    mCullStats.chunks_culled = draw_stats.chunks_culled;
+}
+
+void Scene::setObjectTransform(size_t k, glm::vec3 translate, glm::mat4 rotate, glm::vec3 scale)
+{
+    mObjects[k]->set_transformations(translate, rotate, scale);
+    if(!mObjectDirty.empty()) {
+        mObjectDirty[k] = 1;
+        mAnyObjectDirty = true;
+    }
+    mTransformVersion++;
+    buildBVH();
+}
+
+void Scene::cullObjects(const Camera* camera, std::vector<Frustum::Result>& visibility)
+{
+    if(camera == nullptr) {
+        camera = mCamera;
+    }
+    visibility.resize(mObjects.size());
+    mBVH.classify(Frustum::fromMatrix(camera->getViewProjectionMatrix()), visibility);
+
+    mCullStats = CullStats();
+    for(size_t k = 0; k < mObjects.size(); k++) {
+        if(visibility[k] == Frustum::OUTSIDE) {
+            mCullStats.objects_culled++;
+            mCullStats.chunks_culled += mObjects[k]->getNumChunks();
+        } else {
+            mCullStats.objects_drawn++;
+            mCullStats.chunks_drawn += mObjects[k]->getNumChunks();
+        }
     }
 }
@@ -5,37 +5,123 @@
 #include <json/json.h>
 
 #include <glad/glad.h>
-#include <GLFW/glfw3.h>
-
-#if USE_NATIVE_OSMESA
-    #define GLFW_EXPOSE_NATIVE_OSMESA
-    #include <GLFW/glfw3native.h>
-#endif
 
 #include "camera.h"
 #include "light.h"
+#include "tonemap.h"
+#include "output_format.h"
+#include "object.h"
+#include "bvh.h"
+#include "merged_geometry.h"
 
 #define MAX_NUM_LIGHTS 8
+// Upper bound of the views rendered in one batch
+#define MAX_VIEWS_PER_BATCH 32
+
+class GPUResourceCache;
+
+// std140 layouts of the uniform blocks of the shaders, see
+// scenes/shaders/phong. Programs with these blocks get their state from
+// uniform buffers, others through individual uniforms.
+struct FrameUniforms {
+    glm::vec4 light_pos[MAX_NUM_LIGHTS];
+    glm::vec4 light_color[MAX_NUM_LIGHTS];      // vec3, array elements take a vec4
+    glm::vec4 light_attenuation[MAX_NUM_LIGHTS];
+    glm::vec3 ambient;
+    float pad;
+    glm::vec3 cam_pos;
+    GLint num_lights;
+    // followed by the views, projections and inv_view_transposes arrays
+    // of mat4, as many of each as the program draws views
+};
+struct ObjectUniforms {
+    glm::mat4 model;
+    glm::vec4 normal_matrix[3];     // mat3, columns take a vec4
+    glm::vec3 albedo;
+    float pad0;
+    glm::vec3 coeffs;
+    float pad1;
+};
 
 class Scene {
 public:
-    Scene(const std::string& filename) {
-        loadScene(filename);
-    }
+    // Meshes are loaded on num_load_threads threads (0: one per core).
+    // Throws std::runtime_error if the scene file cannot be read or parsed.
+    Scene(const std::string& filename, int num_load_threads = 0);
+    // Scene from an already parsed specification; relative paths in the
+    // specification are resolved against basedir.
+    Scene(const Json::Value& scene_spec, const std::string& basedir,
+        int num_load_threads = 0);
+    ~Scene();
 
-    void setup();
+    // Create the GPU resources of the scene, sharing them through the cache.
+    // max_views > 1 also builds the program to render batches of views.
+    void setup(GPUResourceCache* cache, int max_views = 1);
+    // Return the GPU resources created by setup() to the cache
+    void release();
     void render(const Camera* camera = nullptr);
+    // Render num_views cameras with one instanced draw per object, view i
+    // into layer i of the bound layered framebuffer. num_views must not
+    // exceed getMaxViews().
+    void renderViews(const Camera* const* cameras, int num_views);
+    // Views per batch the scene was set up for, 1 if its shaders do not
+    // support batching
+    int getMaxViews() const { return mMaxViews; }
+    // Draw all meshes from shared buffers with one multi-draw call per pass
+    // (the "merge_meshes" entry of the scene). Needs shaders written for
+    // it (MERGED_DRAW, see shaders/phong), takes effect in setup().
+    void setMergeMeshes(bool merge) { mMergeMeshes = merge; }
+    bool getMergeMeshes() const { return mMergeMeshes; }
+    // The meshes are drawn merged since the last setup()
+    bool drawsMerged() const { return mMerged; }
+
+    // Objects and mesh chunks drawn and culled by the last render call
+    struct CullStats {
+        size_t objects_drawn, objects_culled;
+        size_t chunks_drawn, chunks_culled;
+
+        CullStats(): objects_drawn(0), objects_culled(0), chunks_drawn(0), chunks_culled(0) {}
+    };
+    const CullStats& getCullStats() const { return mCullStats; }
 
     int getWidth() { return mCamera->getWidth(); }
     int getHeight() { return mCamera->getHeight(); }
+    const Tonemap& getTonemap() const { return mTonemap; }
+    const OutputFormat& getOutputFormat() const { return mOutputFormat; }
+    // Override the "output" entry of the scene, e.g. from the command line
+    void setOutputFormat(const OutputFormat& format) { mOutputFormat = format; }
+    const Camera* getCamera() const { return mCamera; }
+
+    // Scene contents for renderers that draw without GL
+    const std::vector<GLRenderableObject*>& getObjects() const { return mObjects; }
+    glm::vec3 getAmbient() const { return mAmbient; }
+    int getNumLights() const { return mNumLights; }
+    glm::vec4 getLightPosition(int i) const { return mLightPos[i]; }
+    glm::vec3 getLightColor(int i) const { return mLightColor[i]; }
+    glm::vec3 getLightAttenuation(int i) const { return mLightAttenuation[i]; }
+    // Move object k. Its uniform block is uploaded again before the next
+    // draw and the culling bounds are updated.
+    void setObjectTransform(size_t k, glm::vec3 translate, glm::mat4 rotate, glm::vec3 scale);
+    // Incremented by setObjectTransform(), for renderers that keep their
+    // own world space copy of the objects
+    unsigned int getTransformVersion() const { return mTransformVersion; }
+    // Classify the objects against the view frustum of camera (nullptr for
+    // the scene camera), one result per object, and count them in the cull
+    // stats. Objects are not split into chunks, drawn objects count all
+    // their chunks as drawn.
+    void cullObjects(const Camera* camera, std::vector<Frustum::Result>& visibility);
 private:
-    void loadScene(const std::string& filename);
+    void loadScene(const Json::Value& obj, const std::string& basedir, int num_load_threads);
     std::vector<glm::vec3> loadColors(const Json::Value& color_table);
     void loadLights(const Json::Value& light_spec,
         const std::vector<glm::vec3>& colors);
     void loadMaterials(const Json::Value& material_spec);
 
     std::vector<GLRenderableObject*> mObjects;
+    // Over the world space bounds of mObjects, for frustum culling
+    BVH mBVH;
+    CullStats mCullStats;
+    void buildBVH();
     //std::vector<std::shared_ptr<Light>> mLights;
     glm::vec3 mAmbient;
     std::vector<Material> mMaterials;
@@ -44,19 +130,60 @@ private:
     glm::vec3 mLightColor[MAX_NUM_LIGHTS];
     glm::vec3 mLightAttenuation[MAX_NUM_LIGHTS];
     std::vector<glm::vec3> mColors;
+    Tonemap mTonemap;
+    OutputFormat mOutputFormat;
 
     Camera* mCamera;
-    GLuint mProgram;
-    GLint model_matrix_location, view_matrix_location, projection_matrix_location;
-    GLint position_location, normal_location, albedo_location, coeffs_location;
-    GLint inv_model_view_transpose_location;
-    GLint ambient_location;
-    GLint light_pos_location;
-    GLint light_attenuation_location;
-    GLint light_color_location;
-    GLint num_lights_location;
-    GLint cam_pos_location;
-    
+    GPUResourceCache* mCache;
+
+    struct ShaderProgram {
+        GLuint id;
+        GLint model, view, projection;
+        GLint inv_model_view_transpose;
+        GLint ambient;
+        GLint light_pos;
+        GLint light_attenuation;
+        GLint light_color;
+        GLint num_lights;
+        GLint cam_pos;
+        DrawLocations draw;
+        GLint object_blocks, object_block_texels;
+        // The program has the FrameBlock and ObjectBlock uniform blocks
+        bool uniform_blocks;
+        // MERGED_DRAW variant, reads the object blocks from a texture buffer
+        bool merged;
+        int max_views;
+
+        ShaderProgram(): id(0), uniform_blocks(false), merged(false), max_views(1) {}
+    };
+    ShaderProgram mProgram;
+    ShaderProgram mMultiviewProgram;    // MULTIVIEW variant, for batches of views
+    int mMaxViews;
+    void setupPrograms(const std::string& vs_code, const std::string& fs_code, int max_views);
+    void setupProgram(ShaderProgram& program, GLuint id, int max_views, bool merged);
+    void releasePrograms();
+
+    bool mMergeMeshes;
+    bool mMerged;
+    MergedGeometry mMergedGeometry;
+    GLuint mObjectTexture;      // texture buffer over mObjectUBO for merged draws
+    bool canMerge(const std::string& vs_code) const;
+
+    // Uniform buffers of the programs with uniform blocks. Object blocks
+    // are written once and again only after setObjectTransform().
+    GLuint mFrameUBO, mObjectUBO;
+    GLsizeiptr mObjectStride;       // bytes per object, a multiple of the offset alignment
+    static GLsizeiptr objectBlockStride();
+    std::vector<char> mObjectDirty; // per object
+    bool mAnyObjectDirty;
+    unsigned int mTransformVersion;
+    std::vector<unsigned char> mFrameData;  // staging of the frame block
+    void setupUniformBuffers();
+    void writeObjectUniforms(size_t k, ObjectUniforms& uniforms) const;
+    void uploadObjectUniforms();
+    void uploadFrameUniforms(const ShaderProgram& program, const glm::mat4* views,
+        const glm::mat4* projections, const glm::mat4* inv_view_transposes, int num_views);
+
     std::string mVertexShaderPath;
     std::string mFragmentShaderPath;
 };
@@ -0,0 +1,315 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "camera.h"
+#include "profiler.h"
+#include "server.h"
+
+static std::string to_json_line(const Json::Value& value)
+{
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, value) + "\n";
+}
+
+static bool write_all(int fd, const std::string& data)
+{
+    size_t done = 0;
+    while(done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static void send_message(int fd, const Json::Value& job, const std::string& status,
+    Json::Value message = Json::Value(Json::objectValue))
+{
+    if(job.isObject() && job.isMember("id"))
+        message["id"] = job["id"];
+    message["status"] = status;
+    write_all(fd, to_json_line(message));
+}
+
+static Json::Value read_json_file(const std::string& path)
+{
+    std::ifstream ifs(path);
+    if(!ifs) {
+        throw std::runtime_error("Unable to read " + path);
+    }
+    Json::CharReaderBuilder reader;
+    Json::Value value;
+    std::string json_err;
+    if(!Json::parseFromStream(reader, ifs, &value, &json_err)) {
+        throw std::runtime_error("Unable to parse " + path + ": " + json_err);
+    }
+    return value;
+}
+
+RenderServer::RenderServer(Renderer* renderer, int batch_size)
+    : mRenderer(renderer), mScene(nullptr), mShutdown(false)
+{
+    mRenderer->setBatchSize(batch_size);
+}
+
+RenderServer::~RenderServer()
+{
+    mRenderer->finish();
+    if(mScene) {
+        mScene->release();
+        delete mScene;
+    }
+    delete mRenderer;
+}
+
+int RenderServer::serveStdin()
+{
+    serveConnection(STDIN_FILENO, STDOUT_FILENO);
+    return 0;
+}
+
+int RenderServer::serveSocket(const std::string& socket_path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cout << "Error: socket path too long: " << socket_path << std::endl;
+        return -1;
+    }
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0) {
+        std::cout << "Error: socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    // a stale socket file of a previous server would make bind fail
+    unlink(socket_path.c_str());
+    if(bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+        std::cout << "Error: unable to listen on " << socket_path << ": " << strerror(errno) << std::endl;
+        close(listen_fd);
+        return -1;
+    }
+    std::cout << "Listening on " << socket_path << std::endl;
+
+    while(!mShutdown) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if(fd < 0) {
+            if(errno == EINTR)
+                continue;
+            std::cout << "Error: accept: " << strerror(errno) << std::endl;
+            break;
+        }
+        serveConnection(fd, fd);
+        close(fd);
+    }
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    return 0;
+}
+
+void RenderServer::serveConnection(int in_fd, int out_fd)
+{
+    // a client going away must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string pending;
+    char buffer[4096];
+    while(!mShutdown) {
+        size_t newline = pending.find('\n');
+        if(newline != std::string::npos) {
+            std::string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if(line.find_first_not_of(" \t\r") != std::string::npos)
+                handleRequest(line, out_fd);
+            continue;
+        }
+        ssize_t n = read(in_fd, buffer, sizeof(buffer));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            // last job may come without a trailing newline
+            if(pending.find_first_not_of(" \t\r") != std::string::npos)
+                handleRequest(pending, out_fd);
+            break;
+        }
+        pending.append(buffer, n);
+    }
+}
+
+void RenderServer::handleRequest(const std::string& line, int out_fd)
+{
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    Json::Value job;
+    std::string json_err;
+    if(!reader->parse(line.data(), line.data() + line.size(), &job, &json_err) || !job.isObject()) {
+        Json::Value message;
+        message["message"] = "Invalid job: " + json_err;
+        send_message(out_fd, Json::Value(), "error", message);
+        return;
+    }
+
+    if(job.isMember("command")) {
+        if(job["command"].asString() == "shutdown") {
+            mShutdown = true;
+            send_message(out_fd, job, "shutdown");
+        } else {
+            Json::Value message;
+            message["message"] = "Unknown command " + job["command"].asString();
+            send_message(out_fd, job, "error", message);
+        }
+        return;
+    }
+
+    try {
+        runJob(job, out_fd);
+    } catch(const std::exception& e) {
+        std::cout << "Job failed: " << e.what() << std::endl;
+        Json::Value message;
+        message["message"] = e.what();
+        send_message(out_fd, job, "error", message);
+    }
+}
+
+bool RenderServer::loadScene(const Json::Value& job)
+{
+    const Json::Value& scene_spec = job["scene"];
+    Json::Value spec;
+    std::string basedir;
+    if(scene_spec.isString()) {
+        spec = read_json_file(scene_spec.asString());
+        basedir = get_basedir(scene_spec.asString());
+    } else if(scene_spec.isObject()) {
+        spec = scene_spec;
+        basedir = job.get("basedir", ".").asString();
+    } else {
+        throw std::runtime_error("Job needs a scene file path or an inline scene");
+    }
+
+    // The scene is identified by its content, edits to a scene file are
+    // picked up by the next job
+    std::string key = basedir + "\n" + to_json_line(spec);
+    if(mScene && key == mSceneKey)
+        return true;
+
+    Scene* scene = new Scene(spec, basedir);
+    // Set up the new scene before releasing the old one so that resources
+    // shared by both stay in the cache
+    Scene* old_scene = mScene;
+    mScene = scene;
+    mSceneKey = key;
+    mRenderer->setScene(mScene);
+    if(old_scene) {
+        old_scene->release();
+        delete old_scene;
+    }
+    return false;
+}
+
+void RenderServer::runJob(const Json::Value& job, int out_fd)
+{
+    auto start = std::chrono::steady_clock::now();
+    if(Profiler::enabled())
+        Profiler::instance().resetHistograms();
+    std::string out_dir = job.get("output_dir", "").asString();
+    if(!out_dir.empty() && !is_directory(out_dir)) {
+        throw std::runtime_error("Output directory " + out_dir + " does not exist");
+    }
+
+    std::unique_ptr<CameraTrajectory> cam_traj;
+    const Json::Value& traj_spec = job["trajectory"];
+    double keyframe_rate = job.get("fps", 0.0).asDouble();
+    if(keyframe_rate < 0.0) {
+        throw std::runtime_error("\"fps\" must be positive");
+    }
+    if(traj_spec.isString()) {
+        cam_traj.reset(new CameraTrajectory(traj_spec.asString(), keyframe_rate));
+    } else if(!traj_spec.isNull()) {
+        cam_traj.reset(new CameraTrajectory(traj_spec, keyframe_rate));
+    }
+    int num_frames = cam_traj ? cam_traj->size() : 1;
+
+    Json::Value accepted;
+    accepted["frames"] = num_frames;
+    send_message(out_fd, job, "accepted", accepted);
+
+    bool reused = loadScene(job);
+    mRenderer->setOutputDir(out_dir.empty() ? out_dir : out_dir + "/");
+
+    int frame = 0;
+    // the trajectory only keeps its current chunk, batches hold copies
+    std::vector<Camera> batch;
+    std::vector<const Camera*> cameras;
+    std::vector<std::string> names;
+    while(frame < num_frames) {
+        batch.clear();
+        cameras.clear();
+        names.clear();
+        if(cam_traj) {
+            while(int(batch.size()) < mRenderer->getBatchSize()) {
+                auto cam_fname = cam_traj->getNextCameraAndFilename();
+                if(cam_fname.first == nullptr)
+                    break;
+                batch.push_back(*cam_fname.first);
+                names.push_back(cam_fname.second);
+            }
+            for(auto& camera: batch) {
+                cameras.push_back(&camera);
+            }
+        } else {
+            cameras.push_back(nullptr);
+            names.push_back("offscreen");
+        }
+        if(cameras.empty())
+            break;
+        mRenderer->render(cameras, names);
+        const Scene::CullStats& cull_stats = mScene->getCullStats();
+
+        for(auto& name: names) {
+            frame++;
+            Json::Value progress;
+            progress["frame"] = frame;
+            progress["frames"] = num_frames;
+            progress["name"] = name;
+            progress["objects_drawn"] = Json::UInt64(cull_stats.objects_drawn);
+            progress["objects_culled"] = Json::UInt64(cull_stats.objects_culled);
+            progress["chunks_drawn"] = Json::UInt64(cull_stats.chunks_drawn);
+            progress["chunks_culled"] = Json::UInt64(cull_stats.chunks_culled);
+            send_message(out_fd, job, "progress", progress);
+        }
+    }
+    // all files of the job are on disk before it is reported done
+    mRenderer->finish();
+
+    Json::Value done;
+    done["frames"] = frame;
+    done["scene_reused"] = reused;
+    if(GPUResourceCache* cache = mRenderer->getResourceCache()) {
+        const GPUResourceCache::Stats& stats = cache->getStats();
+        done["gpu_cache"]["hits"] = Json::UInt64(stats.hits);
+        done["gpu_cache"]["misses"] = Json::UInt64(stats.misses);
+        done["gpu_cache"]["evictions"] = Json::UInt64(stats.evictions);
+        done["gpu_cache"]["bytes"] = Json::UInt64(stats.bytes);
+    }
+    done["elapsed_ms"] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if(Profiler::enabled())
+        done["timings"] = Profiler::instance().summary();
+    send_message(out_fd, job, "done", done);
+}
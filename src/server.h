@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <json/json.h>
+
+#include "renderer.h"
+#include "scene.h"
+
+// Persistent render server. Jobs are newline delimited JSON objects:
+//
+//   {"id": "job-1", "scene": "scenes/basic_bunny.json",
+//    "trajectory": "scenes/camera_trajectory.json", "output_dir": "out"}
+//
+// "scene" is a scene file path or an inline scene object, in which case
+// "basedir" gives the directory its relative paths are resolved against.
+// "trajectory" is a trajectory file path or an inline list of cameras; without
+// it the scene camera is rendered once. With "fps" the trajectory is a list of
+// keyframes with timestamps that is interpolated at that frame rate. Every
+// job gets an "accepted" message, one "progress" message per frame and a
+// final "done" or "error" message, all tagged with the job id. With
+// --profile the "done" message carries the stage timings of the job.
+// {"command": "shutdown"} stops the server.
+//
+// The renderer (GL context, framebuffer and writer threads) lives as long as
+// the server, and the last scene stays loaded, on the GPU with GLRenderer,
+// so consecutive jobs on the same scene skip loading and setup. Jobs on other
+// scenes still share programs and meshes through the renderer's GPU resource
+// cache.
+class RenderServer {
+public:
+    // Takes ownership of the renderer, which is resized to the scene of the
+    // first job
+    explicit RenderServer(Renderer* renderer, int batch_size = 1);
+    ~RenderServer();
+
+    // Serve jobs read from stdin, messages go to stdout. The caller keeps
+    // log output (std::cout) off stdout.
+    int serveStdin();
+    // Serve jobs from clients of a Unix domain socket, one client at a time
+    int serveSocket(const std::string& socket_path);
+private:
+    Renderer* mRenderer;
+    Scene* mScene;
+    std::string mSceneKey;  // identifies the specification mScene was built from
+    bool mShutdown;
+
+    // Handle all jobs of one connection until it is closed or shutdown
+    void serveConnection(int in_fd, int out_fd);
+    void handleRequest(const std::string& line, int out_fd);
+    void runJob(const Json::Value& job, int out_fd);
+    bool loadScene(const Json::Value& job);
+};
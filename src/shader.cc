@@ -2,6 +2,7 @@
 #include <sstream>
 #include <fstream>
 #include "shader.h"
+#include "program_cache.h"
 
 std::string load_shader_code(const std::string& path)
 {
@@ -17,6 +18,31 @@ std::string load_shader_code(const std::string& path)
     return code;
 }
 
+std::string inject_defines(const std::string& code, const std::vector<std::string>& defines)
+{
+    if(defines.empty())
+        return code;
+    std::string block;
+    for(auto& define: defines) {
+        block += "#define " + define + "\n";
+    }
+    // Defines have to follow the #version directive
+    std::string result = code;
+    size_t pos = 0;
+    size_t version = result.find("#version");
+    if(version != std::string::npos) {
+        pos = result.find('\n', version);
+        if(pos == std::string::npos) {
+            result += "\n";
+            pos = result.size();
+        } else {
+            pos++;
+        }
+    }
+    result.insert(pos, block);
+    return result;
+}
+
 GLuint compile_shader(const std::string& shader,
     GLuint shader_id) 
 {
@@ -42,12 +68,20 @@ GLuint compile_shader(const std::string& shader,
 GLuint LoadShaders(const std::string& vertex_file_path,
     const std::string& fragment_file_path)
 {
+    return LoadShadersFromSource(load_shader_code(vertex_file_path),
+        load_shader_code(fragment_file_path));
+}
+
+GLuint LoadShadersFromSource(const std::string& vs_code,
+    const std::string& fs_code)
+{
+    GLuint cached = ProgramCache::load(vs_code, fs_code);
+    if(cached)
+        return cached;
+
     GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
     GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
 
-    std::string vs_code = load_shader_code(vertex_file_path);
-    std::string fs_code = load_shader_code(fragment_file_path);
-
     // Compile the shader
     compile_shader(vs_code, VertexShaderID);
     compile_shader(fs_code, FragmentShaderID);
@@ -55,13 +89,36 @@ GLuint LoadShaders(const std::string& vertex_file_path,
     GLuint progID = glCreateProgram();
     glAttachShader(progID, VertexShaderID);
     glAttachShader(progID, FragmentShaderID);
+    // Same attribute locations in every program, so one vertex array object
+    // works with all variants of a shader
+    glBindAttribLocation(progID, ATTRIB_POSITION, "position");
+    glBindAttribLocation(progID, ATTRIB_NORMAL, "normal");
+    glBindAttribLocation(progID, ATTRIB_TEXCOORD, "texcoord");
+    glBindAttribLocation(progID, ATTRIB_DRAW_ID, "draw_id");
+    if(ProgramCache::enabled())
+        glProgramParameteri(progID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(progID);
 
-    // Check
-    //...
+    GLint linked = GL_FALSE;
+    glGetProgramiv(progID, GL_LINK_STATUS, &linked);
+    if(!linked) {
+        std::cout << "LoadShaders: link error:" << std::endl;
+        GLint infoLogLength = 0;
+        glGetProgramiv(progID, GL_INFO_LOG_LENGTH, &infoLogLength);
+        if(infoLogLength > 0) {
+            std::vector<GLchar> infoLog(infoLogLength + 1);
+            glGetProgramInfoLog(progID, infoLogLength, nullptr, infoLog.data());
+            std::cout << infoLog.data() << std::endl;
+        }
+    }
 
     glDetachShader(progID, VertexShaderID);
     glDetachShader(progID, FragmentShaderID);
+    glDeleteShader(VertexShaderID);
+    glDeleteShader(FragmentShaderID);
 
+    // Failed programs are not cached, they are compiled again next time
+    if(linked)
+        ProgramCache::store(vs_code, fs_code, progID);
     return progID;
 }
@@ -1,12 +1,23 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <glad/glad.h>
 
+// Attribute locations bound in every program
+enum { ATTRIB_POSITION = 0, ATTRIB_NORMAL = 1, ATTRIB_TEXCOORD = 2, ATTRIB_DRAW_ID = 3 };
+// Uniform buffer binding points of the FrameBlock and ObjectBlock
+enum { FRAME_BLOCK_BINDING = 0, OBJECT_BLOCK_BINDING = 1 };
+
 std::string load_shader_code(const std::string& path);
+// Insert "#define <define>" lines right after the #version directive,
+// e.g. {"MULTIVIEW", "MAX_VIEWS 8"}
+std::string inject_defines(const std::string& code, const std::vector<std::string>& defines);
 GLuint compile_shader(const std::string& shader, GLuint shader_id);
 GLuint LoadShaders(const std::string& vertex_file_path,
     const std::string& fragment_file_path);
+GLuint LoadShadersFromSource(const std::string& vs_code,
+    const std::string& fs_code);
 
 
 class GLShader {
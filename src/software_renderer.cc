@@ -0,0 +1,366 @@
+#include <iostream>
+#include <algorithm>
+#include <future>
+#include <cmath>
+
+#include "utils.h"
+#include "software_renderer.h"
+#include "profiler.h"
+#include "Float4.hpp"
+
+namespace {
+
+const uint32_t kNoTriangle = 0xffffffffu;
+// Triangles reaching further out than this many times the viewport are
+// clipped, the others are rasterized as they are. Keeps the window
+// coordinates small enough for exact edge functions.
+const float kGuardBand = 8.0f;
+// Window coordinates are snapped to 1/256 pixel, as a GPU would
+const float kSubpixels = 256.0f;
+const size_t kVerticesPerTask = 16384;
+const size_t kTrianglesPerTask = 16384;
+const int kTilePixels = SoftwareRenderer::kTileSize * SoftwareRenderer::kTileSize;
+
+void wait_all(std::vector<std::future<void>>& tasks)
+{
+    for(auto& task: tasks) {
+        task.get();
+    }
+    tasks.clear();
+}
+
+}
+
+SoftwareRenderer::SoftwareRenderer(const std::string& output_dir, int width, int height,
+    int num_writers, int num_threads)
+    : CPURenderer(output_dir, nullptr, width, height, num_writers, num_threads)
+{
+    std::cout << "Renderer: software rasterizer on " << mPool.size() << " threads" << std::endl;
+}
+
+SoftwareRenderer::SoftwareRenderer(Scene* scene, const std::string& output_dir,
+    int num_writers, int num_threads)
+    : CPURenderer(output_dir, scene, scene->getWidth(), scene->getHeight(), num_writers, num_threads)
+{
+    std::cout << "Renderer: software rasterizer on " << mPool.size() << " threads" << std::endl;
+}
+
+void SoftwareRenderer::drawView(const Camera* camera, FrameSlot& slot)
+{
+    std::vector<Frustum::Result> visibility;
+    mScene->cullObjects(camera, visibility);
+    const std::vector<GLRenderableObject*>& objects = mScene->getObjects();
+    mMeshes.clear();
+    mMeshTriangles.assign(1, 0);
+    for(size_t k = 0; k < objects.size(); k++) {
+        const TriangleMesh* mesh = dynamic_cast<const TriangleMesh*>(objects[k]);
+        if(visibility[k] == Frustum::OUTSIDE || !mesh)
+            continue;
+        mMeshes.push_back(mesh);
+        mMeshTriangles.push_back(mMeshTriangles.back() + mesh->getNumTriangles());
+    }
+    mVertices.resize(mMeshes.size());
+
+    std::vector<std::future<void>> tasks;
+    {
+        ScopedTimer timer("transform vertices");
+        for(size_t m = 0; m < mMeshes.size(); m++) {
+            size_t num_vertices = mMeshes[m]->getNumVertices();
+            mVertices[m].resize(num_vertices);
+            for(size_t first = 0; first < num_vertices; first += kVerticesPerTask) {
+                size_t count = std::min(kVerticesPerTask, num_vertices - first);
+                tasks.push_back(mPool.enqueue([this, m, first, count] { transformVertices(m, first, count); }));
+            }
+        }
+        wait_all(tasks);
+    }
+
+    {
+        ScopedTimer timer("setup triangles");
+        size_t total = mMeshTriangles.back();
+        size_t per_task = std::max(kTrianglesPerTask, (total + kMaxSetupTasks - 1) / kMaxSetupTasks);
+        size_t num_tasks = (total + per_task - 1) / per_task;
+        mSetupTasks.resize(num_tasks);
+        for(size_t t = 0; t < num_tasks; t++) {
+            SetupTask& task = mSetupTasks[t];
+            task.first_triangle = t * per_task;
+            task.num_triangles = std::min(per_task, total - task.first_triangle);
+            tasks.push_back(mPool.enqueue([this, &task] { setupTriangles(task); }));
+        }
+        wait_all(tasks);
+    }
+
+    {
+        ScopedTimer timer("rasterize tiles");
+        for(int ty = 0; ty < mTilesY; ty++) {
+            for(int tx = 0; tx < mTilesX; tx++) {
+                tasks.push_back(mPool.enqueue([this, tx, ty, &slot] { renderTile(tx, ty, slot); }));
+            }
+        }
+        wait_all(tasks);
+    }
+}
+
+void SoftwareRenderer::transformVertices(size_t mesh, size_t first, size_t count)
+{
+    // the phong vertex shader
+    glm::mat4 model = mMeshes[mesh]->get_transformation();
+    glm::mat4 model_view = mView.view * model;
+    glm::mat4 model_view_projection = mView.projection * mView.view * model;
+    glm::mat3 normal = normal_matrix(model);
+    const Vertex* vertices = mMeshes[mesh]->getArrays().vertices;
+    ClipVertex* out = mVertices[mesh].data();
+    for(size_t i = first; i < first + count; i++) {
+        glm::vec4 position(vertices[i].position, 1.0f);
+        out[i].clip = model_view_projection * position;
+        out[i].position = glm::vec3(model_view * position);
+        out[i].normal = transformNormal(vertices[i].normal, normal);
+    }
+}
+
+void SoftwareRenderer::setupTriangles(SetupTask& task)
+{
+    task.triangles.clear();
+    task.attributes.clear();
+    task.bins.resize(mTilesX * mTilesY);
+    for(auto& bin: task.bins) {
+        bin.clear();
+    }
+
+    size_t end = task.first_triangle + task.num_triangles;
+    size_t mesh = std::upper_bound(mMeshTriangles.begin(), mMeshTriangles.end(), task.first_triangle)
+        - mMeshTriangles.begin() - 1;
+    for(size_t t = task.first_triangle; t < end; mesh++) {
+        const MeshArrays& arrays = mMeshes[mesh]->getArrays();
+        const glm::vec3& albedo = mMeshes[mesh]->getMaterial().albedo;
+        const ClipVertex* vertices = mVertices[mesh].data();
+        size_t mesh_end = std::min(end, mMeshTriangles[mesh + 1]);
+        for(; t < mesh_end; t++) {
+            size_t first_index = 3 * (t - mMeshTriangles[mesh]);
+            const ClipVertex* v[3];
+            for(int i = 0; i < 3; i++) {
+                v[i] = &vertices[arrays.index(first_index + i)];
+            }
+
+            // outside one of the frustum planes
+            int outside = 0x3f;
+            bool needs_clipping = false;
+            for(int i = 0; i < 3; i++) {
+                const glm::vec4& p = v[i]->clip;
+                outside &= (p.x < -p.w) | (p.x > p.w) << 1 | (p.y < -p.w) << 2 |
+                    (p.y > p.w) << 3 | (p.z < -p.w) << 4 | (p.z > p.w) << 5;
+                float guard = kGuardBand * p.w;
+                needs_clipping = needs_clipping || p.z < -p.w ||
+                    std::abs(p.x) > guard || std::abs(p.y) > guard;
+            }
+            if(outside)
+                continue;
+            if(!needs_clipping) {
+                addTriangle(task, v, albedo);
+                continue;
+            }
+
+            // Sutherland-Hodgman against the near plane and the guard band
+            ClipVertex buffers[2][9];
+            int n = 3;
+            for(int i = 0; i < 3; i++) {
+                buffers[0][i] = *v[i];
+            }
+            ClipVertex* in = buffers[0];
+            ClipVertex* out = buffers[1];
+            for(int plane = 0; plane < 5 && n >= 3; plane++) {
+                auto distance = [plane](const glm::vec4& p) {
+                    switch(plane) {
+                    case 0: return p.z + p.w;
+                    case 1: return kGuardBand * p.w + p.x;
+                    case 2: return kGuardBand * p.w - p.x;
+                    case 3: return kGuardBand * p.w + p.y;
+                    default: return kGuardBand * p.w - p.y;
+                    }
+                };
+                int m = 0;
+                for(int i = 0; i < n; i++) {
+                    const ClipVertex& a = in[i];
+                    const ClipVertex& b = in[(i + 1) % n];
+                    float da = distance(a.clip), db = distance(b.clip);
+                    if(da >= 0.0f)
+                        out[m++] = a;
+                    if((da >= 0.0f) != (db >= 0.0f)) {
+                        float s = da / (da - db);
+                        out[m].clip = glm::mix(a.clip, b.clip, s);
+                        out[m].position = glm::mix(a.position, b.position, s);
+                        out[m].normal = glm::mix(a.normal, b.normal, s);
+                        m++;
+                    }
+                }
+                n = m;
+                std::swap(in, out);
+            }
+            for(int i = 1; i + 1 < n; i++) {
+                const ClipVertex* fan[3] = { &in[0], &in[i], &in[i + 1] };
+                addTriangle(task, fan, albedo);
+            }
+        }
+    }
+}
+
+void SoftwareRenderer::addTriangle(SetupTask& task, const ClipVertex* v[3], const glm::vec3& albedo)
+{
+    // viewport transform, default depth range [0, 1]
+    float x[3], y[3], z[3], inv_w[3];
+    for(int i = 0; i < 3; i++) {
+        const glm::vec4& p = v[i]->clip;
+        inv_w[i] = 1.0f / p.w;
+        x[i] = std::round((p.x * inv_w[i] * 0.5f + 0.5f) * mWidth * kSubpixels) / kSubpixels;
+        y[i] = std::round((p.y * inv_w[i] * 0.5f + 0.5f) * mHeight * kSubpixels) / kSubpixels;
+        z[i] = p.z * inv_w[i] * 0.5f + 0.5f;
+    }
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if(area == 0.0f)
+        return;
+    // both windings are drawn, edge functions are set up counter clockwise
+    int order[3] = { 0, 1, 2 };
+    if(area < 0.0f) {
+        std::swap(order[1], order[2]);
+        area = -area;
+    }
+
+    RasterTriangle tri;
+    float xmin = std::min(std::min(x[0], x[1]), x[2]);
+    float xmax = std::max(std::max(x[0], x[1]), x[2]);
+    float ymin = std::min(std::min(y[0], y[1]), y[2]);
+    float ymax = std::max(std::max(y[0], y[1]), y[2]);
+    // pixels with their center inside the bounds
+    tri.xmin = std::max(0, int(std::ceil(xmin - 0.5f)));
+    tri.xmax = std::min(mWidth - 1, int(std::floor(xmax - 0.5f)));
+    tri.ymin = std::max(0, int(std::ceil(ymin - 0.5f)));
+    tri.ymax = std::min(mHeight - 1, int(std::floor(ymax - 0.5f)));
+    if(tri.xmin > tri.xmax || tri.ymin > tri.ymax)
+        return;
+
+    float inv_area = 1.0f / area;
+    tri.owned = 0;
+    tri.za = tri.zb = tri.zc = 0.0f;
+    for(int i = 0; i < 3; i++) {
+        // edge from vertex j to k, opposite of vertex i
+        int vi = order[i], vj = order[(i + 1) % 3], vk = order[(i + 2) % 3];
+        float a = y[vj] - y[vk];
+        float b = x[vk] - x[vj];
+        float c = -(a * x[vj] + b * y[vj]);
+        // pixel centers on an edge shared by two triangles belong to one of them
+        if(a > 0.0f || (a == 0.0f && b < 0.0f))
+            tri.owned |= 1 << i;
+        tri.a[i] = a * inv_area;
+        tri.b[i] = b * inv_area;
+        tri.c[i] = c * inv_area;
+        tri.za += z[vi] * tri.a[i];
+        tri.zb += z[vi] * tri.b[i];
+        tri.zc += z[vi] * tri.c[i];
+    }
+
+    TriangleAttributes attributes;
+    for(int i = 0; i < 3; i++) {
+        const ClipVertex& vertex = *v[order[i]];
+        attributes.inv_w[i] = inv_w[order[i]];
+        attributes.position[i] = vertex.position;
+        attributes.normal[i] = vertex.normal;
+    }
+    attributes.albedo = albedo;
+
+    uint32_t index = task.triangles.size();
+    if(index >= (1u << 24)) {
+        std::cout << "Error: too many triangles in a setup task, triangles dropped" << std::endl;
+        return;
+    }
+    task.triangles.push_back(tri);
+    task.attributes.push_back(attributes);
+    for(int ty = tri.ymin / kTileSize; ty <= tri.ymax / kTileSize; ty++) {
+        for(int tx = tri.xmin / kTileSize; tx <= tri.xmax / kTileSize; tx++) {
+            task.bins[ty * mTilesX + tx].push_back(index);
+        }
+    }
+}
+
+void SoftwareRenderer::renderTile(int tile_x, int tile_y, FrameSlot& slot)
+{
+    // Visibility: the nearest triangle per pixel of the tile
+    thread_local std::vector<float> depth;
+    thread_local std::vector<uint32_t> ids;
+    depth.assign(kTilePixels, 1.0f);
+    ids.assign(kTilePixels, kNoTriangle);
+    int x0 = tile_x * kTileSize, y0 = tile_y * kTileSize;
+    int x1 = std::min(x0 + kTileSize, mWidth), y1 = std::min(y0 + kTileSize, mHeight);
+    const Float4 lane_offsets(0.5f, 1.5f, 2.5f, 3.5f);
+    const Float4 zero(0.0f);
+    int tile = tile_y * mTilesX + tile_x;
+
+    for(size_t t = 0; t < mSetupTasks.size(); t++) {
+        const SetupTask& task = mSetupTasks[t];
+        for(uint32_t index: task.bins[tile]) {
+            const RasterTriangle& tri = task.triangles[index];
+            uint32_t id = uint32_t(t) << 24 | index;
+            // four pixels at a time, from a multiple of four inside the tile
+            int rx0 = std::max(tri.xmin, x0) & ~3, rx1 = std::min(tri.xmax, x1 - 1);
+            int ry0 = std::max(tri.ymin, y0), ry1 = std::min(tri.ymax, y1 - 1);
+            Float4 a[3] = { tri.a[0], tri.a[1], tri.a[2] };
+            Mask4 owned[3];
+            for(int i = 0; i < 3; i++) {
+                owned[i] = (tri.owned >> i & 1) ? Float4(0.0f) == zero : Float4(1.0f) == zero;
+            }
+            for(int y = ry0; y <= ry1; y++) {
+                float py = y + 0.5f;
+                Float4 row[3] = { tri.b[0] * py + tri.c[0], tri.b[1] * py + tri.c[1], tri.b[2] * py + tri.c[2] };
+                Float4 z_row = tri.zb * py + tri.zc;
+                float* depth_row = depth.data() + (y - y0) * kTileSize;
+                uint32_t* id_row = ids.data() + (y - y0) * kTileSize;
+                for(int x = rx0; x <= rx1; x += 4) {
+                    Float4 px = Float4(float(x)) + lane_offsets;
+                    Mask4 inside = Float4(1.0f) == Float4(1.0f);
+                    for(int i = 0; i < 3; i++) {
+                        Float4 e = a[i] * px + row[i];
+                        inside = inside & ((e > zero) | ((e == zero) & owned[i]));
+                    }
+                    if(!inside.any())
+                        continue;
+                    Float4 z = Float4(tri.za) * px + z_row;
+                    Float4 d = Float4::load(depth_row + (x - x0));
+                    Mask4 visible = inside & (z >= zero) & (z < d);
+                    if(!visible.any())
+                        continue;
+                    select(visible, z, d).store(depth_row + (x - x0));
+                    store_masked(id_row + (x - x0), visible, id);
+                }
+            }
+        }
+    }
+
+    // Shading of the covered pixels
+    thread_local PixelBlock block;
+    block.pixels.clear();
+    for(int y = y0; y < y1; y++) {
+        for(int x = x0; x < x1; x++) {
+            int p = (y - y0) * kTileSize + (x - x0);
+            uint32_t id = ids[p];
+            if(id == kNoTriangle)
+                continue;
+            const SetupTask& task = mSetupTasks[id >> 24];
+            const RasterTriangle& tri = task.triangles[id & 0xffffff];
+            const TriangleAttributes& attr = task.attributes[id & 0xffffff];
+            // perspective correct barycentric coordinates
+            float px = x + 0.5f, py = y + 0.5f;
+            float w[3], sum = 0.0f;
+            for(int i = 0; i < 3; i++) {
+                w[i] = (tri.a[i] * px + tri.b[i] * py + tri.c[i]) * attr.inv_w[i];
+                sum += w[i];
+            }
+            glm::vec3 position(0.0f), normal(0.0f);
+            for(int i = 0; i < 3; i++) {
+                position += (w[i] / sum) * attr.position[i];
+                normal += (w[i] / sum) * glm::vec3(attr.normal[i]);
+            }
+            block.add(p, position, normal, attr.albedo);
+        }
+    }
+    shadePixels(block);
+    writeTile(block, depth.data(), tile_x, tile_y, slot);
+}
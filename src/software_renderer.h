@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "cpu_renderer.h"
+
+// Rasterizes the scene on the CPU. Every view goes through three parallel
+// stages:
+//  - vertices of the visible TriangleMesh objects are transformed to clip
+//    and view space,
+//  - triangles are clipped, set up for rasterization and binned into the
+//    screen tiles they overlap,
+//  - tiles are rasterized four pixels at a time with SIMD edge functions
+//    and depth test, keeping the nearest triangle of every pixel, and then
+//    shaded, again four pixels at a time.
+class SoftwareRenderer: public CPURenderer {
+public:
+    // num_threads 0: one per core
+    SoftwareRenderer(const std::string& output_dir, int width, int height,
+        int num_writers = 2, int num_threads = 0);
+    SoftwareRenderer(Scene* scene, const std::string& output_dir,
+        int num_writers = 2, int num_threads = 0);
+private:
+    // Vertex after transformation: clip space position, view space
+    // position and the normal as written by the phong vertex shader
+    struct ClipVertex {
+        glm::vec4 clip;
+        glm::vec3 position;
+        glm::vec4 normal;
+    };
+    // Edge functions of a triangle in window coordinates, scaled to give
+    // the barycentric coordinates of the vertices, and the depth plane
+    struct RasterTriangle {
+        float a[3], b[3], c[3];     // barycentric i = a[i] * x + b[i] * y + c[i]
+        float za, zb, zc;           // window depth = za * x + zb * y + zc
+        int xmin, ymin, xmax, ymax; // pixels covered by the bounds, inclusive
+        int owned;                  // bit i: pixels exactly on edge i are inside
+    };
+    // Perspective correct interpolation of the vertex outputs
+    struct TriangleAttributes {
+        float inv_w[3];
+        glm::vec3 position[3];
+        glm::vec4 normal[3];
+        glm::vec3 albedo;
+    };
+    // Triangles set up by one task, with their indices per tile. Triangle
+    // ids in the tile buffers are the task index in the high 8 bits and the
+    // index in the task below. A task covers a range of the triangles of
+    // all visible meshes, one after the other.
+    struct SetupTask {
+        size_t first_triangle, num_triangles;
+        std::vector<RasterTriangle> triangles;
+        std::vector<TriangleAttributes> attributes;
+        std::vector<std::vector<uint32_t>> bins;
+    };
+    static const int kMaxSetupTasks = 256;
+
+    std::vector<const TriangleMesh*> mMeshes;       // visible meshes of the view
+    std::vector<size_t> mMeshTriangles;             // first triangle of each, and the total
+    std::vector<std::vector<ClipVertex>> mVertices; // per visible mesh
+    std::vector<SetupTask> mSetupTasks;
+
+    void drawView(const Camera* camera, FrameSlot& slot) override;
+    void transformVertices(size_t mesh, size_t first, size_t count);
+    void setupTriangles(SetupTask& task);
+    void addTriangle(SetupTask& task, const ClipVertex* v[3], const glm::vec3& albedo);
+    void renderTile(int tile_x, int tile_y, FrameSlot& slot);
+};
@@ -0,0 +1,185 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <npy/npy.hpp>
+
+#include "stacked_output.h"
+
+namespace {
+
+const char* dtype_name(const std::string& dtype)
+{
+    if(dtype == "|u1")
+        return "uint8";
+    if(dtype == "<u2")
+        return "uint16";
+    return dtype == "<f2" ? "float16" : "float32";
+}
+
+}
+
+StackedOutput::StackedOutput(const std::string& dir, int num_frames, int width, int height,
+    const OutputFormat& format)
+    : mDir(dir), mNumFrames(num_frames), mWidth(width), mHeight(height)
+{
+    size_t pixels = size_t(width) * height;
+    for(int c = 0; c < OutputFormat::NUM_CHANNELS; c++) {
+        if(!format[c].enabled)
+            continue;
+        Channel channel;
+        channel.name = OutputFormat::channelName(c);
+        channel.dtype = format[c].dtype();
+        channel.source = c;
+        channel.components = format[c].components;
+        channel.frame_bytes = pixels * format[c].pixelBytes();
+        channel.fd = -1;
+        mChannels.push_back(channel);
+    }
+    if(format[OutputFormat::COLOR].enabled) {
+        Channel channel;
+        channel.name = "color_ldr";
+        channel.dtype = "|u1";
+        channel.source = -1;
+        channel.components = 4;
+        channel.frame_bytes = pixels * 4;
+        channel.fd = -1;
+        mChannels.push_back(channel);
+    }
+    for(auto& channel: mChannels) {
+        openChannel(channel);
+    }
+}
+
+StackedOutput::~StackedOutput()
+{
+    for(auto& channel: mChannels) {
+        if(channel.fd >= 0)
+            close(channel.fd);
+    }
+}
+
+void StackedOutput::openChannel(Channel& channel)
+{
+    std::vector<npy::ndarray_len_t> shape = {
+        npy::ndarray_len_t(mNumFrames), npy::ndarray_len_t(mHeight), npy::ndarray_len_t(mWidth) };
+    if(channel.components > 1)
+        shape.push_back(channel.components);
+    std::ostringstream ss;
+    npy::write_header(ss, channel.dtype, false, shape);
+    std::string header = ss.str();
+    channel.header_size = header.size();
+    off_t file_size = off_t(header.size() + channel.frame_bytes * mNumFrames);
+
+    std::string path = mDir + channel.name + ".npy";
+    channel.fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(channel.fd < 0) {
+        throw std::runtime_error("Unable to open " + path + ": " + strerror(errno));
+    }
+
+    // keep the frames of an existing container of the same shape
+    std::string existing(header.size(), '\0');
+    bool reuse = pread(channel.fd, &existing[0], existing.size(), 0) == ssize_t(existing.size()) &&
+        existing == header && lseek(channel.fd, 0, SEEK_END) == file_size;
+    if(!reuse) {
+        // sparse until the frames are written
+        if(ftruncate(channel.fd, 0) != 0 || ftruncate(channel.fd, file_size) != 0 ||
+           pwrite(channel.fd, header.data(), header.size(), 0) != ssize_t(header.size())) {
+            throw std::runtime_error("Unable to create " + path + ": " + strerror(errno));
+        }
+    }
+}
+
+void StackedOutput::addFrame(int index, const std::string& prefix, const Json::Value& camera)
+{
+    mFrameIndex[prefix] = index;
+    Frame& frame = mFrames[index];
+    frame.name = prefix.substr(mDir.size());
+    frame.camera = camera;
+}
+
+void StackedOutput::writeChannel(const Channel& channel, int index, const void* data) const
+{
+    const char* p = static_cast<const char*>(data);
+    size_t done = 0;
+    off_t offset = off_t(channel.header_size + channel.frame_bytes * index);
+    while(done < channel.frame_bytes) {
+        ssize_t n = pwrite(channel.fd, p + done, channel.frame_bytes - done, offset + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            throw std::runtime_error("io error: failed to write " + channel.name + ".npy: " + strerror(errno));
+        }
+        done += n;
+    }
+}
+
+size_t StackedOutput::write(const std::string& prefix, int width, int height,
+    const void* const* data, const unsigned char* ldr)
+{
+    auto it = mFrameIndex.find(prefix);
+    if(it == mFrameIndex.end() || width != mWidth || height != mHeight) {
+        throw std::runtime_error("frame " + prefix + " is not part of the stacked output");
+    }
+    size_t bytes = 0;
+    for(auto& channel: mChannels) {
+        writeChannel(channel, it->second, channel.source >= 0 ? data[channel.source] : ldr);
+        bytes += channel.frame_bytes;
+    }
+    return bytes;
+}
+
+void StackedOutput::writeIndex() const
+{
+    Json::Value index;
+    index["num_frames"] = mNumFrames;
+    index["width"] = mWidth;
+    index["height"] = mHeight;
+    for(auto& channel: mChannels) {
+        Json::Value& spec = index["channels"][channel.name];
+        spec["file"] = channel.name + ".npy";
+        spec["dtype"] = dtype_name(channel.dtype);
+        spec["shape"].append(mNumFrames);
+        spec["shape"].append(mHeight);
+        spec["shape"].append(mWidth);
+        if(channel.components > 1)
+            spec["shape"].append(channel.components);
+        spec["offset"] = Json::UInt64(channel.header_size);
+        spec["frame_bytes"] = Json::UInt64(channel.frame_bytes);
+        spec["row_order"] = channel.source < 0 ? "top_down" : "bottom_up";
+    }
+    Json::Value& frames = index["frames"];
+    frames = Json::Value(Json::arrayValue);
+    for(auto& it: mFrames) {
+        Json::Value frame;
+        frame["index"] = it.first;
+        frame["name"] = it.second.name;
+        frame["camera"] = it.second.camera;
+        frames.append(frame);
+    }
+
+    // written to a temporary file first, readers never see a partial index
+    std::string path = mDir + "index.json";
+    std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream out(tmp_path);
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = " ";
+        out << Json::writeString(builder, index) << std::endl;
+        if(!out) {
+            std::cout << "Error: unable to write " << tmp_path << std::endl;
+            return;
+        }
+    }
+    if(rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cout << "Error: unable to write " << path << std::endl;
+    }
+}
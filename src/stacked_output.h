@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <json/json.h>
+
+#include "output_format.h"
+
+// All frames of a trajectory in a few memory mappable files instead of
+// seven files per frame. In the output directory:
+//
+//   color.npy, position.npy, normal.npy  [N, H, W, C] as configured by the
+//                                        OutputFormat, rows bottom-up
+//   depth.npy                            [N, H, W] if enabled, rows bottom-up
+//   color_ldr.npy                        [N, H, W, 4] uint8 tonemapped color,
+//                                        rows top-down like the PNG files
+//   index.json                           shapes, byte offsets of the frame
+//                                        data, frame names and cameras
+//
+// Disabled channels have no file.
+//
+// The files are created at full size up front and frames are written at
+// their offset, so writer threads and worker processes can fill in frames
+// in any order. An existing container of the same shape is reused rather
+// than truncated, which lets separate --shard runs fill one container.
+class StackedOutput {
+public:
+    // dir is empty or ends with '/'. Throws std::runtime_error if a file
+    // cannot be created.
+    StackedOutput(const std::string& dir, int num_frames, int width, int height,
+        const OutputFormat& format = OutputFormat());
+    ~StackedOutput();
+
+    // Register a frame before it is rendered. prefix is the output prefix
+    // the renderer uses for the frame (output directory + name).
+    void addFrame(int index, const std::string& prefix, const Json::Value& camera);
+
+    // Write a rendered frame, called from the writer threads. data holds
+    // the channels laid out as given by the OutputFormat, ldr the tonemapped
+    // color. Returns the number of bytes written.
+    size_t write(const std::string& prefix, int width, int height,
+        const void* const* data, const unsigned char* ldr);
+
+    // Write index.json
+    void writeIndex() const;
+private:
+    struct Channel {
+        std::string name;
+        std::string dtype;      // numpy type string
+        int source;             // OutputFormat channel, -1 for color_ldr
+        int components;
+        int fd;
+        size_t header_size;
+        size_t frame_bytes;
+    };
+    struct Frame {
+        std::string name;
+        Json::Value camera;
+    };
+    std::string mDir;
+    int mNumFrames, mWidth, mHeight;
+    std::vector<Channel> mChannels;
+    // Registered frames by output prefix and by index. Filled in before
+    // rendering, read only while frames are written.
+    std::map<std::string, int> mFrameIndex;
+    std::map<int, Frame> mFrames;
+
+    void openChannel(Channel& channel);
+    void writeChannel(const Channel& channel, int index, const void* data) const;
+};
@@ -0,0 +1,55 @@
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+#include "tonemap.h"
+
+Tonemap Tonemap::fromJson(const Json::Value& tonemap_spec)
+{
+    Tonemap tonemap;
+    if(tonemap_spec.isNull())
+        return tonemap;
+
+    std::string type = tonemap_spec["type"].asString();
+    if(type == "gamma") {
+        tonemap.type = GAMMA;
+        const Json::Value& gamma = tonemap_spec["gamma"];
+        tonemap.gamma = gamma.isArray() ? gamma[0].asFloat() : gamma.asFloat();
+        if(tonemap.gamma <= 0.0f) {
+            std::cout << "Warning: invalid tonemap gamma " << tonemap.gamma << ", using 1.0" << std::endl;
+            tonemap.gamma = 1.0f;
+        }
+    } else if(!type.empty() && type != "none") {
+        std::cout << "Warning: unsupported tonemap type " << type << std::endl;
+    }
+    return tonemap;
+}
+
+TonemapKernel::TonemapKernel(const Tonemap& tonemap): mLUT(kLUTSize)
+{
+    float gamma = (tonemap.type == Tonemap::GAMMA) ? tonemap.gamma : 1.0f;
+    for(int i = 0; i < kLUTSize; i++) {
+        float x = i / float(kLUTSize - 1);
+        mLUT[i] = static_cast<unsigned char>(std::pow(x, gamma) * 255.0f + 0.5f);
+    }
+}
+
+void TonemapKernel::apply(const float* src, unsigned char* dst, int width, int height) const
+{
+    const float lut_scale = float(kLUTSize - 1);
+    const unsigned char* lut = mLUT.data();
+    for(int y = 0; y < height; y++) {
+        // flip vertically: OpenGL rows start at the bottom
+        const float* __restrict__ in = src + size_t(height - 1 - y) * width * 4;
+        unsigned char* __restrict__ out = dst + size_t(y) * width * 4;
+        // max(0, v) first so that NaNs map to 0
+        for(int x = 0; x < width * 4; x += 4) {
+            for(int c = 0; c < 3; c++) {
+                float v = std::min(std::max(0.0f, in[x + c]), 1.0f);
+                out[x + c] = lut[static_cast<int>(v * lut_scale + 0.5f)];
+            }
+            float a = std::min(std::max(0.0f, in[x + 3]), 1.0f);
+            out[x + 3] = static_cast<unsigned char>(a * 255.0f + 0.5f);
+        }
+    }
+}
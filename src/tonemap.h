@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <json/json.h>
+
+// Tone mapping applied when converting the float color attachment to the
+// 8-bit PNG. Mirrors the "tonemap" scene key, e.g.
+//   "tonemap": {"type": "gamma", "gamma": [0.8]}
+struct Tonemap {
+    enum Type { NONE = 0, GAMMA };
+
+    Type type;
+    float gamma;
+
+    Tonemap(): type(NONE), gamma(1.0f) {}
+
+    static Tonemap fromJson(const Json::Value& tonemap_spec);
+};
+
+// Converts a bottom-up RGBA float image (as returned by glReadPixels) into a
+// top-down RGBA8 image. Color channels are clamped to [0, 1] and passed
+// through the tone curve, alpha is only clamped. The gamma curve is evaluated
+// through a lookup table so the per-pixel work is a clamp, a multiply and a
+// table fetch.
+class TonemapKernel {
+public:
+    TonemapKernel(const Tonemap& tonemap = Tonemap());
+
+    void apply(const float* src, unsigned char* dst, int width, int height) const;
+private:
+    static const int kLUTSize = 16384;
+    std::vector<unsigned char> mLUT;
+};
@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cassert>
+
+#include "triangle_bvh.h"
+#include "Float4.hpp"
+
+namespace {
+
+float surface_area(const AABB& box)
+{
+    if(box.empty())
+        return 0.0f;
+    glm::vec3 d = box.max - box.min;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Stack of nodes to visit with the entry distance of their box
+struct StackEntry {
+    int32_t node;
+    float t;
+};
+// Entries on the stack of intersect() for trees of common depths, deeper
+// ones use a larger stack on the heap
+const int kMaxStackSize = 256;
+
+}
+
+const int TriangleBVH::kMaxLeafSize;
+const int TriangleBVH::kNumBins;
+
+void TriangleBVH::build(const std::vector<glm::vec3>& vertices)
+{
+    mNodes.clear();
+    mLeaves.clear();
+    mDepth = 0;
+    mNumTriangles = vertices.size() / 3;
+    if(mNumTriangles == 0)
+        return;
+
+    BuildState state;
+    state.vertices = &vertices;
+    state.boxes.resize(mNumTriangles);
+    state.centroids.resize(mNumTriangles);
+    state.order.resize(mNumTriangles);
+    for(size_t i = 0; i < mNumTriangles; i++) {
+        AABB& box = state.boxes[i];
+        for(int k = 0; k < 3; k++) {
+            box.extend(vertices[3 * i + k]);
+        }
+        state.centroids[i] = box.center();
+        state.order[i] = i;
+    }
+    state.nodes.reserve(2 * mNumTriangles / kMaxLeafSize + 1);
+    buildNode(state, 0, mNumTriangles);
+
+    mNodes.reserve(state.nodes.size() / 3 + 1);
+    mLeaves.reserve(state.nodes.size() / 2 + 1);
+    collapse(state, 0, 1);
+}
+
+int TriangleBVH::buildNode(BuildState& state, int first, int count)
+{
+    int node_idx = state.nodes.size();
+    state.nodes.push_back(BuildNode());
+    AABB bounds, centroid_bounds;
+    for(int i = first; i < first + count; i++) {
+        bounds.extend(state.boxes[state.order[i]]);
+        centroid_bounds.extend(state.centroids[state.order[i]]);
+    }
+    state.nodes[node_idx].bounds = bounds;
+    state.nodes[node_idx].left = state.nodes[node_idx].right = -1;
+    state.nodes[node_idx].first = first;
+    state.nodes[node_idx].count = count;
+    if(count <= kMaxLeafSize)
+        return node_idx;
+
+    // Cheapest split between bins of the centroids along any axis, with the
+    // cost of a side its triangle count times its surface area
+    int best_axis = -1, best_split = 0;
+    float best_cost = std::numeric_limits<float>::max();
+    for(int axis = 0; axis < 3; axis++) {
+        float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+        if(!(extent > 0.0f))
+            continue;
+        float scale = kNumBins / extent;
+        AABB bin_bounds[kNumBins];
+        int bin_counts[kNumBins] = { 0 };
+        for(int i = first; i < first + count; i++) {
+            uint32_t t = state.order[i];
+            int bin = std::min(kNumBins - 1, int((state.centroids[t][axis] - centroid_bounds.min[axis]) * scale));
+            bin_bounds[bin].extend(state.boxes[t]);
+            bin_counts[bin]++;
+        }
+        // area and count of bins [split, kNumBins) for every split
+        float right_areas[kNumBins];
+        int right_counts[kNumBins];
+        AABB right;
+        int right_count = 0;
+        for(int split = kNumBins - 1; split > 0; split--) {
+            right.extend(bin_bounds[split]);
+            right_count += bin_counts[split];
+            right_areas[split] = surface_area(right);
+            right_counts[split] = right_count;
+        }
+        AABB left;
+        int left_count = 0;
+        for(int split = 1; split < kNumBins; split++) {
+            left.extend(bin_bounds[split - 1]);
+            left_count += bin_counts[split - 1];
+            if(left_count == 0 || right_counts[split] == 0)
+                continue;
+            float cost = left_count * surface_area(left) + right_counts[split] * right_areas[split];
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = split;
+            }
+        }
+    }
+
+    int middle;
+    if(best_axis < 0) {
+        // all centroids in one point
+        middle = first + count / 2;
+    } else {
+        float scale = kNumBins / (centroid_bounds.max[best_axis] - centroid_bounds.min[best_axis]);
+        float min = centroid_bounds.min[best_axis];
+        auto it = std::partition(state.order.begin() + first, state.order.begin() + first + count,
+            [&](uint32_t t) {
+                int bin = std::min(kNumBins - 1, int((state.centroids[t][best_axis] - min) * scale));
+                return bin < best_split;
+            });
+        middle = it - state.order.begin();
+    }
+
+    int left = buildNode(state, first, middle - first);
+    int right = buildNode(state, middle, first + count - middle);
+    state.nodes[node_idx].left = left;
+    state.nodes[node_idx].right = right;
+    return node_idx;
+}
+
+int TriangleBVH::collapse(const BuildState& state, int build_node, int depth)
+{
+    mDepth = std::max(mDepth, depth);
+    // Open the inner child with the largest surface area until there are
+    // four children or only leaves
+    int children[4];
+    int num_children = 0;
+    const BuildNode& root = state.nodes[build_node];
+    if(root.left < 0) {
+        children[num_children++] = build_node;
+    } else {
+        children[num_children++] = root.left;
+        children[num_children++] = root.right;
+    }
+    while(num_children < 4) {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for(int i = 0; i < num_children; i++) {
+            const BuildNode& child = state.nodes[children[i]];
+            float area = surface_area(child.bounds);
+            if(child.left >= 0 && area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if(largest < 0)
+            break;
+        const BuildNode& opened = state.nodes[children[largest]];
+        children[largest] = opened.left;
+        children[num_children++] = opened.right;
+    }
+
+    int node_idx = mNodes.size();
+    mNodes.push_back(Node());
+    for(int i = 0; i < 4; i++) {
+        AABB bounds;
+        int32_t child = ~int32_t(0);
+        if(i < num_children) {
+            const BuildNode& b = state.nodes[children[i]];
+            bounds = b.bounds;
+            child = b.left < 0 ? addLeaf(state, b) : collapse(state, children[i], depth + 1);
+        }
+        Node& node = mNodes[node_idx];
+        for(int k = 0; k < 3; k++) {
+            node.bounds[k][i] = bounds.min[k];
+            node.bounds[3 + k][i] = bounds.max[k];
+        }
+        node.children[i] = child;
+    }
+    return node_idx;
+}
+
+int32_t TriangleBVH::addLeaf(const BuildState& state, const BuildNode& node)
+{
+    Leaf leaf;
+    for(int i = 0; i < 4; i++) {
+        glm::vec3 v0(0.0f), e1(0.0f), e2(0.0f);
+        uint32_t triangle = 0;
+        if(i < node.count) {
+            triangle = state.order[node.first + i];
+            const glm::vec3* v = &(*state.vertices)[3 * triangle];
+            v0 = v[0];
+            e1 = v[1] - v[0];
+            e2 = v[2] - v[0];
+        }
+        for(int k = 0; k < 3; k++) {
+            leaf.v0[k][i] = v0[k];
+            leaf.e1[k][i] = e1[k];
+            leaf.e2[k][i] = e2[k];
+        }
+        leaf.triangles[i] = triangle;
+    }
+    mLeaves.push_back(leaf);
+    return ~int32_t(mLeaves.size() - 1);
+}
+
+bool TriangleBVH::intersect(const Ray& ray, RayHit& hit) const
+{
+    if(mNodes.empty())
+        return false;
+
+    // avoid 0 * inf in the slab tests of rays parallel to an axis
+    glm::vec3 dir = ray.direction;
+    for(int k = 0; k < 3; k++) {
+        if(std::abs(dir[k]) < 1e-20f)
+            dir[k] = std::copysign(1e-20f, dir[k]);
+    }
+    Float4 origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    Float4 direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+    Float4 inv_dir[3] = { 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z };
+    // the near and far planes of each axis
+    int near_plane[3], far_plane[3];
+    for(int k = 0; k < 3; k++) {
+        near_plane[k] = dir[k] >= 0.0f ? k : 3 + k;
+        far_plane[k] = dir[k] >= 0.0f ? 3 + k : k;
+    }
+    const Float4 ray_tmin(ray.tmin), zero(0.0f), one(1.0f);
+    float best_t = ray.tmax;
+    bool found = false;
+
+    // Every level on the path to the visited node leaves at most three
+    // siblings on the stack, the last one pushes up to four children
+    int max_stack_size = 3 * mDepth + 1;
+    StackEntry local_stack[kMaxStackSize];
+    thread_local std::vector<StackEntry> heap_stack;
+    StackEntry* stack = local_stack;
+    if(max_stack_size > kMaxStackSize) {
+        heap_stack.resize(max_stack_size);
+        stack = heap_stack.data();
+    }
+    int stack_size = 0;
+    stack[stack_size++] = StackEntry{ 0, ray.tmin };
+    while(stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if(entry.t > best_t)
+            continue;
+
+        if(entry.node >= 0) {
+            const Node& node = mNodes[entry.node];
+            Float4 tnear = ray_tmin, tfar(best_t);
+            for(int k = 0; k < 3; k++) {
+                tnear = max(tnear, (Float4::load(node.bounds[near_plane[k]]) - origin[k]) * inv_dir[k]);
+                tfar = min(tfar, (Float4::load(node.bounds[far_plane[k]]) - origin[k]) * inv_dir[k]);
+            }
+            int mask = (tnear <= tfar).bits();
+            if(!mask)
+                continue;
+            float t[4];
+            tnear.store(t);
+            // push the hit children far to near, the nearest is visited first
+            StackEntry hits[4];
+            int num_hits = 0;
+            for(int i = 0; i < 4; i++) {
+                if(!(mask >> i & 1))
+                    continue;
+                StackEntry child = { node.children[i], t[i] };
+                int j = num_hits++;
+                for(; j > 0 && hits[j - 1].t < child.t; j--) {
+                    hits[j] = hits[j - 1];
+                }
+                hits[j] = child;
+            }
+            assert(stack_size + num_hits <= max_stack_size);
+            for(int i = 0; i < num_hits; i++) {
+                stack[stack_size++] = hits[i];
+            }
+            continue;
+        }
+
+        // Moeller-Trumbore against the four triangles of the leaf
+        const Leaf& leaf = mLeaves[~entry.node];
+        Float4 e1[3] = { Float4::load(leaf.e1[0]), Float4::load(leaf.e1[1]), Float4::load(leaf.e1[2]) };
+        Float4 e2[3] = { Float4::load(leaf.e2[0]), Float4::load(leaf.e2[1]), Float4::load(leaf.e2[2]) };
+        Float4 p[3] = {
+            direction[1] * e2[2] - direction[2] * e2[1],
+            direction[2] * e2[0] - direction[0] * e2[2],
+            direction[0] * e2[1] - direction[1] * e2[0] };
+        Float4 det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+        Float4 inv_det = one / det;
+        Float4 s[3] = {
+            origin[0] - Float4::load(leaf.v0[0]),
+            origin[1] - Float4::load(leaf.v0[1]),
+            origin[2] - Float4::load(leaf.v0[2]) };
+        Float4 u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+        Float4 q[3] = {
+            s[1] * e1[2] - s[2] * e1[1],
+            s[2] * e1[0] - s[0] * e1[2],
+            s[0] * e1[1] - s[1] * e1[0] };
+        Float4 v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * inv_det;
+        Float4 t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+        // degenerate triangles give NaN and fail every comparison
+        int mask = ((u >= zero) & (v >= zero) & (u + v <= one) & (t >= ray_tmin) & (t <= Float4(best_t))).bits();
+        if(!mask)
+            continue;
+        float ts[4], us[4], vs[4];
+        t.store(ts);
+        u.store(us);
+        v.store(vs);
+        for(int i = 0; i < 4; i++) {
+            if((mask >> i & 1) && ts[i] <= best_t) {
+                best_t = ts[i];
+                hit.t = ts[i];
+                hit.u = us[i];
+                hit.v = vs[i];
+                hit.triangle = leaf.triangles[i];
+                found = true;
+            }
+        }
+    }
+    return found;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "bvh.h"
+
+// Ray segment origin + t * direction, t in [tmin, tmax]
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float tmin, tmax;
+};
+
+struct RayHit {
+    float t;
+    // barycentric coordinates of the second and third vertex
+    float u, v;
+    uint32_t triangle;  // index in the build() input
+};
+
+// Four wide bounding volume hierarchy over triangles, for ray casting. Built
+// as a binary tree with the surface area heuristic over binned centroids,
+// which is then collapsed into nodes of four children. A ray is tested
+// against the four child boxes of a node, and against the up to four
+// triangles of a leaf, at a time. Triangles are two sided.
+class TriangleBVH {
+public:
+    TriangleBVH(): mNumTriangles(0), mDepth(0) {}
+
+    // Three vertices per triangle
+    void build(const std::vector<glm::vec3>& vertices);
+
+    // Nearest hit within the ray segment
+    bool intersect(const Ray& ray, RayHit& hit) const;
+
+    size_t getNumTriangles() const { return mNumTriangles; }
+    size_t getNumNodes() const { return mNodes.size(); }
+    // Levels of nodes on the longest path from the root
+    int getDepth() const { return mDepth; }
+private:
+    static const int kMaxLeafSize = 4;
+    static const int kNumBins = 16;
+
+    // Child boxes as minimum x, y, z and maximum x, y, z of the four
+    // children. Children >= 0 are nodes, ~child of negative ones are leaves.
+    // Unused children have empty boxes.
+    struct Node {
+        float bounds[6][4];
+        int32_t children[4];
+    };
+    // First vertex and the two edges from it, unused lanes are degenerate
+    struct Leaf {
+        float v0[3][4];
+        float e1[3][4];
+        float e2[3][4];
+        uint32_t triangles[4];
+    };
+    std::vector<Node> mNodes;
+    std::vector<Leaf> mLeaves;
+    size_t mNumTriangles;
+    int mDepth;
+
+    // Binary tree of the build
+    struct BuildNode {
+        AABB bounds;
+        int left, right;    // children, -1 for leaves
+        int first, count;   // range in the build order for leaves
+    };
+    struct BuildState {
+        const std::vector<glm::vec3>* vertices;
+        std::vector<AABB> boxes;
+        std::vector<glm::vec3> centroids;
+        std::vector<uint32_t> order;
+        std::vector<BuildNode> nodes;
+    };
+
+    int buildNode(BuildState& state, int first, int count);
+    int collapse(const BuildState& state, int build_node, int depth);
+    int32_t addLeaf(const BuildState& state, const BuildNode& node);
+};
@@ -1,6 +1,10 @@
 #include "utils.h"
 #include <glm/glm.hpp>
 #include <iostream>
+#include <algorithm>
+
+#include <dirent.h>
+#include <sys/stat.h>
 
 
 std::string get_basedir(const std::string& filename)
@@ -12,6 +16,51 @@ std::string get_basedir(const std::string& filename)
     return "";
 }
 
+bool ends_with(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() &&
+        str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t h)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool is_directory(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+std::vector<std::string> list_files(const std::string& dir, const std::string& extension)
+{
+    std::vector<std::string> files;
+    DIR* d = opendir(dir.c_str());
+    if(d == nullptr)
+        return files;
+    while(struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if(name == "." || name == "..")
+            continue;
+        std::string path = dir + "/" + name;
+        if(is_directory(path)) {
+            std::vector<std::string> sub = list_files(path, extension);
+            files.insert(files.end(), sub.begin(), sub.end());
+        } else if(ends_with(name, extension)) {
+            files.push_back(path);
+        }
+    }
+    closedir(d);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
 void print_mat(const glm::mat4& m) {
     for(int i = 0; i < 4; i++) {
         for(int j = 0; j < 4; j++) {
@@ -19,4 +68,9 @@ void print_mat(const glm::mat4& m) {
         }
         std::cout << std::endl;
     }    
-}
\ No newline at end of file
+}
+
+glm::mat3 normal_matrix(const glm::mat4& model)
+{
+    return glm::transpose(glm::inverse(glm::mat3(model)));
+}
@@ -1,7 +1,19 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
 #include <glm/glm.hpp>
 
+#include <vector>
+
 std::string get_basedir(const std::string& filename);
-void print_mat(const glm::mat4& m);
\ No newline at end of file
+bool ends_with(const std::string& str, const std::string& suffix);
+bool is_directory(const std::string& path);
+// Paths of all files under dir (recursively) whose name ends with extension
+std::vector<std::string> list_files(const std::string& dir, const std::string& extension);
+// 64-bit FNV-1a, pass the previous result as h to hash several buffers
+uint64_t hash_bytes(const void* data, size_t size, uint64_t h = 14695981039346656037ULL);
+void print_mat(const glm::mat4& m);
+// Transform of the normals of an object with this model matrix: the
+// inverse transpose of its upper 3x3
+glm::mat3 normal_matrix(const glm::mat4& model);